@@ -0,0 +1,262 @@
+#include "ClothWorld.h"
+#include "Checkpoint.h"
+
+#include <cstring>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static uint64_t section_end( uint64_t offset, uint64_t bytes )
+{
+	return ( offset + bytes + 7 ) / 8 * 8;
+}
+
+// the "count" values at "offset" in the mapping, NULL if they overrun the file;
+// sections start on multiples of 8, so the pointer is aligned
+template <class T>
+static const T *section( const char *pData, uint64_t size, uint64_t offset, uint64_t count )
+{
+	if ( offset > size || count * sizeof( T ) > size - offset )
+		return NULL;
+	return ( const T* )( pData + offset );
+}
+
+// copies "count" values at "offset" into "out", false if they overrun the file
+template <class T>
+static bool read_section( const char *pData, uint64_t size, uint64_t offset, uint64_t count, T *out )
+{
+	if ( offset > size || count * sizeof( T ) > size - offset )
+		return false;
+	if ( count > 0 )
+		memcpy( out, pData + offset, count * sizeof( T ) );
+	return true;
+}
+
+template <class P>
+bool ClothWorldT<P>::save_checkpoint( const char *fileName ) const
+{
+	const int size = pVector.size(), forces = pNonconstraintForceVector.size();
+	const SleepManager &sleep = sleepManager;
+	const int patches = sleep.m_Enabled ? sleep.m_PatchAsleep.size() : 0;
+
+	CheckpointHeader header;
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, CHECKPOINT_MAGIC, sizeof( header.magic ) );
+	header.version = CHECKPOINT_VERSION;
+	header.scalar_bytes = sizeof( Real );
+	header.particles = size;
+	header.forces = forces;
+	header.pinned = pinnedVector.size();
+	header.patches = patches;
+	header.sleep_enabled = sleep.m_Enabled;
+	header.sleep_steps = sleep.m_SleepSteps;
+	header.sleep_energy = sleep.m_SleepEnergy;
+	header.wake_energy = sleep.m_WakeEnergy;
+	header.step = m_StepCount;
+	for ( int k = 0; k < 3; k++ )
+		header.gravity[k] = m_Gravity[k];
+	header.particle_offset = section_end( 0, sizeof( header ) );
+	header.force_offset = section_end( header.particle_offset, 9 * (uint64_t)size * sizeof( Real ) );
+	header.pinned_offset = section_end( header.force_offset, forces * sizeof( CheckpointForce ) );
+	header.sleep_offset = section_end( header.pinned_offset, header.pinned * sizeof( int32_t ) );
+	uint64_t sleep_bytes = 0;
+	if ( sleep.m_Enabled )
+		sleep_bytes = size * ( sizeof( int32_t ) + 4 * sizeof( float ) ) + patches * ( sizeof( float ) + sizeof( int32_t ) + 1 );
+	header.size = section_end( header.sleep_offset, sleep_bytes );
+
+	// the file is assembled in memory and written at once
+	std::vector<char> image( header.size, 0 );
+	memcpy( &image[0], &header, sizeof( header ) );
+
+	Real *particle = ( Real* )&image[ header.particle_offset ];
+	for ( int ii = 0; ii < size; ii++, particle += 9 ) {
+		const ParticleType *pParticle = pVector[ii];
+		for ( int k = 0; k < 3; k++ ) {
+			particle[k] = pParticle->m_ConstructPos[k];
+			particle[3 + k] = pParticle->m_Position[k];
+			particle[6 + k] = pParticle->m_Velocity[k];
+		}
+	}
+
+	CheckpointForce *force = ( CheckpointForce* )&image[ header.force_offset ];
+	for ( int fi = 0; fi < forces; fi++, force++ ) {
+		NonconstraintForce *pForce = pNonconstraintForceVector[fi];
+		if ( pForce->is_spring ) {
+			SpringType *pSpring = ( SpringType* )pForce;
+			pSpring->update_index( pVector );
+			force->p1 = pSpring->index_of_p1();
+			force->p2 = pSpring->index_of_p2();
+			force->rest = pSpring->rest_length();
+			force->ks = pSpring->stiffness();
+			force->kd = pSpring->damping();
+		} else {
+			Vec3f gravity = ( ( GravityForce* )pForce )->force();
+			force->p1 = force->p2 = CHECKPOINT_GRAVITY;
+			force->rest = gravity[0];
+			force->ks = gravity[1];
+			force->kd = gravity[2];
+		}
+	}
+
+	if ( !pinnedVector.empty() )
+		memcpy( &image[ header.pinned_offset ], &pinnedVector[0], pinnedVector.size() * sizeof( int32_t ) );
+
+	if ( sleep.m_Enabled ) {
+		char *at = &image[ header.sleep_offset ];
+		memcpy( at, &sleep.m_PatchOf[0], size * sizeof( int32_t ) );
+		at += size * sizeof( int32_t );
+		memcpy( at, &sleep.m_PreviousVelocity[0], size * 3 * sizeof( float ) );
+		at += size * 3 * sizeof( float );
+		memcpy( at, &sleep.m_ParticleEnergy[0], size * sizeof( float ) );
+		at += size * sizeof( float );
+		memcpy( at, &sleep.m_PatchEnergy[0], patches * sizeof( float ) );
+		at += patches * sizeof( float );
+		memcpy( at, &sleep.m_PatchQuietSteps[0], patches * sizeof( int32_t ) );
+		at += patches * sizeof( int32_t );
+		memcpy( at, &sleep.m_PatchAsleep[0], patches );
+	}
+
+	FILE *fp = fopen( fileName, "wb" );
+	if ( !fp ) {
+		fprintf( stderr, "Cannot write checkpoint %s\n", fileName );
+		return false;
+	}
+	bool ok = fwrite( &image[0], 1, image.size(), fp ) == image.size();
+	ok = fclose( fp ) == 0 && ok;
+	if ( !ok )
+		fprintf( stderr, "Writing the checkpoint %s failed\n", fileName );
+	return ok;
+}
+
+// builds the world from the mapped checkpoint, the scalars are converted to "Real" if needed
+template <class P, class Stored>
+static bool load_particles( ClothWorldT<P> *pWorld, const char *pData, const CheckpointHeader &header )
+{
+	typedef typename ClothWorldT<P>::Vec Vec;
+	const Stored *particles = section<Stored>( pData, header.size, header.particle_offset, 9 * (uint64_t)header.particles );
+	if ( !particles )
+		return false;
+	pWorld->pVector.reserve( header.particles );
+	for ( int ii = 0; ii < header.particles; ii++ ) {
+		const Stored *particle = &particles[ 9 * ii ];
+		int index = pWorld->add_particle( Vec( particle[0], particle[1], particle[2] ) );
+		pWorld->pVector[index]->m_Position = Vec( particle[3], particle[4], particle[5] );
+		pWorld->pVector[index]->m_Velocity = Vec( particle[6], particle[7], particle[8] );
+	}
+	return true;
+}
+
+template <class P>
+bool ClothWorldT<P>::load_checkpoint( const char *fileName )
+{
+	if ( !pVector.empty() || !pNonconstraintForceVector.empty() ) {
+		fprintf( stderr, "Checkpoints load into an empty world\n" );
+		return false;
+	}
+	int fd = ::open( fileName, O_RDONLY );
+	if ( fd < 0 ) {
+		fprintf( stderr, "Cannot open checkpoint %s\n", fileName );
+		return false;
+	}
+	struct stat info;
+	if ( fstat( fd, &info ) != 0 || info.st_size < (off_t)sizeof( CheckpointHeader ) ) {
+		fprintf( stderr, "%s is not a checkpoint\n", fileName );
+		::close( fd );
+		return false;
+	}
+	void *pMapping = mmap( NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	::close( fd );
+	if ( pMapping == MAP_FAILED ) {
+		fprintf( stderr, "Cannot map checkpoint %s\n", fileName );
+		return false;
+	}
+	const char *pData = ( const char* )pMapping;
+	CheckpointHeader header;
+	memcpy( &header, pData, sizeof( header ) );
+
+	bool ok = memcmp( header.magic, CHECKPOINT_MAGIC, sizeof( CHECKPOINT_MAGIC ) ) == 0 && header.version == CHECKPOINT_VERSION
+	          && ( header.scalar_bytes == 4 || header.scalar_bytes == 8 ) && header.size <= (uint64_t)info.st_size
+	          && 9 * (uint64_t)header.particles * header.scalar_bytes <= header.size
+	          && (uint64_t)header.forces * sizeof( CheckpointForce ) <= header.size && header.patches <= header.size;
+	if ( !ok ) {
+		fprintf( stderr, "%s is not a version %u checkpoint\n", fileName, CHECKPOINT_VERSION );
+		munmap( pMapping, info.st_size );
+		return false;
+	}
+
+	if ( header.scalar_bytes == sizeof( float ) )
+		ok = load_particles<P, float>( this, pData, header );
+	else
+		ok = load_particles<P, double>( this, pData, header );
+
+	const CheckpointForce *forces = section<CheckpointForce>( pData, header.size, header.force_offset, header.forces );
+	ok = ok && forces;
+	pNonconstraintForceVector.reserve( header.forces );
+	for ( int fi = 0; ok && fi < header.forces; fi++ ) {
+		const CheckpointForce &force = forces[fi];
+		if ( force.p1 == CHECKPOINT_GRAVITY ) {
+			add_force( new GravityForce( Vec3f( force.rest, force.ks, force.kd ) ) );
+			continue;
+		}
+		ok = force.p1 < header.particles && force.p2 < header.particles;
+		if ( ok ) {
+			SpringType *pSpring = new SpringType( pVector[ force.p1 ], pVector[ force.p2 ], force.rest, force.ks, force.kd );
+			pSpring->set_index( force.p1, force.p2 );
+			add_force( pSpring );
+		}
+	}
+
+	std::vector<int32_t> pinned( header.pinned );
+	ok = ok && read_section( pData, header.size, header.pinned_offset, pinned.size(), pinned.empty() ? NULL : &pinned[0] );
+	for ( int pi = 0; ok && pi < pinned.size(); pi++ ) {
+		ok = pinned[pi] >= 0 && pinned[pi] < header.particles;
+		pin( pinned[pi] );
+	}
+
+	if ( ok && header.sleep_enabled ) {
+		const uint64_t size = header.particles, patches = header.patches;
+		std::vector<int32_t> patch_of( size );
+		uint64_t at = header.sleep_offset;
+		ok = read_section( pData, header.size, at, size, patch_of.empty() ? NULL : &patch_of[0] );
+		for ( int ii = 0; ok && ii < size; ii++ )
+			ok = patch_of[ii] >= 0 && patch_of[ii] < patches;
+		if ( ok ) {
+			// init() sizes the vectors, then the saved state overwrites them
+			sleepManager.init( std::vector<int>( patch_of.begin(), patch_of.end() ) );
+			ok = sleepManager.m_PatchAsleep.size() == patches;
+		}
+		SleepManager &sleep = sleepManager;
+		at += size * sizeof( int32_t );
+		ok = ok && read_section( pData, header.size, at, 3 * size, size ? &sleep.m_PreviousVelocity[0][0] : NULL );
+		at += 3 * size * sizeof( float );
+		ok = ok && read_section( pData, header.size, at, size, size ? &sleep.m_ParticleEnergy[0] : NULL );
+		at += size * sizeof( float );
+		ok = ok && read_section( pData, header.size, at, patches, patches ? &sleep.m_PatchEnergy[0] : NULL );
+		at += patches * sizeof( float );
+		ok = ok && read_section( pData, header.size, at, patches, patches ? &sleep.m_PatchQuietSteps[0] : NULL );
+		at += patches * sizeof( int32_t );
+		ok = ok && read_section( pData, header.size, at, patches, patches ? &sleep.m_PatchAsleep[0] : NULL );
+		sleep.m_SleepSteps = header.sleep_steps;
+		sleep.m_SleepEnergy = header.sleep_energy;
+		sleep.m_WakeEnergy = header.wake_energy;
+	}
+	munmap( pMapping, info.st_size );
+
+	if ( !ok ) {
+		fprintf( stderr, "Checkpoint %s is corrupt\n", fileName );
+		return false;
+	}
+	m_Gravity = Vec( header.gravity[0], header.gravity[1], header.gravity[2] );
+	m_StepCount = header.step;
+	m_IncidenceForceCount = -1;
+	return true;
+}
+
+template bool ClothWorldT<FloatPrecision>::save_checkpoint( const char *fileName ) const;
+template bool ClothWorldT<DoublePrecision>::save_checkpoint( const char *fileName ) const;
+template bool ClothWorldT<MixedPrecision>::save_checkpoint( const char *fileName ) const;
+template bool ClothWorldT<FloatPrecision>::load_checkpoint( const char *fileName );
+template bool ClothWorldT<DoublePrecision>::load_checkpoint( const char *fileName );
+template bool ClothWorldT<MixedPrecision>::load_checkpoint( const char *fileName );
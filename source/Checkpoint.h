@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+// Checkpoint files, written by ClothWorldT::save_checkpoint() in one write and mapped by
+// load_checkpoint(). They hold everything a step depends on: the particles, the force list in
+// solver order ( the order of the force sums ), the pinned particles, the sleep state and the
+// step count. The integrator vectors are rebuilt from the particles at the start of every step,
+// so a restored world continues bit-identically to the one that was saved. There is no random
+// number generator to save.
+//
+// Layout, native byte order, every section starts on a multiple of 8:
+//   CheckpointHeader
+//   scalar[9]        construction position, position and velocity of every particle,
+//                    float or double as scalar_bytes says, either loads into any precision
+//   CheckpointForce  every force
+//   int32            every pinned particle
+// then, if sleep_enabled:
+//   int32            patch of every particle
+//   float[3]         velocity of every particle at the last sleep update
+//   float            energy of every particle
+//   float            energy of every patch
+//   int32            quiet steps of every patch
+//   uint8            asleep flag of every patch
+
+const char CHECKPOINT_MAGIC[8] = { 'C', 'L', 'O', 'T', 'H', 'C', 'K', 'P' };
+const uint32_t CHECKPOINT_VERSION = 1;
+const uint32_t CHECKPOINT_GRAVITY = 0xffffffff;	// CheckpointForce::p1 of a gravity force
+
+struct CheckpointHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t scalar_bytes;		// 4 or 8
+	uint32_t particles;
+	uint32_t forces;
+	uint32_t pinned;
+	uint32_t patches;
+	uint32_t sleep_enabled;
+	int32_t sleep_steps;
+	float sleep_energy, wake_energy;
+	int64_t step;
+	double gravity[3];
+	uint64_t particle_offset, force_offset, pinned_offset, sleep_offset;
+	uint64_t size;				// of the whole file, a shorter file was cut off
+};
+
+struct CheckpointForce {
+	uint32_t p1, p2;			// particle indices, p1 is CHECKPOINT_GRAVITY for gravity
+	double rest, ks, kd;		// spring constants, the constant vector for gravity
+};
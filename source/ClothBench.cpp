@@ -0,0 +1,356 @@
+// ClothBench.cpp : microbenchmarks of the force pass, the integrators and ConjGrad on cloth grids.
+// Every measurement is one CSV row on stdout, so runs of different versions can be diffed and plotted.
+// With --counters every row also gets hardware counters of the benchmark thread, see PerfCounters.h.
+
+#include "ClothWorld.h"
+#include "Scene.h"
+#include "ThreadPool.h"
+#include "linearSolver.h"
+#include "PerfCounters.h"
+
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <stdlib.h>
+#include <stdio.h>
+
+const float BENCH_DT = 0.01f;
+const int CG_ITERATIONS = 20;		// every solve runs exactly this many iterations
+const int PARALLEL_CHUNK = 1024;
+
+struct BenchConfig {
+	std::vector<int> sizes, threads;
+	std::vector<std::string> benchmarks;
+	std::string label;
+	std::string parallel;		// deterministic or fast
+	double min_seconds;
+	PerfCounters *counters;		// NULL unless --counters
+};
+
+static void usage ( const char *program )
+{
+	fprintf ( stderr, "usage: %s [options]\n", program );
+	fprintf ( stderr, "\t--sizes N,N,...         grid sizes (default 20,64,256,1024)\n" );
+	fprintf ( stderr, "\t--threads T,T,...       thread counts (default 1 and every core)\n" );
+	fprintf ( stderr, "\t--benchmarks B,B,...    forces, matvec, euler, midpoint, rk4, cg (default all)\n" );
+	fprintf ( stderr, "\t--precision P           float, double or mixed (default float)\n" );
+	fprintf ( stderr, "\t--parallel MODE         deterministic or fast (default deterministic)\n" );
+	fprintf ( stderr, "\t--min-time S            seconds to repeat each measurement for (default 0.5)\n" );
+	fprintf ( stderr, "\t--label NAME            first column of every row, e.g. a version\n" );
+	fprintf ( stderr, "\t--counters              add IPC and cache miss columns from perf_event_open, filled\n" );
+	fprintf ( stderr, "\t                        for single thread rows only\n" );
+}
+
+static std::vector<std::string> split ( const std::string &list )
+{
+	std::vector<std::string> items;
+	std::stringstream in ( list );
+	std::string item;
+	while ( std::getline ( in, item, ',' ) )
+		if ( !item.empty() )
+			items.push_back ( item );
+	return items;
+}
+
+static std::vector<int> split_ints ( const std::string &list )
+{
+	std::vector<std::string> items = split ( list );
+	std::vector<int> values;
+	for ( int ii = 0; ii < items.size(); ii++ )
+		values.push_back ( atoi ( items[ii].c_str() ) );
+	return values;
+}
+
+// repeat "op" for at least min_seconds after one warm-up call, returns seconds per call;
+// "counters" ( may be NULL ) are read around the timed calls into "sample"
+template <class Op>
+static double time_per_call ( Op op, double min_seconds, int *calls, PerfCounters *counters, PerfSample *sample )
+{
+	op();
+	PerfSample begin, end;
+	if ( counters )
+		counters->read ( &begin );
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	double seconds = 0.0;
+	*calls = 0;
+	do {
+		op();
+		( *calls )++;
+		seconds = std::chrono::duration<double> ( std::chrono::steady_clock::now() - start ).count();
+	} while ( seconds < min_seconds );
+	if ( counters ) {
+		counters->read ( &end );
+		*sample = PerfSample::difference ( begin, end );
+	}
+	return seconds / *calls;
+}
+
+static void print_header ( const BenchConfig &config )
+{
+	printf ( "label,benchmark,precision,N,particles,springs,threads,parallel,calls,seconds_per_call,"
+	         "ns_per_particle,ns_per_spring,calls_per_second,est_GBps" );
+	if ( config.counters )
+		printf ( ",ipc,cycles_per_particle,cycles_per_spring,cache_misses_per_particle,"
+		         "cache_misses_per_spring,branch_misses_per_spring,miss_GBps" );
+	printf ( "\n" );
+}
+
+// one counter column, empty when the event is missing
+static void print_counter ( const PerfSample &sample, PerfEvent event, double divisor )
+{
+	if ( sample.valid[event] )
+		printf ( ",%.3f", sample.value[event] / divisor );
+	else
+		printf ( "," );
+}
+
+// "bytes" is the memory traffic of one call from the models below, a lower bound that ignores caches;
+// "sample" holds the counters of all timed calls, NULL leaves the counter columns empty
+static void print_row ( const BenchConfig &config, const char *benchmark, const char *precision, int N,
+                        int particles, int springs, int threads, int calls, double seconds, double bytes,
+                        const PerfSample *sample )
+{
+	printf ( "%s,%s,%s,%d,%d,%d,%d,%s,%d,%.6g,%.2f,%.2f,%.2f,%.3f",
+		config.label.c_str(), benchmark, precision, N, particles, springs, threads, config.parallel.c_str(), calls, seconds,
+		1e9 * seconds / particles, 1e9 * seconds / springs, 1.0 / seconds, bytes / seconds * 1e-9 );
+	if ( config.counters ) {
+		PerfSample none;
+		std::fill ( none.valid, none.valid + PERF_EVENT_COUNT, false );
+		const PerfSample &s = sample ? *sample : none;
+		if ( s.valid[PERF_CYCLES] && s.valid[PERF_INSTRUCTIONS] && s.value[PERF_CYCLES] > 0 )
+			printf ( ",%.3f", (double)s.value[PERF_INSTRUCTIONS] / s.value[PERF_CYCLES] );
+		else
+			printf ( "," );
+		print_counter ( s, PERF_CYCLES, (double)calls * particles );
+		print_counter ( s, PERF_CYCLES, (double)calls * springs );
+		print_counter ( s, PERF_CACHE_MISSES, (double)calls * particles );
+		print_counter ( s, PERF_CACHE_MISSES, (double)calls * springs );
+		print_counter ( s, PERF_BRANCH_MISSES, (double)calls * springs );
+		if ( s.valid[PERF_CACHE_MISSES] )
+			printf ( ",%.3f", s.value[PERF_CACHE_MISSES] * (double)PERF_CACHE_LINE_BYTES / ( seconds * calls ) * 1e-9 );
+		else
+			printf ( "," );
+	}
+	printf ( "\n" );
+	fflush ( stdout );
+}
+
+// ( I + h^2 K ) x = b with K the spring graph Laplacian weighted by stiffness, one 3x3 identity
+// block per spring: symmetric positive definite and shaped like the system of an implicit step
+template <class Real>
+class ClothSystemMatrix : public implicitMatrixT<Real> {
+	public:
+		template <class P>
+		ClothSystemMatrix( ClothWorldT<P> *pWorld, double h, ThreadPool *pool ) : m_pPool( pool )
+		{
+			int size = pWorld->particle_count();
+			std::vector< std::vector< std::pair<int, Real> > > neighbours( size );
+			for ( int fi = 0; fi < pWorld->pNonconstraintForceVector.size(); fi++ )
+			{
+				if ( !pWorld->pNonconstraintForceVector[fi]->is_spring )
+					continue;
+				SpringForceT<Real> *pSpring = ( SpringForceT<Real>* )pWorld->pNonconstraintForceVector[fi];
+				pSpring->update_index( pWorld->pVector );
+				Real weight = h * h * pSpring->stiffness();
+				neighbours[ pSpring->index_of_p1() ].push_back( std::make_pair( pSpring->index_of_p2(), weight ) );
+				neighbours[ pSpring->index_of_p2() ].push_back( std::make_pair( pSpring->index_of_p1(), weight ) );
+			}
+			m_Offset.push_back( 0 );
+			for ( int ii = 0; ii < size; ii++ ) {
+				for ( int ni = 0; ni < neighbours[ii].size(); ni++ ) {
+					m_Neighbour.push_back( neighbours[ii][ni].first );
+					m_Weight.push_back( neighbours[ii][ni].second );
+				}
+				m_Offset.push_back( m_Neighbour.size() );
+			}
+		}
+
+		void matVecMult( Real x[], Real r[] )
+		{
+			int size = m_Offset.size() - 1;
+			std::function<void(int)> rows = [&]( int chunk ) {
+				int end = std::min( size, ( chunk + 1 ) * PARALLEL_CHUNK );
+				for ( int ii = chunk * PARALLEL_CHUNK; ii < end; ii++ )
+					for ( int c = 0; c < 3; c++ ) {
+						Real sum = x[ 3 * ii + c ];
+						for ( int ei = m_Offset[ii]; ei < m_Offset[ ii + 1 ]; ei++ )
+							sum += m_Weight[ei] * ( x[ 3 * ii + c ] - x[ 3 * m_Neighbour[ei] + c ] );
+						r[ 3 * ii + c ] = sum;
+					}
+			};
+			int chunks = ( size + PARALLEL_CHUNK - 1 ) / PARALLEL_CHUNK;
+			if ( m_pPool )
+				m_pPool->parallel_for( chunks, rows );
+			else
+				for ( int chunk = 0; chunk < chunks; chunk++ )
+					rows( chunk );
+		}
+
+		int entries() const { return m_Neighbour.size(); }
+
+	private:
+		std::vector<int> m_Offset, m_Neighbour;
+		std::vector<Real> m_Weight;
+		ThreadPool *m_pPool;
+};
+
+template <class P>
+static void run_size ( const BenchConfig &config, const char *precision, int N )
+{
+	typedef typename P::Real Real;
+	typedef typename P::Accumulator Accum;
+
+	ClothWorldT<P> *pWorld = new ClothWorldT<P>();
+	build_grid_cloth ( pWorld, N );
+	const int particles = pWorld->particle_count();
+	int springs = 0;
+	for ( int fi = 0; fi < pWorld->pNonconstraintForceVector.size(); fi++ )
+		springs += pWorld->pNonconstraintForceVector[fi]->is_spring;
+
+	// traffic models: a spring reads both ends' position and velocity and adds into two accumulators,
+	// a particle reads its velocity and writes its derivative pair; a step also copies the state
+	// in and out of the integrator workspace a few times per stage
+	const double spring_bytes = 12 * sizeof( Real ) + sizeof( SpringForceT<Real> ) + 12 * sizeof( Accum );
+	const double particle_bytes = 9 * sizeof( Real ) + 3 * sizeof( Accum );
+	const double force_bytes = springs * spring_bytes + particles * particle_bytes;
+	const double state_bytes = particles * 12.0 * sizeof( Real );
+
+	for ( int ti = 0; ti < config.threads.size(); ti++ )
+	{
+		int threads = config.threads[ti];
+		ThreadPool pool ( threads );
+		pWorld->set_parallel ( threads > 1 ? &pool : NULL, config.parallel == "deterministic" );
+		threads = pool.size();
+		// the counters see only this thread, so they would miss the workers' share
+		PerfCounters *counters = threads == 1 ? config.counters : NULL;
+
+		for ( int bi = 0; bi < config.benchmarks.size(); bi++ )
+		{
+			const std::string &benchmark = config.benchmarks[bi];
+			int calls = 0;
+			double seconds = 0.0, bytes = 0.0;
+			PerfSample sample;
+			pWorld->reset();
+
+			if ( benchmark == "forces" ) {
+				seconds = time_per_call ( [&]{ pWorld->evaluate_forces(); }, config.min_seconds, &calls, counters, &sample );
+				bytes = force_bytes;
+			} else if ( benchmark == "matvec" ) {
+				ClothSystemMatrix<Real> A ( pWorld, BENCH_DT, threads > 1 ? &pool : NULL );
+				int n = 3 * particles;
+				std::vector<Real> x ( n, Real( 1 ) ), r ( n );
+				seconds = time_per_call ( [&]{ A.matVecMult ( &x[0], &r[0] ); }, config.min_seconds, &calls, counters, &sample );
+				bytes = 2.0 * n * sizeof( Real ) + A.entries() * ( 4.0 * sizeof( Real ) + sizeof( int ) );
+			} else if ( benchmark == "euler" || benchmark == "midpoint" || benchmark == "rk4" ) {
+				std::string mode = benchmark == "euler" ? "Euler" : benchmark == "midpoint" ? "Midpoint" : "RK4";
+				int stages = benchmark == "euler" ? 1 : benchmark == "midpoint" ? 2 : 4;
+				seconds = time_per_call ( [&]{ pWorld->simulation_step ( BENCH_DT, mode ); }, config.min_seconds, &calls, counters, &sample );
+				bytes = stages * ( force_bytes + 3 * state_bytes );
+			} else if ( benchmark == "cg" ) {
+				ClothSystemMatrix<Real> A ( pWorld, BENCH_DT, threads > 1 ? &pool : NULL );
+				int n = 3 * particles;
+				std::vector<Real> x ( n ), b ( n );
+				for ( int ii = 0; ii < particles; ii++ )
+					for ( int c = 0; c < 3; c++ )
+						b[ 3 * ii + c ] = pWorld->pVector[ii]->m_Position[c];
+				seconds = time_per_call ( [&]{
+					int steps = CG_ITERATIONS;
+					ConjGrad<Real, Accum> ( n, &A, &x[0], &b[0], 0.0, &steps, threads > 1 ? &pool : NULL, config.parallel == "deterministic" );
+				}, config.min_seconds, &calls, counters, &sample );
+				// per iteration one matrix product and about ten passes over the vectors
+				double matvec_bytes = 2.0 * n * sizeof( Real ) + A.entries() * ( 4.0 * sizeof( Real ) + sizeof( int ) );
+				bytes = CG_ITERATIONS * ( matvec_bytes + 10.0 * n * sizeof( Real ) );
+			} else {
+				fprintf ( stderr, "Unknown benchmark %s\n", benchmark.c_str() );
+				continue;
+			}
+			print_row ( config, benchmark.c_str(), precision, N, particles, springs, threads, calls, seconds, bytes,
+			            counters ? &sample : NULL );
+		}
+		pWorld->set_parallel ( NULL, true );
+	}
+	delete pWorld;
+}
+
+template <class P>
+static void run ( const BenchConfig &config, const char *precision )
+{
+	for ( int si = 0; si < config.sizes.size(); si++ )
+		run_size<P> ( config, precision, config.sizes[si] );
+}
+
+int main ( int argc, char ** argv )
+{
+	BenchConfig config;
+	config.sizes = split_ints ( "20,64,256,1024" );
+	config.threads.push_back ( 1 );
+	if ( std::thread::hardware_concurrency() > 1 )
+		config.threads.push_back ( std::thread::hardware_concurrency() );
+	config.benchmarks = split ( "forces,matvec,euler,midpoint,rk4,cg" );
+	config.parallel = "deterministic";
+	config.min_seconds = 0.5;
+	config.counters = NULL;
+	bool counters = false;
+	std::string precision = "float";
+
+	for ( int ai = 1; ai < argc; ai++ )
+	{
+		std::string option = argv[ai];
+		if ( option == "--counters" ) {
+			counters = true;
+			continue;
+		}
+		if ( option == "-h" || option == "--help" || ai + 1 >= argc ) {
+			usage ( argv[0] );
+			return option == "-h" || option == "--help" ? 0 : 1;
+		}
+		std::string value = argv[++ai];
+		if ( option == "--sizes" )				config.sizes = split_ints ( value );
+		else if ( option == "--threads" )		config.threads = split_ints ( value );
+		else if ( option == "--benchmarks" )	config.benchmarks = split ( value );
+		else if ( option == "--precision" )		precision = value;
+		else if ( option == "--parallel" )		config.parallel = value;
+		else if ( option == "--min-time" )		config.min_seconds = atof ( value.c_str() );
+		else if ( option == "--label" )			config.label = value;
+		else {
+			fprintf ( stderr, "Unknown option %s\n", option.c_str() );
+			usage ( argv[0] );
+			return 1;
+		}
+	}
+	for ( int si = 0; si < config.sizes.size(); si++ )
+		if ( config.sizes[si] < 3 ) {
+			fprintf ( stderr, "Grid size %d is too small\n", config.sizes[si] );
+			return 1;
+		}
+	if ( config.parallel != "deterministic" && config.parallel != "fast" ) {
+		fprintf ( stderr, "Unknown parallel mode %s\n", config.parallel.c_str() );
+		return 1;
+	}
+
+	// opened on the thread that runs the single threaded rows
+	if ( counters ) {
+		config.counters = new PerfCounters();
+		if ( !config.counters->available() )
+			fprintf ( stderr, "No hardware counters ( %s ), the counter columns stay empty\n", config.counters->error().c_str() );
+	}
+
+	print_header ( config );
+	if ( precision == "float" )
+		run<FloatPrecision> ( config, "float" );
+	else if ( precision == "double" )
+		run<DoublePrecision> ( config, "double" );
+	else if ( precision == "mixed" )
+		run<MixedPrecision> ( config, "mixed" );
+	else {
+		fprintf ( stderr, "Unknown precision %s\n", precision.c_str() );
+		delete config.counters;
+		return 1;
+	}
+	delete config.counters;
+	return 0;
+}
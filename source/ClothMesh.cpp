@@ -0,0 +1,431 @@
+#include "ClothMesh.h"
+#include "ThreadPool.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include <stdint.h>
+
+const size_t PARALLEL_SORT_MIN = 1 << 16;	// shorter lists are sorted on the calling thread
+
+/*
+----------------------------------------------------------------------
+mesh input
+----------------------------------------------------------------------
+*/
+
+static bool read_file( const char *fileName, std::string &text )
+{
+	FILE *fp = fopen( fileName, "rb" );
+	if ( !fp ) {
+		fprintf( stderr, "Cannot open mesh %s\n", fileName );
+		return false;
+	}
+	fseek( fp, 0, SEEK_END );
+	long size = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+	text.resize( size > 0 ? size : 0 );
+	bool ok = size >= 0 && ( size == 0 || fread( &text[0], 1, size, fp ) == (size_t)size );
+	fclose( fp );
+	if ( !ok )
+		fprintf( stderr, "Cannot read mesh %s\n", fileName );
+	return ok;
+}
+
+// faces of three or more vertices go in as a list of vertex indices, large polygons are fanned
+static void add_face( ClothMesh *pMesh, const int *face, int count )
+{
+	if ( count == 4 ) {
+		pMesh->quads.insert( pMesh->quads.end(), face, face + 4 );
+		return;
+	}
+	for ( int fi = 2; fi < count; fi++ ) {
+		pMesh->triangles.push_back( face[0] );
+		pMesh->triangles.push_back( face[fi-1] );
+		pMesh->triangles.push_back( face[fi] );
+	}
+}
+
+// the text is parsed in place with strtod/strtol, a stream per line is several times slower
+static bool parse_obj( const std::string &text, ClothMesh *pMesh )
+{
+	const char *p = text.c_str(), *end = p + text.size();
+	std::vector<int> face;
+	while ( p < end )
+	{
+		const char *line_end = (const char *)memchr( p, '\n', end - p );
+		if ( !line_end )
+			line_end = end;
+		while ( p < line_end && ( *p == ' ' || *p == '\t' ) )
+			p++;
+
+		if ( line_end - p > 2 && p[0] == 'v' && ( p[1] == ' ' || p[1] == '\t' ) ) {
+			char *next;
+			float x = strtof( p + 2, &next );
+			float y = strtof( next, &next );
+			float z = strtof( next, &next );
+			pMesh->vertices.push_back( Vec3f( x, y, z ) );
+		} else if ( line_end - p > 2 && p[0] == 'f' && ( p[1] == ' ' || p[1] == '\t' ) ) {
+			// "f a b c ...", each entry may be "v", "v/vt", "v//vn" or "v/vt/vn", indices are 1-based or negative
+			face.clear();
+			p += 2;
+			for ( ;; ) {
+				while ( p < line_end && ( *p == ' ' || *p == '\t' || *p == '\r' ) )
+					p++;
+				if ( p >= line_end )
+					break;
+				char *next;
+				long index = strtol( p, &next, 10 );
+				if ( next == p )
+					return false;
+				face.push_back( index < 0 ? (int)pMesh->vertices.size() + (int)index : (int)index - 1 );
+				p = next;
+				while ( p < line_end && *p != ' ' && *p != '\t' )
+					p++;
+			}
+			if ( face.size() >= 3 )
+				add_face( pMesh, &face[0], face.size() );
+		}
+		p = line_end + 1;
+	}
+	return true;
+}
+
+enum PlyType { PLY_NONE, PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64 };
+
+static PlyType ply_type( const std::string &name )
+{
+	static const char *names[][2] = {
+		{ "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+		{ "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" } };
+	for ( int ti = 0; ti < 8; ti++ )
+		if ( name == names[ti][0] || name == names[ti][1] )
+			return (PlyType)( PLY_INT8 + ti );
+	return PLY_NONE;
+}
+
+struct PlyProperty {
+	std::string name;
+	PlyType type;
+	PlyType count_type;		// PLY_NONE unless the property is a list
+};
+
+struct PlyElement {
+	std::string name;
+	long count;
+	std::vector<PlyProperty> properties;
+};
+
+// one value of "type" at "p", ascii or little endian binary, advances "p"
+static bool read_ply_value( const char *&p, const char *end, PlyType type, bool ascii, double *pValue )
+{
+	if ( ascii ) {
+		while ( p < end && ( *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n' ) )
+			p++;
+		char *next;
+		*pValue = strtod( p, &next );
+		if ( next == p )
+			return false;
+		p = next;
+		return true;
+	}
+
+	static const int sizes[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+	if ( end - p < sizes[type] )
+		return false;
+	union { int8_t i8; uint8_t u8; int16_t i16; uint16_t u16; int32_t i32; uint32_t u32; float f32; double f64; } value;
+	memcpy( &value, p, sizes[type] );
+	p += sizes[type];
+	switch ( type ) {
+		case PLY_INT8: *pValue = value.i8; break;
+		case PLY_UINT8: *pValue = value.u8; break;
+		case PLY_INT16: *pValue = value.i16; break;
+		case PLY_UINT16: *pValue = value.u16; break;
+		case PLY_INT32: *pValue = value.i32; break;
+		case PLY_UINT32: *pValue = value.u32; break;
+		case PLY_FLOAT32: *pValue = value.f32; break;
+		default: *pValue = value.f64; break;
+	}
+	return true;
+}
+
+static bool parse_ply( const std::string &text, ClothMesh *pMesh )
+{
+	// header, one keyword per line up to "end_header"
+	size_t header_end = text.find( "end_header" );
+	if ( text.compare( 0, 3, "ply" ) != 0 || header_end == std::string::npos )
+		return false;
+	bool ascii = false;
+	std::vector<PlyElement> elements;
+	const char *p = text.c_str();
+	while ( p < text.c_str() + header_end )
+	{
+		const char *line_end = strchr( p, '\n' );
+		char keyword[32] = "", a[32] = "", b[32] = "", c[32] = "", d[64] = "";
+		std::string line( p, line_end - p );
+		sscanf( line.c_str(), "%31s %31s %31s %31s %63s", keyword, a, b, c, d );
+		if ( !strcmp( keyword, "format" ) ) {
+			ascii = !strcmp( a, "ascii" );
+			if ( !ascii && strcmp( a, "binary_little_endian" ) )
+				return false;
+		} else if ( !strcmp( keyword, "element" ) ) {
+			PlyElement element;
+			element.name = a;
+			element.count = atol( b );
+			elements.push_back( element );
+		} else if ( !strcmp( keyword, "property" ) && !elements.empty() ) {
+			PlyProperty property;
+			bool list = !strcmp( a, "list" );
+			property.name = list ? d : b;
+			property.type = ply_type( list ? c : a );
+			property.count_type = list ? ply_type( b ) : PLY_NONE;
+			if ( property.type == PLY_NONE || ( list && property.count_type == PLY_NONE ) )
+				return false;
+			elements.back().properties.push_back( property );
+		}
+		p = line_end + 1;
+	}
+	p = strchr( text.c_str() + header_end, '\n' ) + 1;
+	const char *end = text.c_str() + text.size();
+
+	std::vector<int> face;
+	for ( int ei = 0; ei < elements.size(); ei++ )
+	{
+		const PlyElement &element = elements[ei];
+		const bool vertex = element.name == "vertex", faces = element.name == "face";
+		for ( long ii = 0; ii < element.count; ii++ ) {
+			double xyz[3] = { 0.0, 0.0, 0.0 };
+			for ( int pi = 0; pi < element.properties.size(); pi++ ) {
+				const PlyProperty &property = element.properties[pi];
+				double value;
+				if ( property.count_type == PLY_NONE ) {
+					if ( !read_ply_value( p, end, property.type, ascii, &value ) )
+						return false;
+					if ( vertex && property.name.size() == 1 && property.name[0] >= 'x' && property.name[0] <= 'z' )
+						xyz[ property.name[0] - 'x' ] = value;
+					continue;
+				}
+				double count;
+				if ( !read_ply_value( p, end, property.count_type, ascii, &count ) )
+					return false;
+				const bool indices = faces && ( property.name == "vertex_indices" || property.name == "vertex_index" );
+				face.clear();
+				for ( int vi = 0; vi < (int)count; vi++ ) {
+					if ( !read_ply_value( p, end, property.type, ascii, &value ) )
+						return false;
+					face.push_back( (int)value );
+				}
+				if ( indices && face.size() >= 3 )
+					add_face( pMesh, &face[0], face.size() );
+			}
+			if ( vertex )
+				pMesh->vertices.push_back( Vec3f( xyz[0], xyz[1], xyz[2] ) );
+		}
+	}
+	return true;
+}
+
+bool load_cloth_mesh( const char *fileName, ClothMesh *pMesh )
+{
+	std::string text;
+	if ( !read_file( fileName, text ) )
+		return false;
+
+	*pMesh = ClothMesh();
+	const char *extension = strrchr( fileName, '.' );
+	bool ply = extension && !strcmp( extension, ".ply" );
+	if ( !( ply ? parse_ply( text, pMesh ) : parse_obj( text, pMesh ) ) ) {
+		fprintf( stderr, "%s: not a %s mesh this reader understands\n", fileName, ply ? "PLY" : "OBJ" );
+		return false;
+	}
+
+	const int V = pMesh->vertices.size();
+	for ( int ti = 0; ti < pMesh->triangles.size(); ti++ )
+		if ( pMesh->triangles[ti] < 0 || pMesh->triangles[ti] >= V ) {
+			fprintf( stderr, "%s: face refers to vertex %d of %d\n", fileName, pMesh->triangles[ti] + 1, V );
+			return false;
+		}
+	for ( int qi = 0; qi < pMesh->quads.size(); qi++ )
+		if ( pMesh->quads[qi] < 0 || pMesh->quads[qi] >= V ) {
+			fprintf( stderr, "%s: face refers to vertex %d of %d\n", fileName, pMesh->quads[qi] + 1, V );
+			return false;
+		}
+	if ( pMesh->triangles.empty() && pMesh->quads.empty() ) {
+		fprintf( stderr, "%s: no faces\n", fileName );
+		return false;
+	}
+	return true;
+}
+
+/*
+----------------------------------------------------------------------
+spring generation
+----------------------------------------------------------------------
+*/
+
+// sorts equal slices on every thread, then merges neighbouring slices, halving their number each round
+template <class T>
+static void parallel_sort( std::vector<T> &items, ThreadPool *pPool )
+{
+	const int slices = pPool ? pPool->size() : 1;
+	if ( slices == 1 || items.size() < PARALLEL_SORT_MIN ) {
+		std::sort( items.begin(), items.end() );
+		return;
+	}
+
+	std::vector<size_t> bounds( slices + 1 );
+	for ( int si = 0; si <= slices; si++ )
+		bounds[si] = items.size() * si / slices;
+	typename std::vector<T>::iterator begin = items.begin();
+	pPool->parallel_for( slices, [&]( int si ) {
+		std::sort( begin + bounds[si], begin + bounds[si+1] );
+	} );
+	for ( int width = 1; width < slices; width *= 2 ) {
+		pPool->parallel_for( ( slices + 2 * width - 1 ) / ( 2 * width ), [&]( int mi ) {
+			const int first = 2 * width * mi;
+			const int middle = std::min( first + width, slices ), last = std::min( first + 2 * width, slices );
+			if ( middle < last )
+				std::inplace_merge( begin + bounds[first], begin + bounds[middle], begin + bounds[last] );
+		} );
+	}
+}
+
+static uint64_t edge_key( int v1, int v2 )
+{
+	return v1 < v2 ? (uint64_t)v1 << 32 | (uint32_t)v2 : (uint64_t)v2 << 32 | (uint32_t)v1;
+}
+
+// one side of a face, faces below the triangle count are triangles, the rest quads
+struct EdgeRecord {
+	uint64_t key;
+	int face, corner;		// the side runs from corner to the next corner of the face
+
+	bool operator < ( const EdgeRecord &other ) const {
+		if ( key != other.key )
+			return key < other.key;
+		return face != other.face ? face < other.face : corner < other.corner;
+	}
+};
+
+struct SpringRecord {
+	uint64_t key;
+	int kind;
+
+	bool operator < ( const SpringRecord &other ) const {
+		return key != other.key ? key < other.key : kind < other.kind;
+	}
+};
+
+static float squared_length( const ClothMesh &mesh, int v1, int v2 )
+{
+	return norm2( mesh.vertices[v1] - mesh.vertices[v2] );
+}
+
+// the side at "corner" of triangle "t" is its longest
+static bool longest_side( const ClothMesh &mesh, int t, int corner )
+{
+	const int *v = &mesh.triangles[3 * t];
+	float side = squared_length( mesh, v[corner], v[(corner+1)%3] );
+	return side >= squared_length( mesh, v[(corner+1)%3], v[(corner+2)%3] ) &&
+	       side >= squared_length( mesh, v[(corner+2)%3], v[corner] );
+}
+
+// the neighbour of "end" in quad "q" that is not on the side at "corner"
+static int quad_neighbour( const ClothMesh &mesh, int q, int corner, int end )
+{
+	const int *v = &mesh.quads[4 * q];
+	return v[corner] == end ? v[(corner+3)%4] : v[(corner+2)%4];
+}
+
+// shear and bend springs across the two faces of an interior edge
+static void add_cross_springs( const ClothMesh &mesh, const EdgeRecord &e1, const EdgeRecord &e2, std::vector<SpringRecord> &springs )
+{
+	const int T = mesh.triangles.size() / 3;
+	if ( e1.face < T && e2.face < T ) {
+		int opposite1 = mesh.triangles[ 3 * e1.face + ( e1.corner + 2 ) % 3 ];
+		int opposite2 = mesh.triangles[ 3 * e2.face + ( e2.corner + 2 ) % 3 ];
+		bool diagonal = longest_side( mesh, e1.face, e1.corner ) && longest_side( mesh, e2.face, e2.corner );
+		SpringRecord spring = { edge_key( opposite1, opposite2 ), diagonal ? MESH_SHEAR : MESH_BEND };
+		springs.push_back( spring );
+	} else if ( e1.face >= T && e2.face >= T ) {
+		const int ends[2] = { (int)( e1.key >> 32 ), (int)( e1.key & 0xffffffff ) };
+		for ( int ei = 0; ei < 2; ei++ ) {
+			SpringRecord spring = { edge_key( quad_neighbour( mesh, e1.face - T, e1.corner, ends[ei] ),
+			                                  quad_neighbour( mesh, e2.face - T, e2.corner, ends[ei] ) ), MESH_BEND };
+			springs.push_back( spring );
+		}
+	}
+	// a triangle next to a quad only gets the shared edge
+}
+
+void generate_mesh_springs( const ClothMesh &mesh, std::vector<MeshSpring> &springs, ThreadPool *pPool )
+{
+	const int T = mesh.triangles.size() / 3, Q = mesh.quads.size() / 4;
+	const int slices = pPool ? pPool->size() : 1;
+
+	// 1. every side of every face, sorted so the sides of one edge are neighbours
+	std::vector<EdgeRecord> edges( 3 * T + 4 * Q );
+	for ( int t = 0; t < T; t++ )
+		for ( int k = 0; k < 3; k++ ) {
+			EdgeRecord edge = { edge_key( mesh.triangles[3*t+k], mesh.triangles[3*t+(k+1)%3] ), t, k };
+			edges[3*t+k] = edge;
+		}
+	for ( int q = 0; q < Q; q++ )
+		for ( int k = 0; k < 4; k++ ) {
+			EdgeRecord edge = { edge_key( mesh.quads[4*q+k], mesh.quads[4*q+(k+1)%4] ), T + q, k };
+			edges[3*T+4*q+k] = edge;
+		}
+	parallel_sort( edges, pPool );
+
+	// 2. one stretch spring per edge and the cross springs of interior edges, each slice starts
+	// on the first side of an edge so no edge is split between two slices
+	std::vector<size_t> bounds( slices + 1 );
+	for ( int si = 0; si <= slices; si++ ) {
+		size_t start = edges.size() * si / slices;
+		while ( start > 0 && start < edges.size() && edges[start].key == edges[start-1].key )
+			start++;
+		bounds[si] = start;
+	}
+	std::vector< std::vector<SpringRecord> > slice_springs( slices );
+	std::function<void(int)> scan = [&]( int si ) {
+		std::vector<SpringRecord> &out = slice_springs[si];
+		for ( size_t ei = bounds[si]; ei < bounds[si+1]; ) {
+			size_t next = ei + 1;
+			while ( next < edges.size() && edges[next].key == edges[ei].key )
+				next++;
+			SpringRecord stretch = { edges[ei].key, MESH_STRETCH };
+			out.push_back( stretch );
+			if ( next - ei == 2 )
+				add_cross_springs( mesh, edges[ei], edges[ei+1], out );
+			ei = next;
+		}
+	};
+	if ( pPool )
+		pPool->parallel_for( slices, scan );
+	else
+		scan( 0 );
+
+	std::vector<SpringRecord> candidates;
+	for ( int si = 0; si < slices; si++ )
+		candidates.insert( candidates.end(), slice_springs[si].begin(), slice_springs[si].end() );
+	for ( int q = 0; q < Q; q++ ) {
+		SpringRecord diagonal1 = { edge_key( mesh.quads[4*q], mesh.quads[4*q+2] ), MESH_SHEAR };
+		SpringRecord diagonal2 = { edge_key( mesh.quads[4*q+1], mesh.quads[4*q+3] ), MESH_SHEAR };
+		candidates.push_back( diagonal1 );
+		candidates.push_back( diagonal2 );
+	}
+
+	// 3. one spring per vertex pair, the strongest kind first after sorting
+	parallel_sort( candidates, pPool );
+	springs.clear();
+	for ( size_t ci = 0; ci < candidates.size(); ci++ ) {
+		const int p1 = candidates[ci].key >> 32, p2 = candidates[ci].key & 0xffffffff;
+		if ( p1 == p2 || ( ci > 0 && candidates[ci].key == candidates[ci-1].key ) )
+			continue;
+		MeshSpring spring = { p1, p2, candidates[ci].kind, sqrtf( squared_length( mesh, p1, p2 ) ) };
+		springs.push_back( spring );
+	}
+}
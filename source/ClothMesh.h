@@ -0,0 +1,42 @@
+#pragma once
+
+#include <gfx/vec3.h>
+#include <vector>
+
+class ThreadPool;
+
+// Cloth from a garment mesh instead of a generated grid: every vertex becomes a particle and the
+// springs come from the mesh adjacency. Triangles and quads are kept as they are, larger
+// polygons are fanned into triangles.
+struct ClothMesh {
+	std::vector<Vec3f> vertices;
+	std::vector<int> triangles;		// 3 vertex indices per face
+	std::vector<int> quads;			// 4 vertex indices per face, in order around the face
+};
+
+// Wavefront OBJ ( "v" and "f" records ) or PLY ( ascii or binary_little_endian, vertex x y z
+// and a face vertex_indices list ), chosen by the file extension. Returns false and prints why
+// if the file cannot be read or a face refers to a missing vertex.
+bool load_cloth_mesh( const char *fileName, ClothMesh *pMesh );
+
+enum MeshSpringKind { MESH_STRETCH, MESH_SHEAR, MESH_BEND };
+
+struct MeshSpring {
+	int p1, p2;			// vertex indices, p1 < p2
+	int kind;			// MeshSpringKind
+	float rest;			// distance of the vertices in the mesh
+};
+
+/* Springs from an edge map of the mesh:
+   		stretch: every mesh edge
+   		shear: both diagonals of a quad, and across the diagonal of a triangle pair ( two
+   		       triangles sharing their longest edge form a quad, the other diagonal is added )
+   		bend: across two quads sharing an edge, the two neighbours of each edge end that continue
+   		      a line of edges through it, and across any other triangle pair, the two vertices
+   		      opposite the shared edge
+   Edges with more than two faces only get the stretch spring. A vertex pair is connected once,
+   stretch before shear before bend. The edge records are sorted on every thread of "pPool"
+   ( NULL sorts serially ) and the springs come out sorted by vertex pair, the same for any
+   number of threads.
+*/
+void generate_mesh_springs( const ClothMesh &mesh, std::vector<MeshSpring> &springs, ThreadPool *pPool );
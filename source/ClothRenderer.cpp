@@ -0,0 +1,313 @@
+#include "ClothRenderer.h"
+#include "ThreadPool.h"
+#include "shader.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+const int NORMAL_CHUNK = 4096;	// triangles or particles per pool task, smaller meshes stay on one thread
+
+ClothRenderer::ClothRenderer() :
+	m_Program( 0 ), m_VertexArray( 0 ), m_PositionBuffer( 0 ), m_NormalBuffer( 0 ), m_ElementBuffer( 0 ),
+	m_MatrixUniform( -1 ), m_FrontColorUniform( -1 ), m_BackColorUniform( -1 ),
+	m_PositionAttribute( -1 ), m_NormalAttribute( -1 ),
+	m_Vertices( 0 ), m_Indices( 0 ), m_pPool( NULL ), m_pNormals( NULL ),
+	m_RingBuffer( 0 ), m_pMapped( NULL ), m_Slot( 0 )
+{
+	for ( int c = 0; c < 3; c++ )
+		m_FrontColor[c] = m_BackColor[c] = 1.0f;
+	for ( int si = 0; si < RENDER_RING_SLOTS; si++ )
+		m_Fences[si] = 0;
+}
+
+ClothRenderer::~ClothRenderer()
+{
+	release();
+}
+
+bool ClothRenderer::create( const char *vertexShaderFile, const char *fragmentShaderFile )
+{
+	release();
+
+	// Create and compile our GLSL program from the shaders
+	m_Program = LoadShaders( vertexShaderFile, fragmentShaderFile );
+	if ( !m_Program )
+		return false;
+	// the attributes are looked up, binding locations after LoadShaders has linked would need a relink
+	GLint linked = GL_FALSE;
+	glGetProgramiv( m_Program, GL_LINK_STATUS, &linked );
+	m_MatrixUniform = glGetUniformLocation( m_Program, "MVP" );
+	m_FrontColorUniform = glGetUniformLocation( m_Program, "frontColor" );
+	m_BackColorUniform = glGetUniformLocation( m_Program, "backColor" );
+	m_PositionAttribute = glGetAttribLocation( m_Program, "vertexPosition_modelspace" );
+	m_NormalAttribute = glGetAttribLocation( m_Program, "vertexNormal" );
+	if ( !linked || m_PositionAttribute < 0 || m_NormalAttribute < 0 ) {
+		fprintf( stderr, "Cannot build the cloth shaders %s and %s\n", vertexShaderFile, fragmentShaderFile );
+		release();
+		return false;
+	}
+
+	glGenVertexArrays( 1, &m_VertexArray );
+	glGenBuffers( 1, &m_PositionBuffer );
+	glGenBuffers( 1, &m_NormalBuffer );
+	glGenBuffers( 1, &m_ElementBuffer );
+
+	bind_attributes( m_PositionBuffer, 0, m_NormalBuffer, 0 );
+	glBindVertexArray( m_VertexArray );
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, m_ElementBuffer );
+	glBindVertexArray( 0 );
+	return true;
+}
+
+// the attribute layout is recorded in the vertex array, drawing only binds it
+void ClothRenderer::bind_attributes( GLuint positionBuffer, size_t positionOffset, GLuint normalBuffer, size_t normalOffset )
+{
+	glBindVertexArray( m_VertexArray );
+	glBindBuffer( GL_ARRAY_BUFFER, positionBuffer );
+	glEnableVertexAttribArray( m_PositionAttribute );
+	glVertexAttribPointer( m_PositionAttribute, 3, GL_FLOAT, GL_FALSE, 0, (void*)positionOffset );
+	glBindBuffer( GL_ARRAY_BUFFER, normalBuffer );
+	glEnableVertexAttribArray( m_NormalAttribute );
+	glVertexAttribPointer( m_NormalAttribute, 3, GL_FLOAT, GL_FALSE, 0, (void*)normalOffset );
+	glBindVertexArray( 0 );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+}
+
+void ClothRenderer::release()
+{
+	release_ring();
+	if ( m_ElementBuffer )
+		glDeleteBuffers( 1, &m_ElementBuffer );
+	if ( m_NormalBuffer )
+		glDeleteBuffers( 1, &m_NormalBuffer );
+	if ( m_PositionBuffer )
+		glDeleteBuffers( 1, &m_PositionBuffer );
+	if ( m_VertexArray )
+		glDeleteVertexArrays( 1, &m_VertexArray );
+	if ( m_Program )
+		glDeleteProgram( m_Program );
+	m_Program = m_VertexArray = m_PositionBuffer = m_NormalBuffer = m_ElementBuffer = 0;
+	m_Vertices = m_Indices = 0;
+}
+
+void ClothRenderer::set_triangles( const std::vector<int> &triangles )
+{
+	if ( !m_Program )
+		return;
+
+	m_Triangles.assign( triangles.begin(), triangles.end() );
+	m_Indices = m_Triangles.size();
+	m_Vertices = m_Triangles.empty() ? 0 : *std::max_element( m_Triangles.begin(), m_Triangles.end() ) + 1;
+
+	// triangles of every particle, so each particle's normal is summed by one thread
+	m_IncidentOffset.assign( m_Vertices + 1, 0 );
+	for ( int ii = 0; ii < m_Indices; ii++ )
+		m_IncidentOffset[ m_Triangles[ii] + 1 ]++;
+	for ( int vi = 0; vi < m_Vertices; vi++ )
+		m_IncidentOffset[vi+1] += m_IncidentOffset[vi];
+	m_IncidentTriangle.resize( m_Indices );
+	std::vector<int> fill( m_IncidentOffset.begin(), m_IncidentOffset.end() - 1 );
+	for ( int ii = 0; ii < m_Indices; ii++ )
+		m_IncidentTriangle[ fill[ m_Triangles[ii] ]++ ] = ii / 3;
+	m_FaceNormals.resize( m_Indices );
+	m_Normals.resize( 3 * m_Vertices );
+	m_pNormals = m_Normals.empty() ? NULL : &m_Normals[0];
+
+	// the element buffer is part of the vertex array state
+	glBindVertexArray( m_VertexArray );
+	glBufferData( GL_ELEMENT_ARRAY_BUFFER, m_Indices * sizeof( GLuint ), m_Triangles.empty() ? NULL : &m_Triangles[0], GL_STATIC_DRAW );
+	glBindVertexArray( 0 );
+
+	glBindBuffer( GL_ARRAY_BUFFER, m_PositionBuffer );
+	glBufferData( GL_ARRAY_BUFFER, m_Vertices * 3 * sizeof( GLfloat ), NULL, GL_STREAM_DRAW );
+	glBindBuffer( GL_ARRAY_BUFFER, m_NormalBuffer );
+	glBufferData( GL_ARRAY_BUFFER, m_Vertices * 3 * sizeof( GLfloat ), NULL, GL_STREAM_DRAW );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+	// the ring is sized for the particles, a new mesh needs a new one
+	if ( m_pMapped ) {
+		release_ring();
+		create_ring();
+	}
+}
+
+bool ClothRenderer::set_persistent( bool persistent )
+{
+	if ( persistent == ( m_pMapped != NULL ) )
+		return true;
+	if ( !persistent ) {
+		release_ring();
+		return true;
+	}
+	if ( !m_Program || !( GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage ) )
+		return false;
+	create_ring();
+	return m_pMapped != NULL;
+}
+
+void ClothRenderer::create_ring()
+{
+	if ( m_Vertices == 0 )
+		return;
+	const size_t frame_bytes = m_Vertices * 3 * sizeof( GLfloat );
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+	glGenBuffers( 1, &m_RingBuffer );
+	glBindBuffer( GL_ARRAY_BUFFER, m_RingBuffer );
+	glBufferStorage( GL_ARRAY_BUFFER, 2 * RENDER_RING_SLOTS * frame_bytes, NULL, flags );
+	m_pMapped = (GLfloat *)glMapBufferRange( GL_ARRAY_BUFFER, 0, 2 * RENDER_RING_SLOTS * frame_bytes, flags );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+	if ( !m_pMapped ) {
+		fprintf( stderr, "Cannot map a persistent vertex buffer, streaming instead\n" );
+		glDeleteBuffers( 1, &m_RingBuffer );
+		m_RingBuffer = 0;
+		return;
+	}
+
+	// every slot has the same layout, the draw picks one with its base vertex
+	bind_attributes( m_RingBuffer, 0, m_RingBuffer, RENDER_RING_SLOTS * frame_bytes );
+	m_Slot = 0;
+	m_pNormals = m_pMapped + 3 * m_Vertices * RENDER_RING_SLOTS;
+}
+
+void ClothRenderer::release_ring()
+{
+	for ( int si = 0; si < RENDER_RING_SLOTS; si++ )
+		if ( m_Fences[si] ) {
+			glDeleteSync( m_Fences[si] );
+			m_Fences[si] = 0;
+		}
+	if ( !m_RingBuffer )
+		return;
+
+	glBindBuffer( GL_ARRAY_BUFFER, m_RingBuffer );
+	glUnmapBuffer( GL_ARRAY_BUFFER );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+	glDeleteBuffers( 1, &m_RingBuffer );
+	m_RingBuffer = 0;
+	m_pMapped = NULL;
+	m_pNormals = m_Normals.empty() ? NULL : &m_Normals[0];
+	if ( m_VertexArray )
+		bind_attributes( m_PositionBuffer, 0, m_NormalBuffer, 0 );
+}
+
+GLfloat *ClothRenderer::map_positions()
+{
+	if ( !m_pMapped )
+		return NULL;
+
+	m_Slot = ( m_Slot + 1 ) % RENDER_RING_SLOTS;
+	GLsync &fence = m_Fences[m_Slot];
+	if ( fence ) {
+		// normally long signalled, two more frames were queued since
+		while ( glClientWaitSync( fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000 ) == GL_TIMEOUT_EXPIRED )
+			;
+		glDeleteSync( fence );
+		fence = 0;
+	}
+	m_pNormals = m_pMapped + 3 * m_Vertices * ( RENDER_RING_SLOTS + m_Slot );
+	return m_pMapped + 3 * m_Vertices * m_Slot;
+}
+
+void ClothRenderer::set_parallel( ThreadPool *pPool )
+{
+	m_pPool = pPool;
+}
+
+void ClothRenderer::set_colors( const GLfloat *front, const GLfloat *back )
+{
+	for ( int c = 0; c < 3; c++ ) {
+		m_FrontColor[c] = front[c];
+		m_BackColor[c] = back[c];
+	}
+}
+
+void ClothRenderer::run_chunks( int count, void (ClothRenderer::*range)( const GLfloat *, int, int ), const GLfloat *positions )
+{
+	const int chunks = ( count + NORMAL_CHUNK - 1 ) / NORMAL_CHUNK;
+	if ( !m_pPool || chunks <= 1 ) {
+		(this->*range)( positions, 0, count );
+		return;
+	}
+	m_pPool->parallel_for( chunks, [&]( int ci ) {
+		(this->*range)( positions, ci * NORMAL_CHUNK, std::min( count, ( ci + 1 ) * NORMAL_CHUNK ) );
+	} );
+}
+
+// cross product of two sides, its length is twice the area so larger triangles weigh more
+void ClothRenderer::face_normals( const GLfloat *positions, int first, int last )
+{
+	const GLuint *triangles = &m_Triangles[0];
+	GLfloat *normals = &m_FaceNormals[0];
+	for ( int t = first; t < last; t++ ) {
+		const GLfloat *a = positions + 3 * triangles[3*t], *b = positions + 3 * triangles[3*t+1], *c = positions + 3 * triangles[3*t+2];
+		const GLfloat u0 = b[0] - a[0], u1 = b[1] - a[1], u2 = b[2] - a[2];
+		const GLfloat v0 = c[0] - a[0], v1 = c[1] - a[1], v2 = c[2] - a[2];
+		normals[3*t] = u1 * v2 - u2 * v1;
+		normals[3*t+1] = u2 * v0 - u0 * v2;
+		normals[3*t+2] = u0 * v1 - u1 * v0;
+	}
+}
+
+// gathers instead of scattering into the particles, so threads never write the same normal
+void ClothRenderer::vertex_normals( const GLfloat *, int first, int last )
+{
+	const GLfloat *faces = &m_FaceNormals[0];
+	for ( int vi = first; vi < last; vi++ ) {
+		GLfloat n0 = 0.0f, n1 = 0.0f, n2 = 0.0f;
+		for ( int ii = m_IncidentOffset[vi]; ii < m_IncidentOffset[vi+1]; ii++ ) {
+			const GLfloat *face = faces + 3 * m_IncidentTriangle[ii];
+			n0 += face[0];
+			n1 += face[1];
+			n2 += face[2];
+		}
+		m_pNormals[3*vi] = n0;
+		m_pNormals[3*vi+1] = n1;
+		m_pNormals[3*vi+2] = n2;
+	}
+}
+
+void ClothRenderer::compute_normals( const GLfloat *positions )
+{
+	if ( m_Vertices == 0 )
+		return;
+	run_chunks( m_Indices / 3, &ClothRenderer::face_normals, positions );
+	run_chunks( m_Vertices, &ClothRenderer::vertex_normals, positions );
+}
+
+void ClothRenderer::stream( GLuint buffer, const GLfloat *data )
+{
+	const size_t bytes = m_Vertices * 3 * sizeof( GLfloat );
+	glBindBuffer( GL_ARRAY_BUFFER, buffer );
+	// orphan the storage the last draw may still be reading, then fill the fresh one
+	glBufferData( GL_ARRAY_BUFFER, bytes, NULL, GL_STREAM_DRAW );
+	glBufferSubData( GL_ARRAY_BUFFER, 0, bytes, data );
+}
+
+void ClothRenderer::upload( const GLfloat *positions )
+{
+	if ( !m_Program || m_Vertices == 0 || m_pMapped )
+		return;
+	stream( m_PositionBuffer, positions );
+	stream( m_NormalBuffer, &m_Normals[0] );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+}
+
+void ClothRenderer::draw( const GLfloat *mvp )
+{
+	if ( !m_Program || m_Indices == 0 )
+		return;
+
+	glUseProgram( m_Program );
+	// Send our transformation to the currently bound shader, in the "MVP" uniform
+	glUniformMatrix4fv( m_MatrixUniform, 1, GL_FALSE, mvp );
+	glUniform3fv( m_FrontColorUniform, 1, m_FrontColor );
+	glUniform3fv( m_BackColorUniform, 1, m_BackColor );
+	glBindVertexArray( m_VertexArray );
+	if ( m_pMapped ) {
+		glDrawElementsBaseVertex( GL_TRIANGLES, m_Indices, GL_UNSIGNED_INT, (void*)0, m_Slot * m_Vertices );
+		m_Fences[m_Slot] = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+	} else
+		glDrawElements( GL_TRIANGLES, m_Indices, GL_UNSIGNED_INT, (void*)0 );
+	glBindVertexArray( 0 );
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <vector>
+#include <cstddef>
+
+class ThreadPool;
+
+// GL objects for drawing the cloth, created once when the window opens instead of every frame.
+// The cloth is drawn indexed: a static element buffer holds the triangles and the vertex buffers
+// hold one position and normal per particle, so a frame uploads each particle once instead of
+// once per triangle corner. Every upload orphans the old storage and fills the new one with
+// glBufferSubData, so the driver never waits for the previous frame's draw to finish with it.
+// The shaders light the cloth, two-sided: the front color where the normal faces +z, the back
+// color where it faces away.
+//
+// With persistent buffers ( GL 4.4 or ARB_buffer_storage ) the positions and normals instead
+// live in one buffer mapped for the renderer's lifetime, a ring of RENDER_RING_SLOTS frames.
+// The caller writes the positions of a frame straight into map_positions(), the normals are
+// computed into the same slot and nothing is uploaded; a fence after each draw keeps a slot
+// from being rewritten while the GPU may still read it.
+const int RENDER_RING_SLOTS = 3;
+
+class ClothRenderer {
+	public:
+		ClothRenderer();
+		~ClothRenderer();	// release(), needs the context to still be current
+
+		// compiles and links the shaders and creates the vertex array and buffers,
+		// needs a current GL context; returns false if the program cannot be built
+		bool create( const char *vertexShaderFile, const char *fragmentShaderFile );
+		void release();
+
+		// particle indices, 3 per triangle; sizes the vertex buffers for the particles they use
+		void set_triangles( const std::vector<int> &triangles );
+
+		// spread the normal computation over "pPool", NULL computes it on the calling thread
+		void set_parallel( ThreadPool *pPool );
+
+		void set_colors( const GLfloat *front, const GLfloat *back );	// rgb each
+
+		// switches between persistent buffers and streaming, returns false if the GL lacks them
+		bool set_persistent( bool persistent );
+		bool persistent() const { return m_pMapped != NULL; }
+
+		// persistent buffers only, NULL otherwise: where the positions of the next frame go,
+		// 3 floats for each of vertex_count() particles; waits until the GPU is done with them
+		GLfloat *map_positions();
+
+		// smooth normals, the area weighted sum over the triangles of each particle, from
+		// 3 floats per particle; they go to the mapped frame with persistent buffers.
+		// upload() sends the positions straight from the caller's array along with the
+		// normals last computed, it is not needed with persistent buffers
+		void compute_normals( const GLfloat *positions );
+		void upload( const GLfloat *positions );
+		void draw( const GLfloat *mvp );	// the triangles with the last upload or mapped frame
+
+		int vertex_count() const { return m_Vertices; }
+
+	private:
+		ClothRenderer( const ClothRenderer & );
+		void operator = ( const ClothRenderer & );
+
+		void run_chunks( int count, void (ClothRenderer::*range)( const GLfloat *, int, int ), const GLfloat *positions );
+		void face_normals( const GLfloat *positions, int first, int last );
+		void vertex_normals( const GLfloat *positions, int first, int last );
+		void stream( GLuint buffer, const GLfloat *data );
+		void bind_attributes( GLuint positionBuffer, size_t positionOffset, GLuint normalBuffer, size_t normalOffset );
+		void create_ring();
+		void release_ring();
+
+		GLuint m_Program;
+		GLuint m_VertexArray;
+		GLuint m_PositionBuffer, m_NormalBuffer, m_ElementBuffer;
+		GLint m_MatrixUniform, m_FrontColorUniform, m_BackColorUniform;
+		GLint m_PositionAttribute, m_NormalAttribute;
+		GLfloat m_FrontColor[3], m_BackColor[3];
+		int m_Vertices;			// particles the triangles refer to, 0 .. m_Vertices - 1
+		int m_Indices;
+
+		ThreadPool *m_pPool;
+		std::vector<GLuint> m_Triangles;
+		std::vector<int> m_IncidentOffset;		// per particle, range into m_IncidentTriangle
+		std::vector<int> m_IncidentTriangle;	// triangles using each particle, ascending
+		std::vector<GLfloat> m_FaceNormals;		// area weighted, 3 per triangle
+		std::vector<GLfloat> m_Normals;			// sum of the face normals, 3 per particle
+		GLfloat *m_pNormals;					// where compute_normals() writes, m_Normals or the mapped slot
+
+		GLuint m_RingBuffer;		// the positions of every slot, then the normals of every slot
+		GLfloat *m_pMapped;			// NULL unless persistent
+		GLsync m_Fences[RENDER_RING_SLOTS];	// set by the last draw from each slot
+		int m_Slot;					// written this frame
+};
@@ -0,0 +1,5 @@
+#include "ClothScheduler.h"
+
+ClothScheduler::ClothScheduler( int threads ) :
+	m_Pool( threads ) {
+}
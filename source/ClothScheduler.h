@@ -0,0 +1,34 @@
+#pragma once
+
+#include "ClothWorld.h"
+#include "ThreadPool.h"
+
+#include <vector>
+#include <string>
+
+// Steps a batch of independent cloth worlds on a thread pool.
+// Each world is advanced by one thread at a time, so worlds never need locking;
+// throughput scales with cores as long as there are more worlds than threads.
+class ClothScheduler {
+	public:
+		explicit ClothScheduler( int threads );	// threads <= 0 uses every hardware thread
+
+		// advance every world by "steps" integration steps of size dt, any ClothWorldT precision
+		template <class World>
+		void simulate( const std::vector<World*> &worlds, int steps, float dt, const std::string &mode )
+		{
+			// one task per world runs all of its steps, which keeps its state in one core's cache
+			m_Pool.parallel_for( worlds.size(), [&]( int wi ) {
+				for ( int si = 0; si < steps; si++ )
+					worlds[wi]->simulation_step( dt, mode );
+			} );
+		}
+
+		int thread_count() const { return m_Pool.size(); }
+
+		// the same threads, for spreading a single world's work ( ClothWorld::set_parallel )
+		ThreadPool *pool() { return &m_Pool; }
+
+	private:
+		ThreadPool m_Pool;
+};
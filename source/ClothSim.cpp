@@ -0,0 +1,388 @@
+// ClothSim.cpp : headless batch simulator, runs the physics at full speed without a window.
+
+#include "ClothWorld.h"
+#include "ClothScheduler.h"
+#include "Scene.h"
+#include "TrajectoryRecorder.h"
+#include "TrajectoryCodec.h"
+#include "Profiler.h"
+#include "Trace.h"
+
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstring>
+#include <cmath>
+#include <stdlib.h>
+#include <stdio.h>
+
+const int SDF_RESOLUTION = 64;		// distance field cells along the longest side of the obstacle
+
+static void usage ( const char *program )
+{
+	fprintf ( stderr, "usage: %s [options]\n", program );
+	fprintf ( stderr, "\t--scene grid:N          N x N cloth hanging from one edge (default grid:20)\n" );
+	fprintf ( stderr, "\t--scene FILE            scene file, see Scene.h; compiled once into FILE.<hash>.f32.ckpt\n" );
+	fprintf ( stderr, "\t--obstacle FILE.obj     static obstacle, its distance field is cached in FILE.obj.sdf\n" );
+	fprintf ( stderr, "\t--integrator MODE       Euler, Midpoint or RK4 (default RK4 or the scene's)\n" );
+	fprintf ( stderr, "\t--precision P           float, double or mixed (float state, double sums) (default float)\n" );
+	fprintf ( stderr, "\t--accuracy              also run the first instance in double and report the position error\n" );
+	fprintf ( stderr, "\t--dt DT                 time step (default 0.01 or the scene's)\n" );
+	fprintf ( stderr, "\t--steps S               number of steps (default 1000)\n" );
+	fprintf ( stderr, "\t--instances K           independent copies of the scene (default 1)\n" );
+	fprintf ( stderr, "\t--threads T             worker threads, 0 for all cores (default 1)\n" );
+	fprintf ( stderr, "\t--parallel MODE         split each instance over the threads: none, fast or\n" );
+	fprintf ( stderr, "\t                        deterministic (default none, instances run side by side)\n" );
+	fprintf ( stderr, "\t--output FILE           write particle positions of the first instance, - for stdout\n" );
+	fprintf ( stderr, "\t--output-every K        write a frame every K steps instead of only the last one\n" );
+	fprintf ( stderr, "\t--record FILE           binary trajectory of the first instance, see TrajectoryFile.h\n" );
+	fprintf ( stderr, "\t--record-every K        record a frame every K steps (default 1)\n" );
+	fprintf ( stderr, "\t--compress E            record compressed, positions within E and velocities within E / dt,\n" );
+	fprintf ( stderr, "\t                        see TrajectoryCodec.h\n" );
+	fprintf ( stderr, "\t--checkpoint FILE       save the state of the first instance after the last step\n" );
+	fprintf ( stderr, "\t--resume FILE           start every instance from a checkpoint instead of the scene\n" );
+	fprintf ( stderr, "\t--unpack IN OUT         convert the compressed recording IN to a raw one for the viewer\n" );
+	fprintf ( stderr, "\t--profile FILE.json     write phase timings ( needs a make PROFILE=1 build )\n" );
+	fprintf ( stderr, "\t--trace FILE.json       write a Chrome/Perfetto timeline of every thread ( same )\n" );
+	fprintf ( stderr, "\t--counters P,P,...      hardware counters for profiler phases, e.g. forces,collision ( same )\n" );
+}
+
+// one "x y z" line per particle, frames are separated by "# step S" lines
+template <class P>
+static void write_frame ( FILE *fp, const ClothWorldT<P> *pWorld )
+{
+	fprintf ( fp, "# step %d\n", pWorld->step_count() );
+	for ( int ii = 0; ii < pWorld->particle_count(); ii++ ) {
+		const TVec3<typename P::Real> &position = pWorld->pVector[ii]->m_Position;
+		fprintf ( fp, "%.9g %.9g %.9g\n", (double)position[0], (double)position[1], (double)position[2] );
+	}
+}
+
+struct Options {
+	std::string scene, mode, parallel;
+	const char *obstacle_file, *output_file, *profile_file, *trace_file, *record_file;
+	const char *checkpoint_file, *resume_file;
+	float dt;
+	SceneDescription description;	// what --scene names
+	int steps, instances, threads, output_every, record_every;
+	double compress_error;		// 0 records raw frames
+	bool accuracy;
+	std::vector<ProfilePhase> counted_phases;
+};
+
+template <class P>
+static ClothWorldT<P> *build_world ( const Options &options )
+{
+	ClothWorldT<P> *pWorld = new ClothWorldT<P>();
+	if ( options.resume_file ) {
+		if ( !pWorld->load_checkpoint ( options.resume_file ) ) {
+			delete pWorld;
+			return NULL;
+		}
+	} else if ( !build_scene ( pWorld, options.description ) || !add_scene_colliders ( pWorld, options.description ) ) {
+		delete pWorld;
+		return NULL;
+	}
+	if ( options.obstacle_file && !add_obstacle ( pWorld, options.obstacle_file, SDF_RESOLUTION ) ) {
+		delete pWorld;
+		return NULL;
+	}
+	return pWorld;
+}
+
+// largest and rms distance between the particles of "pWorld" and of the same scene run in double
+template <class P>
+static void report_accuracy ( const Options &options, const ClothWorldT<P> *pWorld )
+{
+	ClothWorldT<DoublePrecision> *pReference = build_world<DoublePrecision> ( options );
+	if ( !pReference )
+		return;
+	for ( int si = 0; si < options.steps; si++ )
+		pReference->simulation_step ( options.dt, options.mode );
+
+	double max_error = 0.0, sum_error = 0.0;
+	for ( int ii = 0; ii < pWorld->particle_count(); ii++ ) {
+		double error = norm ( Vec3 ( pWorld->pVector[ii]->m_Position ) - pReference->pVector[ii]->m_Position );
+		max_error = std::max ( max_error, error );
+		sum_error += error * error;
+	}
+	fprintf ( stderr, "position error against double: max %.3g, rms %.3g\n",
+		max_error, sqrt ( sum_error / pWorld->particle_count() ) );
+	delete pReference;
+}
+
+// hardware counters of the counted phases, per call and spread over the particles and springs
+template <class P>
+static void report_counters ( const Options &options, const ClothWorldT<P> *pWorld )
+{
+	int springs = 0;
+	for ( int fi = 0; fi < pWorld->pNonconstraintForceVector.size(); fi++ )
+		if ( pWorld->pNonconstraintForceVector[fi]->is_spring )
+			springs++;
+	for ( int pi = 0; pi < options.counted_phases.size(); pi++ )
+	{
+		ProfilePhaseStats stats;
+		Profiler::phase_stats ( options.counted_phases[pi], &stats );
+		fprintf ( stderr, "%s: %ld calls", stats.name, stats.hardware_calls );
+		if ( stats.hardware_valid[PERF_CYCLES] && stats.hardware_valid[PERF_INSTRUCTIONS] && stats.hardware_per_call[PERF_CYCLES] > 0 )
+			fprintf ( stderr, ", ipc %.2f", stats.hardware_per_call[PERF_INSTRUCTIONS] / stats.hardware_per_call[PERF_CYCLES] );
+		for ( int ei = 0; ei < PERF_EVENT_COUNT; ei++ )
+			if ( stats.hardware_valid[ei] )
+				fprintf ( stderr, ", %s %.3g per particle %.3g per spring", PerfCounters::event_name ( (PerfEvent)ei ),
+					stats.hardware_per_call[ei] / pWorld->particle_count(), springs ? stats.hardware_per_call[ei] / springs : 0.0 );
+		fprintf ( stderr, "\n" );
+	}
+}
+
+// decodes every frame of a compressed recording into a raw one
+template <class Real>
+static bool unpack_frames ( CompressedTrajectoryFile &in, TrajectoryRecorder &out )
+{
+	std::vector<Real> positions ( 3 * in.particles() ), velocities ( 3 * in.particles() );
+	for ( long fi = 0; fi < in.frames(); fi++ ) {
+		long long step;
+		if ( !in.read ( fi, &positions[0], &velocities[0], &step ) )
+			return false;
+		out.record_frame ( step, &positions[0], &velocities[0] );
+	}
+	return true;
+}
+
+static int unpack ( const char *in_file, const char *out_file )
+{
+	CompressedTrajectoryFile in;
+	if ( !in.open ( in_file, 0 ) )
+		return 1;
+	std::vector<unsigned int> springs ( in.spring_indices(), in.spring_indices() + 2 * in.springs() );
+	TrajectoryRecorder out;
+	if ( !out.open_file ( out_file, in.scalar_bytes(), in.particles(), springs, in.dt(), in.integrator(), NULL ) )
+		return 1;
+	bool ok = in.scalar_bytes() == sizeof ( float ) ? unpack_frames<float> ( in, out ) : unpack_frames<double> ( in, out );
+	if ( !out.close () || !ok )
+		return 1;
+	fprintf ( stderr, "unpacked %ld frames of %d particles\n", in.frames(), in.particles() );
+	return 0;
+}
+
+template <class P>
+static int run ( const Options &options, const char *precision )
+{
+	std::vector<ClothWorldT<P>*> worlds;
+	std::chrono::steady_clock::time_point build_start = std::chrono::steady_clock::now();
+	for ( int wi = 0; wi < options.instances; wi++ ) {
+		ClothWorldT<P> *pWorld = build_world<P> ( options );
+		if ( !pWorld )
+			return 1;
+		worlds.push_back ( pWorld );
+	}
+	if ( options.resume_file )
+		fprintf ( stderr, "resumed %s at step %d, %.1f ms per instance\n", options.resume_file, worlds[0]->step_count(),
+			1e3 * std::chrono::duration<double> ( std::chrono::steady_clock::now() - build_start ).count() / options.instances );
+
+	FILE *output = NULL;
+	if ( options.output_file ) {
+		output = strcmp ( options.output_file, "-" ) == 0 ? stdout : fopen ( options.output_file, "w" );
+		if ( !output ) {
+			fprintf ( stderr, "Cannot open %s\n", options.output_file );
+			return 1;
+		}
+	}
+
+	TrajectoryRecorder recorder;
+	TrajectoryCodecOptions compression;
+	compression.position_error = options.compress_error;
+	compression.velocity_error = options.compress_error / options.dt;
+	if ( options.record_file && !recorder.open ( options.record_file, worlds[0], options.dt, options.mode,
+	                                             options.compress_error > 0 ? &compression : NULL ) )
+		return 1;
+
+	ClothScheduler scheduler ( options.threads );
+	if ( options.parallel != "none" )
+		for ( int wi = 0; wi < options.instances; wi++ )
+			worlds[wi]->set_parallel ( scheduler.pool(), options.parallel == "deterministic" );
+	fprintf ( stderr, "%s: %d particles, %s precision, %d instance(s), %d thread(s), parallel %s, %s, dt=%g, %d steps\n",
+		options.resume_file ? options.resume_file : options.scene.c_str(), worlds[0]->particle_count(), precision, options.instances, scheduler.thread_count(),
+		options.parallel.c_str(), options.mode.c_str(), options.dt, options.steps );
+	if ( options.trace_file ) {
+		TRACE_THREAD_NAME ( "main" );
+		Trace::start ();
+	}
+	if ( !options.counted_phases.empty() && !Profiler::compiled_in() )
+		fprintf ( stderr, "--counters needs a make PROFILE=1 build\n" );
+	// opened on this thread, which also runs the counted phases unless instances run side by side
+	for ( int pi = 0; pi < options.counted_phases.size(); pi++ ) {
+		std::string error;
+		if ( !Profiler::count_hardware ( options.counted_phases[pi], &error ) ) {
+			fprintf ( stderr, "No hardware counters ( %s )\n", error.c_str() );
+			break;
+		}
+	}
+
+	// frames are written and recorded between batches of steps, outside of the timed region
+	const int steps = options.steps;
+	double seconds = 0.0, record_seconds = 0.0;
+	if ( options.record_file )
+		recorder.record ( worlds[0] );
+	for ( int done = 0; done < steps; )
+	{
+		int count = steps - done;
+		if ( options.output_every > 0 )
+			count = std::min ( count, options.output_every - done % options.output_every );
+		if ( options.record_file )
+			count = std::min ( count, options.record_every - done % options.record_every );
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		scheduler.simulate ( worlds, count, options.dt, options.mode );
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		seconds += std::chrono::duration<double> ( end - start ).count();
+		done += count;
+
+		if ( output && ( ( options.output_every > 0 && done % options.output_every == 0 ) || done == steps ) )
+			write_frame ( output, worlds[0] );
+		if ( options.record_file && ( done % options.record_every == 0 || done == steps ) ) {
+			recorder.record ( worlds[0] );
+			record_seconds += std::chrono::duration<double> ( std::chrono::steady_clock::now() - end ).count();
+		}
+	}
+	if ( output && steps == 0 )
+		write_frame ( output, worlds[0] );
+	if ( options.record_file ) {
+		if ( !recorder.close () )
+			return 1;
+		fprintf ( stderr, "recorded %d frames, %.1f us per frame on the simulation thread\n",
+			recorder.frames(), 1e6 * record_seconds / std::max ( 1, recorder.frames() - 1 ) );
+	}
+
+	double world_steps = (double)steps * options.instances;
+	fprintf ( stderr, "%.3f s, %.1f steps/s, %.1f ns per particle step\n",
+		seconds, world_steps / seconds, 1e9 * seconds / ( world_steps * worlds[0]->particle_count() ) );
+	if ( options.checkpoint_file && !worlds[0]->save_checkpoint ( options.checkpoint_file ) )
+		return 1;
+
+	// written before the accuracy run so that only the timed steps are in it
+	if ( options.profile_file )
+		Profiler::write_json ( options.profile_file );
+	if ( options.trace_file ) {
+		Trace::stop ();
+		Trace::write_json ( options.trace_file );
+	}
+	if ( !options.counted_phases.empty() )
+		report_counters ( options, worlds[0] );
+	if ( options.accuracy )
+		report_accuracy ( options, worlds[0] );
+
+	if ( output && output != stdout )
+		fclose ( output );
+	for ( int wi = 0; wi < options.instances; wi++ )
+		delete worlds[wi];
+	return 0;
+}
+
+int main ( int argc, char ** argv )
+{
+	Options options;
+	options.scene = "grid:20";
+	options.mode = "";		// from the scene unless given
+	options.parallel = "none";
+	options.obstacle_file = options.output_file = options.profile_file = options.trace_file = options.record_file = NULL;
+	options.checkpoint_file = options.resume_file = NULL;
+	options.dt = 0.0f;
+	options.steps = 1000;
+	options.instances = 1;
+	options.threads = 1;
+	options.output_every = 0;
+	options.record_every = 1;
+	options.compress_error = 0.0;
+	options.accuracy = false;
+	std::string precision = "float";
+
+	for ( int ai = 1; ai < argc; ai++ )
+	{
+		std::string option = argv[ai];
+		if ( option == "-h" || option == "--help" ) {
+			usage ( argv[0] );
+			return 0;
+		}
+		if ( option == "--accuracy" ) {
+			options.accuracy = true;
+			continue;
+		}
+		if ( option == "--unpack" && ai + 2 < argc )
+			return unpack ( argv[ai + 1], argv[ai + 2] );
+		if ( ai + 1 >= argc ) {
+			usage ( argv[0] );
+			return 1;
+		}
+		const char *value = argv[++ai];
+		if ( option == "--scene" )				options.scene = value;
+		else if ( option == "--obstacle" )		options.obstacle_file = value;
+		else if ( option == "--integrator" )	options.mode = value;
+		else if ( option == "--precision" )		precision = value;
+		else if ( option == "--dt" )			options.dt = atof ( value );
+		else if ( option == "--steps" )			options.steps = atoi ( value );
+		else if ( option == "--instances" )		options.instances = atoi ( value );
+		else if ( option == "--threads" )		options.threads = atoi ( value );
+		else if ( option == "--parallel" )		options.parallel = value;
+		else if ( option == "--output" )		options.output_file = value;
+		else if ( option == "--output-every" )	options.output_every = atoi ( value );
+		else if ( option == "--profile" )		options.profile_file = value;
+		else if ( option == "--trace" )			options.trace_file = value;
+		else if ( option == "--record" )		options.record_file = value;
+		else if ( option == "--record-every" )	options.record_every = atoi ( value );
+		else if ( option == "--compress" )		options.compress_error = atof ( value );
+		else if ( option == "--checkpoint" )	options.checkpoint_file = value;
+		else if ( option == "--resume" )		options.resume_file = value;
+		else if ( option == "--counters" ) {
+			std::stringstream in ( value );
+			std::string name;
+			while ( std::getline ( in, name, ',' ) ) {
+				int phase = Profiler::find_phase ( name );
+				if ( phase < 0 ) {
+					fprintf ( stderr, "Unknown phase %s\n", name.c_str() );
+					return 1;
+				}
+				options.counted_phases.push_back ( (ProfilePhase)phase );
+			}
+		}
+		else {
+			fprintf ( stderr, "Unknown option %s\n", option.c_str() );
+			usage ( argv[0] );
+			return 1;
+		}
+	}
+
+	const std::string &scene = options.scene;
+	if ( scene.compare ( 0, 5, "grid:" ) == 0 && atoi ( scene.c_str() + 5 ) >= 3 )
+		options.description = grid_scene ( atoi ( scene.c_str() + 5 ) );
+	else if ( scene.compare ( 0, 5, "grid:" ) == 0 || !load_scene ( scene.c_str(), &options.description ) ) {
+		fprintf ( stderr, "Unknown scene %s\n", scene.c_str() );
+		return 1;
+	}
+	if ( options.mode.empty() )
+		options.mode = options.description.integrator;
+	if ( options.dt <= 0.0f )
+		options.dt = options.description.dt;
+
+	if ( options.mode != "Euler" && options.mode != "Midpoint" && options.mode != "RK4" ) {
+		fprintf ( stderr, "Unknown integrator %s\n", options.mode.c_str() );
+		return 1;
+	}
+	if ( options.parallel != "none" && options.parallel != "fast" && options.parallel != "deterministic" ) {
+		fprintf ( stderr, "Unknown parallel mode %s\n", options.parallel.c_str() );
+		return 1;
+	}
+	if ( options.steps < 0 || options.instances < 1 || options.record_every < 1 || options.compress_error < 0 ) {
+		usage ( argv[0] );
+		return 1;
+	}
+
+	if ( precision == "float" )
+		return run<FloatPrecision> ( options, "float" );
+	if ( precision == "double" )
+		return run<DoublePrecision> ( options, "double" );
+	if ( precision == "mixed" )
+		return run<MixedPrecision> ( options, "mixed" );
+	fprintf ( stderr, "Unknown precision %s\n", precision.c_str() );
+	return 1;
+}
@@ -0,0 +1,89 @@
+#include "ClothWorld.h"
+
+template <class P>
+ClothWorldT<P>::ClothWorldT() :
+	m_Gravity(0.0, -0.03, 0.0), m_pPool(NULL), m_Deterministic(true), m_IncidenceForceCount(-1), m_StepCount(0) {
+}
+
+template <class P>
+ClothWorldT<P>::~ClothWorldT()
+{
+	for ( int ii = 0; ii < pVector.size(); ii++ )
+		delete pVector[ii];
+	for ( int fi = 0; fi < pNonconstraintForceVector.size(); fi++ )
+		delete pNonconstraintForceVector[fi];
+	for ( int ci = 0; ci < colliderVector.size(); ci++ )
+		delete colliderVector[ci];
+}
+
+template <class P>
+int ClothWorldT<P>::add_particle( const Vec &ConstructPos )
+{
+	ParticleType *pParticle = new ParticleType( ConstructPos );
+	pParticle->reset();
+	pVector.push_back( pParticle );
+	return pVector.size() - 1;
+}
+
+template <class P>
+void ClothWorldT<P>::add_force( NonconstraintForce *pForce )
+{
+	if ( pForce->is_spring )
+		( ( SpringType* )pForce )->update_index( pVector );
+	pNonconstraintForceVector.push_back( pForce );
+}
+
+template <class P>
+void ClothWorldT<P>::add_collider( SdfCollider *pCollider )
+{
+	colliderVector.push_back( pCollider );
+}
+
+template <class P>
+void ClothWorldT<P>::pin( int particle )
+{
+	pinnedVector.push_back( particle );
+}
+
+template <class P>
+void ClothWorldT<P>::set_parallel( ThreadPool *pPool, bool deterministic )
+{
+	m_pPool = pPool;
+	m_Deterministic = deterministic;
+}
+
+template <class P>
+void ClothWorldT<P>::enable_sleeping( const std::vector<int> &patch_of_particle )
+{
+	sleepManager.init( patch_of_particle );
+}
+
+template <class P>
+void ClothWorldT<P>::reset()
+{
+	int ii, size = pVector.size();
+	for(ii=0; ii<size; ii++)
+		pVector[ii]->reset();
+	sleepManager.wake_all();
+	m_StepCount = 0;
+}
+
+template <class P>
+void ClothWorldT<P>::clear()
+{
+	for ( int ii = 0; ii < pVector.size(); ii++ )
+		delete pVector[ii];
+	for ( int fi = 0; fi < pNonconstraintForceVector.size(); fi++ )
+		delete pNonconstraintForceVector[fi];
+	pVector.clear();
+	pNonconstraintForceVector.clear();
+	pinnedVector.clear();
+	sleepManager.disable();
+	m_IncidenceForceCount = -1;
+	m_StepCount = 0;
+}
+
+// the members defined in Solver.cpp and Checkpoint.cpp are instantiated there
+template class ClothWorldT<FloatPrecision>;
+template class ClothWorldT<DoublePrecision>;
+template class ClothWorldT<MixedPrecision>;
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "Precision.h"
+#include "Particle.h"
+#include "SpringForce.h"
+#include "SdfCollider.h"
+#include "SleepManager.h"
+#include "ThreadPool.h"
+
+#include <vector>
+#include <string>
+
+// One independent cloth simulation: particles, forces, obstacles and the integrator workspace.
+// Nothing is shared between instances, so separate worlds can be stepped on separate threads.
+// "P" is one of the Precision types, it sets the scalar of the state and of the force sums.
+template <class P>
+class ClothWorldT {
+	public:
+		typedef typename P::Real Real;
+		typedef typename P::Accumulator Accumulator;
+		typedef TVec3<Real> Vec;
+		typedef TVec3<Accumulator> AccumVec;
+		typedef ParticleT<Real> ParticleType;
+		typedef SpringForceT<Real> SpringType;
+
+		ClothWorldT();
+		~ClothWorldT();	// deletes the particles, forces and colliders it owns
+
+		// construction, the world takes ownership of everything passed in
+		int add_particle( const Vec &ConstructPos );
+		void add_force( NonconstraintForce *pForce );
+		void add_collider( SdfCollider *pCollider );
+		void pin( int particle );	// pinned particles never accelerate
+		void enable_sleeping( const std::vector<int> &patch_of_particle );
+
+		void reset();	// every particle back to its construction position, at rest and awake
+		void clear();	// deletes the particles, forces and pins, the obstacles stay
+
+		// Checkpoints, format in Checkpoint.h. load_checkpoint() needs an empty world and
+		// builds its particles, forces, pins, sleep state and step count from the file;
+		// obstacles are not part of a checkpoint, add them afterwards. A failed load leaves
+		// the world partly built, clear() it before building it another way.
+		bool save_checkpoint( const char *fileName ) const;
+		bool load_checkpoint( const char *fileName );
+
+		// Spread force accumulation and the collision pass over "pPool" ( NULL steps serially ).
+		// Deterministic mode uses fixed partitions, one force slot per spring and an ordered
+		// per-particle gather, so trajectories are bit-identical for any thread count and equal
+		// to the serial solver. The fast mode lets every thread accumulate into its own buffer
+		// and sums those, which saves the gather but depends on how chunks were scheduled.
+		void set_parallel( ThreadPool *pPool, bool deterministic );
+
+		/* integration mode:
+		 * Euler for Euler's method, accurate to O(dt)
+		 * Midpoint for midpoint method, accurate to O(dt^2)
+		 * RK4 for Runge-Kutta4 method, accurate to O(dt^4)
+		 */
+		void simulation_step( float dt, const std::string &mode );
+
+		// one evaluation of every force without integrating, what each integrator stage costs
+		void evaluate_forces();
+
+		int particle_count() const { return pVector.size(); }
+		int step_count() const { return m_StepCount; }
+
+		std::vector<ParticleType*> pVector;
+		std::vector<NonconstraintForce*> pNonconstraintForceVector;
+		SleepManager sleepManager;
+
+		Vec m_Gravity;	// acceleration added once per GravityForce in the force list
+
+	private:
+		ClothWorldT( const ClothWorldT & );		// not copyable, particles are owned
+		void operator = ( const ClothWorldT & );
+
+		void interface_update_active_variables();
+		void interface_get_variable_data();
+		void interface_derivative_evaluation();
+		void interface_return_variable_data();
+		void derivative_evaluation_deterministic();
+		void derivative_evaluation_fast();
+		void update_spring_incidence();
+
+		void euler_method( Real dt );
+		void midpoint_method( Real dt );
+		void runge_kutta4_method( Real dt );
+		void collision_pass();
+
+		std::vector<Vec> variableVector;		// in our case, should be [x1,v1,x2,v2,...,xn,vn]
+		std::vector<Vec> derivativeVector;	// should be [v1,f1/m1,...,vn,fn/mn]
+		std::vector<AccumVec> accelerationVector;	// per particle force sum before it is stored in derivativeVector
+		std::vector<int> activeVariableVector;	// indices into variableVector of the particles that are awake
+		std::vector<Vec> initialVariableVector;	// state at the start of a multi-stage step
+
+		std::vector<SdfCollider*> colliderVector;	// static obstacles, resolved after every integration step
+		std::vector<int> pinnedVector;
+
+		ThreadPool *m_pPool;
+		bool m_Deterministic;
+		std::vector<Vec> springForceVector;		// [force on p1, force on p2] for every force index
+		std::vector<char> springActiveVector;		// false when both ends of the spring sleep
+		std::vector<int> incidentOffsetVector;		// per particle, range into incidentForceVector
+		std::vector<int> incidentForceVector;		// 2 * force index + end, ascending force index per particle
+		std::vector<int> gravityForceVector;		// force indices of the gravity forces
+		int m_IncidenceForceCount;					// number of forces the incidence lists were built for
+		std::vector< std::vector<AccumVec> > workerForceVector;	// fast mode accumulators, one per thread
+		std::vector<char> wakeVector;				// sleeping particles touched by an obstacle
+
+		int m_StepCount;
+};
+
+// the viewer's world, instantiated along with the double and mixed ones in ClothWorld.cpp and Solver.cpp
+typedef ClothWorldT<FloatPrecision> ClothWorld;
@@ -0,0 +1,29 @@
+// Legacy OpenGL drawing of the physics objects, only linked into the viewer
+// so that the physics sources build without any graphics library.
+
+#include "Particle.h"
+#include "SpringForce.h"
+#include <GL/glut.h>
+
+template <>
+void Particle::draw() {
+	const double h = 0.03;
+	glColor3f(1.f, 1.f, 1.f); 
+	glBegin(GL_QUADS);
+	glVertex2f(m_Position[0]-h/2.0, m_Position[1]-h/2.0);
+	glVertex2f(m_Position[0]+h/2.0, m_Position[1]-h/2.0);
+	glVertex2f(m_Position[0]+h/2.0, m_Position[1]+h/2.0);
+	glVertex2f(m_Position[0]-h/2.0, m_Position[1]+h/2.0);
+	glEnd();
+}
+
+template <>
+void SpringForce::draw()
+{
+  glBegin( GL_LINES );
+  glColor3f(0.6, 0.7, 0.8);
+  glVertex2f( m_p1->m_Position[0], m_p1->m_Position[1] );
+  glColor3f(0.6, 0.7, 0.8);
+  glVertex2f( m_p2->m_Position[0], m_p2->m_Position[1] );
+  glEnd();
+}
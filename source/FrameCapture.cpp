@@ -0,0 +1,394 @@
+#include "FrameCapture.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdio.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// RGB to BT.601 studio range YCbCr in 8 bit fixed point, the coefficients ffmpeg and x264 use:
+// luma from each pixel, chroma from the sum of a 2 by 2 block of pixels ( hence the shift by 10 ).
+// The SSE2 loops take 8 pixels of luma or 4 of chroma at a time and give the same bytes as the
+// plain loops, which do the rest of a row and everything on other processors.
+
+static inline unsigned char luma( const unsigned char *p )
+{
+	return ( ( 66 * p[0] + 129 * p[1] + 25 * p[2] + 128 ) >> 8 ) + 16;
+}
+
+static void rgba_to_luma( const unsigned char *rgba, unsigned char *y, int width )
+{
+	int x = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i coef = _mm_setr_epi16( 66, 129, 25, 0, 66, 129, 25, 0 );
+	const __m128i round = _mm_set1_epi32( 128 ), offset = _mm_set1_epi32( 16 );
+	for ( ; x + 8 <= width; x += 8 ) {
+		__m128i sums[2];
+		for ( int hi = 0; hi < 2; hi++ ) {
+			__m128i px = _mm_loadu_si128( (const __m128i *)( rgba + 4 * ( x + 4 * hi ) ) );
+			// per pixel 66 r + 129 g and 25 b, then the two added
+			__m128i m0 = _mm_madd_epi16( _mm_unpacklo_epi8( px, zero ), coef );
+			__m128i m1 = _mm_madd_epi16( _mm_unpackhi_epi8( px, zero ), coef );
+			m0 = _mm_add_epi32( m0, _mm_shuffle_epi32( m0, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+			m1 = _mm_add_epi32( m1, _mm_shuffle_epi32( m1, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+			sums[hi] = _mm_castps_si128( _mm_shuffle_ps( _mm_castsi128_ps( m0 ), _mm_castsi128_ps( m1 ), _MM_SHUFFLE( 2, 0, 2, 0 ) ) );
+			sums[hi] = _mm_add_epi32( _mm_srai_epi32( _mm_add_epi32( sums[hi], round ), 8 ), offset );
+		}
+		__m128i words = _mm_packs_epi32( sums[0], sums[1] );
+		_mm_storel_epi64( (__m128i *)( y + x ), _mm_packus_epi16( words, words ) );
+	}
+#endif
+	for ( ; x < width; x++ )
+		y[x] = luma( rgba + 4 * x );
+}
+
+// "r", "g", "b": sums over a 2 by 2 block
+static inline void chroma( int r, int g, int b, unsigned char *u, unsigned char *v )
+{
+	*u = ( ( -38 * r - 74 * g + 112 * b + 512 ) >> 10 ) + 128;
+	*v = ( ( 112 * r - 94 * g - 18 * b + 512 ) >> 10 ) + 128;
+}
+
+// one row of chroma from two rows of pixels, the last column repeated for an odd width
+static void rgba_to_chroma( const unsigned char *row0, const unsigned char *row1, unsigned char *u, unsigned char *v, int width )
+{
+	int cx = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i coefU = _mm_setr_epi16( -38, -74, 112, 0, -38, -74, 112, 0 );
+	const __m128i coefV = _mm_setr_epi16( 112, -94, -18, 0, 112, -94, -18, 0 );
+	const __m128i round = _mm_set1_epi32( 512 ), offset = _mm_set1_epi32( 128 );
+	for ( ; 2 * cx + 4 <= width; cx += 2 ) {
+		__m128i a = _mm_loadu_si128( (const __m128i *)( row0 + 8 * cx ) );
+		__m128i b = _mm_loadu_si128( (const __m128i *)( row1 + 8 * cx ) );
+		__m128i lo = _mm_add_epi16( _mm_unpacklo_epi8( a, zero ), _mm_unpacklo_epi8( b, zero ) );
+		__m128i hi = _mm_add_epi16( _mm_unpackhi_epi8( a, zero ), _mm_unpackhi_epi8( b, zero ) );
+		// r g b a sums of the two blocks
+		__m128i blocks = _mm_unpacklo_epi64( _mm_add_epi16( lo, _mm_srli_si128( lo, 8 ) ), _mm_add_epi16( hi, _mm_srli_si128( hi, 8 ) ) );
+		__m128i mu = _mm_madd_epi16( blocks, coefU ), mv = _mm_madd_epi16( blocks, coefV );
+		mu = _mm_add_epi32( mu, _mm_shuffle_epi32( mu, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+		mv = _mm_add_epi32( mv, _mm_shuffle_epi32( mv, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+		__m128i uv = _mm_castps_si128( _mm_shuffle_ps( _mm_castsi128_ps( mu ), _mm_castsi128_ps( mv ), _MM_SHUFFLE( 2, 0, 2, 0 ) ) );
+		uv = _mm_add_epi32( _mm_srai_epi32( _mm_add_epi32( uv, round ), 10 ), offset );
+		__m128i words = _mm_packs_epi32( uv, uv );
+		int bytes = _mm_cvtsi128_si32( _mm_packus_epi16( words, words ) );
+		u[cx] = bytes;
+		u[cx + 1] = bytes >> 8;
+		v[cx] = bytes >> 16;
+		v[cx + 1] = bytes >> 24;
+	}
+#endif
+	for ( ; 2 * cx < width; cx++ ) {
+		const unsigned char *p0 = row0 + 8 * cx, *p1 = row1 + 8 * cx;
+		int right = 2 * cx + 1 < width ? 4 : 0;
+		chroma( p0[0] + p0[right] + p1[0] + p1[right], p0[1] + p0[right + 1] + p1[1] + p1[right + 1],
+		        p0[2] + p0[right + 2] + p1[2] + p1[right + 2], &u[cx], &v[cx] );
+	}
+}
+
+// a YUV4MPEG2 frame from bottom-up RGBA rows, the last row repeated for an odd height
+static void rgba_to_y4m( const unsigned char *rgba, int width, int height, std::vector<unsigned char> &out )
+{
+	static const char FRAME_HEADER[] = "FRAME\n";
+	const int header = sizeof( FRAME_HEADER ) - 1;
+	const int cw = ( width + 1 ) / 2, ch = ( height + 1 ) / 2;
+	out.resize( header + (size_t)width * height + 2 * (size_t)cw * ch );
+	memcpy( &out[0], FRAME_HEADER, header );
+	unsigned char *y = &out[header], *u = y + (size_t)width * height, *v = u + (size_t)cw * ch;
+	const size_t stride = 4 * (size_t)width;
+	for ( int ri = 0; ri < height; ri++ )
+		rgba_to_luma( rgba + ( height - 1 - ri ) * stride, y + (size_t)ri * width, width );
+	for ( int ci = 0; ci < ch; ci++ ) {
+		int r0 = height - 1 - 2 * ci, r1 = std::max( 0, r0 - 1 );
+		rgba_to_chroma( rgba + r0 * stride, rgba + r1 * stride, u + (size_t)ci * cw, v + (size_t)ci * cw, width );
+	}
+}
+
+FrameCapture::FrameCapture() :
+	m_Next( 0 ), m_Allocated( 0 ), m_Busy( 0 ), m_Failed( false ), m_Quit( false ),
+	m_Stream( NULL ), m_Format( CAPTURE_PNG ), m_FramesPerSecond( 0 ), m_StreamWidth( 0 ), m_StreamHeight( 0 ),
+	m_Frames( 0 ), m_NextWrite( 0 ), m_Dropped( 0 )
+{
+	for ( int si = 0; si < CAPTURE_SLOTS; si++ ) {
+		m_Slots[si].buffer = 0;
+		m_Slots[si].capacity = 0;
+		m_Slots[si].fence = 0;
+		m_Slots[si].width = m_Slots[si].height = 0;
+		m_Slots[si].copies = 1;
+	}
+}
+
+FrameCapture::~FrameCapture()
+{
+	release();
+}
+
+void FrameCapture::create( int encoders )
+{
+	for ( int si = 0; si < CAPTURE_SLOTS; si++ )
+		glGenBuffers( 1, &m_Slots[si].buffer );
+	m_Next = 0;
+	m_Failed = m_Quit = false;
+	for ( int ei = 0; ei < std::max( 1, encoders ); ei++ )
+		m_Encoders.push_back( std::thread( &FrameCapture::encoder_loop, this ) );
+}
+
+void FrameCapture::release()
+{
+	if ( m_Encoders.empty() )
+		return;
+	finish();
+
+	{
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		m_Quit = true;
+	}
+	m_Full.notify_all();
+	for ( int ei = 0; ei < m_Encoders.size(); ei++ )
+		m_Encoders[ei].join();
+	m_Encoders.clear();
+	close_stream();
+
+	for ( int si = 0; si < CAPTURE_SLOTS; si++ ) {
+		glDeleteBuffers( 1, &m_Slots[si].buffer );
+		m_Slots[si].buffer = 0;
+		m_Slots[si].capacity = 0;
+	}
+	for ( int fi = 0; fi < m_Spare.size(); fi++ )
+		delete m_Spare[fi];
+	m_Spare.clear();
+	m_Allocated = 0;
+}
+
+bool FrameCapture::open_stream( const char *fileName, CaptureFormat format, int framesPerSecond )
+{
+	finish();
+	close_stream();
+	if ( format == CAPTURE_PNG )
+		return true;
+
+	if ( !strcmp( fileName, "-" ) ) {
+		// the frames keep stdout to themselves, the viewer's messages go to stderr from now on
+		fflush( stdout );
+		int fd = dup( fileno( stdout ) );
+		m_Stream = fd < 0 ? NULL : fdopen( fd, "wb" );
+		if ( m_Stream )
+			dup2( fileno( stderr ), fileno( stdout ) );
+	} else
+		m_Stream = fopen( fileName, "wb" );
+	if ( !m_Stream ) {
+		fprintf( stderr, "Cannot write video %s\n", fileName );
+		return false;
+	}
+	m_Format = format;
+	m_FramesPerSecond = framesPerSecond;
+	m_StreamWidth = m_StreamHeight = 0;
+	m_Frames = m_NextWrite = m_Dropped = 0;
+	return true;
+}
+
+void FrameCapture::close_stream()
+{
+	if ( !m_Stream )
+		return;
+	if ( m_Dropped > 0 )
+		fprintf( stderr, "Dropped %ld frames that were not %dx%d from the video\n", m_Dropped, m_StreamWidth, m_StreamHeight );
+	fclose( m_Stream );
+	m_Stream = NULL;
+	m_Format = CAPTURE_PNG;
+}
+
+void FrameCapture::capture( const char *fileName, int width, int height, int copies )
+{
+	// hand on the readbacks that have already arrived, oldest first, without waiting for any
+	for ( int si = 0; si < CAPTURE_SLOTS; si++ ) {
+		Slot &slot = m_Slots[ ( m_Next + si ) % CAPTURE_SLOTS ];
+		if ( !slot.fence )
+			continue;
+		GLenum state = glClientWaitSync( slot.fence, 0, 0 );
+		if ( state != GL_ALREADY_SIGNALED && state != GL_CONDITION_SATISFIED )
+			break;
+		collect( slot );
+	}
+
+	// the slot to reuse is the oldest; it only waits when every slot is still in flight
+	Slot &slot = m_Slots[m_Next];
+	if ( slot.fence )
+		collect( slot );
+	m_Next = ( m_Next + 1 ) % CAPTURE_SLOTS;
+
+	size_t bytes = (size_t)width * height * 4;
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, slot.buffer );
+	if ( bytes > slot.capacity ) {
+		glBufferData( GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ );
+		slot.capacity = bytes;
+	}
+	glPixelStorei( GL_PACK_ALIGNMENT, 4 );
+	glReadPixels( 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0 );	// into the buffer, returns at once
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+	slot.fence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+	slot.width = width;
+	slot.height = height;
+	slot.fileName = fileName;
+	slot.copies = copies;
+}
+
+bool FrameCapture::finish()
+{
+	for ( int si = 0; si < CAPTURE_SLOTS; si++ ) {
+		Slot &slot = m_Slots[ ( m_Next + si ) % CAPTURE_SLOTS ];
+		if ( slot.fence )
+			collect( slot );
+	}
+
+	std::unique_lock<std::mutex> lock( m_Mutex );
+	m_Idle.wait( lock, [&]{ return m_Queue.empty() && m_Busy == 0; } );
+	if ( m_Stream && fflush( m_Stream ) != 0 )
+		m_Failed = true;
+	bool ok = !m_Failed;
+	m_Failed = false;
+	return ok;
+}
+
+void FrameCapture::collect( Slot &slot )
+{
+	while ( glClientWaitSync( slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000 ) == GL_TIMEOUT_EXPIRED )
+		;
+	glDeleteSync( slot.fence );
+	slot.fence = 0;
+
+	// a stream has one frame size
+	if ( m_Stream && !m_StreamWidth ) {
+		m_StreamWidth = slot.width;
+		m_StreamHeight = slot.height;
+	}
+	if ( m_Stream && ( slot.width != m_StreamWidth || slot.height != m_StreamHeight ) ) {
+		m_Dropped++;
+		return;
+	}
+
+	Frame *pFrame = spare_frame();
+	size_t bytes = (size_t)slot.width * slot.height * 4;
+	pFrame->pixels.resize( bytes );
+	pFrame->width = slot.width;
+	pFrame->height = slot.height;
+	pFrame->fileName.swap( slot.fileName );
+	pFrame->copies = slot.copies;
+
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, slot.buffer );
+	const void *pixels = glMapBufferRange( GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT );
+	if ( pixels ) {
+		memcpy( &pFrame->pixels[0], pixels, bytes );
+		glUnmapBuffer( GL_PIXEL_PACK_BUFFER );
+	}
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+
+	{
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		if ( pixels ) {
+			// numbered only once it is queued, a frame that is not would stall every later turn
+			pFrame->index = m_Stream ? m_Frames++ : -1;
+			m_Queue.push_back( pFrame );
+		} else {
+			fprintf( stderr, "Cannot map the pixels of %s\n", pFrame->fileName.c_str() );
+			m_Spare.push_back( pFrame );
+			m_Failed = true;
+		}
+	}
+	m_Full.notify_one();
+}
+
+FrameCapture::Frame *FrameCapture::spare_frame()
+{
+	std::unique_lock<std::mutex> lock( m_Mutex );
+	if ( m_Spare.empty() && m_Allocated == CAPTURE_FRAMES )
+		m_Empty.wait( lock, [&]{ return !m_Spare.empty(); } );
+	if ( m_Spare.empty() ) {
+		m_Allocated++;
+		return new Frame();
+	}
+	Frame *pFrame = m_Spare.back();
+	m_Spare.pop_back();
+	return pFrame;
+}
+
+void FrameCapture::encoder_loop()
+{
+	TRACE_THREAD_NAME( "png encoder" );
+	for ( ;; )
+	{
+		Frame *pFrame;
+		{
+			std::unique_lock<std::mutex> lock( m_Mutex );
+			m_Full.wait( lock, [&]{ return m_Quit || !m_Queue.empty(); } );
+			if ( m_Queue.empty() )
+				return;		// quitting with nothing left to write
+			pFrame = m_Queue.front();
+			m_Queue.pop_front();
+			m_Busy++;
+		}
+
+		bool ok;
+		if ( pFrame->index >= 0 )
+			ok = write_stream( pFrame );
+		else {
+			TRACE_SCOPE( "png write" );
+			ok = saveImageRGBA( &pFrame->fileName[0], &pFrame->pixels[0], pFrame->width, pFrame->height, m_PngOptions );
+			if ( ok )
+				printf( "Dumped %s.\n", pFrame->fileName.c_str() );
+			else
+				fprintf( stderr, "Cannot write %s\n", pFrame->fileName.c_str() );
+		}
+
+		{
+			std::lock_guard<std::mutex> lock( m_Mutex );
+			m_Failed = m_Failed || !ok;
+			m_Spare.push_back( pFrame );
+			m_Busy--;
+		}
+		m_Empty.notify_one();
+		m_Idle.notify_all();
+	}
+}
+
+bool FrameCapture::write_stream( Frame *pFrame )
+{
+	if ( m_Format == CAPTURE_Y4M ) {
+		TRACE_SCOPE( "yuv convert" );
+		rgba_to_y4m( &pFrame->pixels[0], pFrame->width, pFrame->height, pFrame->coded );
+	}
+
+	// converted side by side, written one at a time in capture order
+	{
+		std::unique_lock<std::mutex> lock( m_Mutex );
+		m_Turn.wait( lock, [&]{ return m_NextWrite == pFrame->index; } );
+	}
+	bool ok = true;
+	{
+		TRACE_SCOPE( "video write" );
+		if ( pFrame->index == 0 && m_Format == CAPTURE_Y4M )
+			ok = fprintf( m_Stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+			              pFrame->width, pFrame->height, m_FramesPerSecond ) > 0;
+		for ( int copy = 0; copy < pFrame->copies && ok; copy++ )
+			if ( m_Format == CAPTURE_Y4M )
+				ok = fwrite( &pFrame->coded[0], 1, pFrame->coded.size(), m_Stream ) == pFrame->coded.size();
+			else {
+				// the rows come bottom-up from GL
+				const size_t stride = 4 * (size_t)pFrame->width;
+				for ( int ri = pFrame->height - 1; ri >= 0 && ok; ri-- )
+					ok = fwrite( &pFrame->pixels[ri * stride], 1, stride, m_Stream ) == stride;
+			}
+	}
+	{
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		m_NextWrite++;
+	}
+	m_Turn.notify_all();
+	if ( !ok )
+		fprintf( stderr, "Cannot write video frame %ld\n", pFrame->index );
+	return ok;
+}
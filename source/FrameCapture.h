@@ -0,0 +1,109 @@
+#pragma once
+
+#include <GL/glew.h>
+#include "imageio.h"
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+#include <stdio.h>
+
+// Frame dumping without stalling the viewer. capture() only starts an asynchronous glReadPixels
+// into one of CAPTURE_SLOTS pixel pack buffers and returns; a readback is collected frames later,
+// once its fence has signalled, copied into a pooled frame and handed to the encoder threads,
+// which write the PNGs. If the encoders fall behind by more than CAPTURE_FRAMES frames, capture()
+// waits instead of dropping frames.
+//
+// With open_stream() the frames go into one video stream instead, no deflate and no file per
+// frame: raw RGBA, or YUV4MPEG2 ( 4:2:0, BT.601 studio range, as ffmpeg reads it from a pipe ).
+// The encoders convert frames side by side and write them in capture order.
+
+const int CAPTURE_SLOTS = 3;	// readbacks in flight on the GPU
+const int CAPTURE_FRAMES = 8;	// frames waiting for or being encoded before capture() waits
+
+enum CaptureFormat {
+	CAPTURE_PNG,	// img%.5i.png files, the default
+	CAPTURE_Y4M,	// one YUV4MPEG2 stream
+	CAPTURE_RGBA	// one stream of raw top-down RGBA frames, nothing else
+};
+
+class FrameCapture {
+	public:
+		FrameCapture();
+		~FrameCapture();	// release(), needs the context to still be current
+
+		// creates the pixel pack buffers and starts "encoders" threads ( at least one ), once,
+		// needs a current GL context; a stream may be opened before
+		void create( int encoders );
+		void release();		// also closes the stream
+
+		// how the PNGs are written, see imageio.h
+		void set_png_options( const PngOptions &options ) { m_PngOptions = options; }
+
+		// the following frames go to "fileName" in "format", not to PNGs; "-" is stdout, whose
+		// other output then moves to stderr. Every frame of a stream has the size of the first,
+		// frames of another size are dropped. Returns false if the file cannot be created
+		bool open_stream( const char *fileName, CaptureFormat format, int framesPerSecond );
+
+		// reads the "width" by "height" RGBA framebuffer of the frame just drawn, to be written to
+		// "fileName" unless there is a stream, which gets it "copies" times in a row; earlier
+		// readbacks that have arrived go to the encoders
+		void capture( const char *fileName, int width, int height, int copies = 1 );
+
+		// collects every readback and waits until all frames are written and the stream is flushed;
+		// returns false if any write since the last finish() failed
+		bool finish();
+
+	private:
+		FrameCapture( const FrameCapture & );
+		void operator = ( const FrameCapture & );
+
+		struct Slot {
+			GLuint buffer;
+			size_t capacity;	// bytes of "buffer"
+			GLsync fence;		// 0 unless a readback is in flight
+			int width, height;
+			std::string fileName;
+			int copies;
+		};
+
+		struct Frame {
+			std::vector<unsigned char> pixels;	// bottom row first, as read
+			int width, height;
+			std::string fileName;
+			long index;							// in the stream
+			int copies;							// times it is written to the stream
+			std::vector<unsigned char> coded;	// the Y4M frame
+		};
+
+		void collect( Slot &slot );		// waits for the readback of "slot" and queues its frame
+		Frame *spare_frame();
+		void encoder_loop();
+		bool write_stream( Frame *pFrame );	// on an encoder thread
+		void close_stream();
+
+		Slot m_Slots[CAPTURE_SLOTS];
+		int m_Next;						// slot the next capture() reads into, the oldest in flight
+
+		std::vector<std::thread> m_Encoders;
+		std::mutex m_Mutex;
+		std::condition_variable m_Full, m_Empty, m_Idle;
+		std::deque<Frame*> m_Queue;		// read frames waiting for an encoder
+		std::vector<Frame*> m_Spare;	// written frames ready for reuse
+		int m_Allocated;
+		int m_Busy;						// frames being encoded
+		bool m_Failed, m_Quit;
+
+		PngOptions m_PngOptions;		// read by the encoders, set before capturing
+		FILE *m_Stream;					// NULL when writing PNGs
+		CaptureFormat m_Format;
+		int m_FramesPerSecond;
+		int m_StreamWidth, m_StreamHeight;	// of the first frame, 0 before it
+		long m_Frames;					// frames queued for the stream
+		long m_NextWrite;				// the frame whose turn it is to be written
+		long m_Dropped;					// frames not the stream's size
+		std::condition_variable m_Turn;
+};
@@ -0,0 +1,45 @@
+#include "FrameScheduler.h"
+
+#include <algorithm>
+
+FrameScheduler::FrameScheduler( double step_rate, int max_steps_per_frame ) :
+	m_StepPeriod( 1.0 / step_rate ), m_MaxStepsPerFrame( max_steps_per_frame ),
+	m_Accumulator( 0.0 ), m_Running( false ), m_DroppedSteps( 0 ) {
+}
+
+void FrameScheduler::restart()
+{
+	m_Accumulator = 0.0;
+	m_Running = false;
+}
+
+int FrameScheduler::steps_due()
+{
+	clock::time_point now = clock::now();
+	if ( !m_Running ) {
+		m_LastFrame = now;
+		m_Running = true;
+	}
+	m_Accumulator += std::chrono::duration<double>( now - m_LastFrame ).count();
+	m_LastFrame = now;
+
+	int steps = (int)( m_Accumulator / m_StepPeriod );
+	if ( steps > m_MaxStepsPerFrame ) {
+		// too far behind to catch up, the simulation runs slow for a moment instead
+		m_DroppedSteps += steps - m_MaxStepsPerFrame;
+		m_Accumulator -= ( steps - m_MaxStepsPerFrame ) * m_StepPeriod;
+		steps = m_MaxStepsPerFrame;
+	}
+	m_Accumulator -= steps * m_StepPeriod;
+	return steps;
+}
+
+float FrameScheduler::interpolation() const
+{
+	return std::min( 1.0, std::max( 0.0, m_Accumulator / m_StepPeriod ) );
+}
+
+double FrameScheduler::seconds_to_next_step() const
+{
+	return std::max( 0.0, m_StepPeriod - m_Accumulator );
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <chrono>
+
+// Fixed time step driver for the viewer.
+// Wall clock time goes into an accumulator and is paid out in whole simulation steps, so the
+// simulated speed no longer depends on how often GLUT calls back or how long a frame takes to
+// draw. What is left over says how far between the last two states the frame should be drawn.
+class FrameScheduler {
+	public:
+		// "step_rate" simulation steps per wall clock second, never more than
+		// "max_steps_per_frame" per frame ( a slow frame drops time instead of spiralling )
+		FrameScheduler( double step_rate, int max_steps_per_frame );
+
+		void restart();		// forget the time that passed, e.g. while paused
+		int steps_due();	// steps to simulate before drawing the frame that starts now
+		float interpolation() const;	// 0 draws the previous state, 1 the current one
+		double seconds_to_next_step() const;
+		double step_period() const { return m_StepPeriod; }
+
+		int dropped_steps() const { return m_DroppedSteps; }
+
+	private:
+		typedef std::chrono::steady_clock clock;
+
+		double m_StepPeriod;	// wall clock seconds per simulation step
+		int m_MaxStepsPerFrame;
+		double m_Accumulator;	// wall clock seconds not simulated yet
+		clock::time_point m_LastFrame;
+		bool m_Running;
+		int m_DroppedSteps;
+};
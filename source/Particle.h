@@ -2,19 +2,25 @@
 
 #include <gfx/vec3.h>
 
-class Particle
+template <class Real>
+class ParticleT
 {
 public:
+	typedef TVec3<Real> Vec;
 
-	Particle(const Vec3f & ConstructPos);
-	virtual ~Particle(void);
+	ParticleT(const Vec & ConstructPos);
+	virtual ~ParticleT(void);
 
 	void reset();	// return the particle back to construction position and set velocity back to zero
 	void draw();	// draw the particle as a square ( with white color and side length h = 0.03 )
 	
-	void operator = ( const Particle* pParticle );
+	void operator = ( const ParticleT* pParticle );
 
-	Vec3f m_ConstructPos;	// starting position
-	Vec3f m_Position;	// current position
-	Vec3f m_Velocity;	// current velocity
+	Vec m_ConstructPos;	// starting position
+	Vec m_Position;	// current position
+	Vec m_Velocity;	// current velocity
 };
+
+// the viewer simulates and draws single precision particles
+typedef ParticleT<float> Particle;
+template <> void ParticleT<float>::draw();	// defined in Drawing.cpp
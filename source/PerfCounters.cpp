@@ -0,0 +1,109 @@
+#include "PerfCounters.h"
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+static const char *EVENT_NAMES[PERF_EVENT_COUNT] = {
+	"cycles", "instructions", "cache_references", "cache_misses", "branch_misses"
+};
+
+PerfSample PerfSample::difference( const PerfSample &begin, const PerfSample &end )
+{
+	PerfSample delta;
+	for ( int ei = 0; ei < PERF_EVENT_COUNT; ei++ ) {
+		delta.valid[ei] = begin.valid[ei] && end.valid[ei];
+		delta.value[ei] = delta.valid[ei] ? end.value[ei] - begin.value[ei] : 0;
+	}
+	return delta;
+}
+
+const char *PerfCounters::event_name( PerfEvent event )
+{
+	return EVENT_NAMES[event];
+}
+
+#ifdef __linux__
+
+static const unsigned long long EVENT_CONFIGS[PERF_EVENT_COUNT] = {
+	PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_REFERENCES,
+	PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+PerfCounters::PerfCounters()
+{
+	for ( int ei = 0; ei < PERF_EVENT_COUNT; ei++ )
+	{
+		struct perf_event_attr attr;
+		memset( &attr, 0, sizeof( attr ) );
+		attr.size = sizeof( attr );
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = EVENT_CONFIGS[ei];
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		// this thread on any cpu
+		m_Fd[ei] = syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+		if ( m_Fd[ei] < 0 && m_Error.empty() )
+			m_Error = std::string( "perf_event_open " ) + EVENT_NAMES[ei] + ": " + strerror( errno );
+	}
+	if ( available() )
+		m_Error.clear();
+}
+
+PerfCounters::~PerfCounters()
+{
+	for ( int ei = 0; ei < PERF_EVENT_COUNT; ei++ )
+		if ( m_Fd[ei] >= 0 )
+			close( m_Fd[ei] );
+}
+
+void PerfCounters::read( PerfSample *sample ) const
+{
+	for ( int ei = 0; ei < PERF_EVENT_COUNT; ei++ )
+	{
+		// value, time enabled, time running
+		unsigned long long data[3];
+		sample->valid[ei] = m_Fd[ei] >= 0 && ::read( m_Fd[ei], data, sizeof( data ) ) == sizeof( data ) && data[2] > 0;
+		sample->value[ei] = 0;
+		if ( sample->valid[ei] )
+			sample->value[ei] = data[2] < data[1] ? (long long)( (double)data[0] * data[1] / data[2] ) : data[0];
+	}
+}
+
+#else
+
+PerfCounters::PerfCounters() : m_Error( "hardware counters need Linux perf_event_open" )
+{
+	for ( int ei = 0; ei < PERF_EVENT_COUNT; ei++ )
+		m_Fd[ei] = -1;
+}
+
+PerfCounters::~PerfCounters()
+{
+}
+
+void PerfCounters::read( PerfSample *sample ) const
+{
+	for ( int ei = 0; ei < PERF_EVENT_COUNT; ei++ ) {
+		sample->valid[ei] = false;
+		sample->value[ei] = 0;
+	}
+}
+
+#endif
+
+bool PerfCounters::available() const
+{
+	for ( int ei = 0; ei < PERF_EVENT_COUNT; ei++ )
+		if ( m_Fd[ei] >= 0 )
+			return true;
+	return false;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+
+// Hardware performance counters of the calling thread through Linux perf_event_open.
+// Only user space is counted, which an unprivileged process may do as long as
+// /proc/sys/kernel/perf_event_paranoid is 2 or lower. Each event is opened on its own,
+// so a machine or VM that lacks some events still gets the others; when none can be
+// opened ( other systems, containers without a PMU, a stricter paranoid setting )
+// available() is false, error() says why and every read comes back invalid.
+// Counters follow the thread that created them, pool workers are not included.
+
+enum PerfEvent {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_REFERENCES,
+	PERF_CACHE_MISSES,		// usually last level cache misses, i.e. lines fetched from memory
+	PERF_BRANCH_MISSES,
+	PERF_EVENT_COUNT
+};
+
+const int PERF_CACHE_LINE_BYTES = 64;	// to turn cache misses into memory traffic
+
+struct PerfSample {
+	long long value[PERF_EVENT_COUNT];	// scaled up when the kernel had to multiplex the events
+	bool valid[PERF_EVENT_COUNT];
+
+	// "end" minus "begin", valid where both are
+	static PerfSample difference( const PerfSample &begin, const PerfSample &end );
+};
+
+class PerfCounters {
+	public:
+		PerfCounters();		// opens and starts the counters
+		~PerfCounters();
+
+		bool available() const;
+		const std::string &error() const { return m_Error; }
+
+		// running totals since construction
+		void read( PerfSample *sample ) const;
+
+		static const char *event_name( PerfEvent event );
+
+	private:
+		PerfCounters( const PerfCounters & );
+		void operator = ( const PerfCounters & );
+
+		int m_Fd[PERF_EVENT_COUNT];		// -1 where the event could not be opened
+		std::string m_Error;
+};
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <gfx/vec3.h>
+
+// Scalar types of the simulation core.
+// "Real" is what particle state is stored and forces are computed in, "Accumulator" is used
+// where many terms are summed: per-particle force totals and the reductions of ConjGrad.
+template <class State, class Accum>
+struct Precision {
+	typedef State Real;
+	typedef Accum Accumulator;
+};
+
+typedef Precision<float, float> FloatPrecision;		// what the viewer runs, half the bandwidth
+typedef Precision<double, double> DoublePrecision;	// reference accuracy
+typedef Precision<float, double> MixedPrecision;	// float state and forces, double sums
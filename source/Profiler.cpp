@@ -0,0 +1,227 @@
+#include "Profiler.h"
+
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <vector>
+#include <cmath>
+#include <stdio.h>
+
+const int ROLLING_SAMPLES = 512;	// per phase, older samples are overwritten
+
+static const char *PHASE_NAMES[PHASE_COUNT] = {
+	"step", "gather", "forces", "integrate", "collision", "cg_iteration", "mesh_build", "gl_upload", "frame_capture"
+};
+static const char *COUNTER_NAMES[COUNTER_COUNT] = {
+	"steps", "force_evaluations", "cg_iterations", "frames"
+};
+
+// all fields are atomics so that recording needs no lock; a reader may see a sample
+// counted but not written yet, which only blurs one frame of statistics
+struct PhaseTable {
+	std::atomic<long> calls;
+	std::atomic<long long> total_ns;
+	std::atomic<unsigned int> next;
+	std::atomic<unsigned int> samples_ns[ROLLING_SAMPLES];	// saturates at ~4 s
+	std::atomic<long> hardware_calls;
+	std::atomic<long> hardware_valid_calls[PERF_EVENT_COUNT];
+	std::atomic<long long> hardware_total[PERF_EVENT_COUNT];
+};
+
+static PhaseTable phase_tables[PHASE_COUNT];
+static std::atomic<long> counters[COUNTER_COUNT];
+static std::atomic<unsigned int> hardware_phases( 0 );	// bit per phase
+
+// opened the first time a thread enters a counted phase, closed when the thread ends
+static thread_local std::unique_ptr<PerfCounters> thread_counters;
+
+static PerfCounters *local_counters()
+{
+	if ( !thread_counters )
+		thread_counters.reset( new PerfCounters() );
+	return thread_counters.get();
+}
+
+bool Profiler::compiled_in()
+{
+#ifdef CLOTH_PROFILE
+	return true;
+#else
+	return false;
+#endif
+}
+
+void Profiler::record( ProfilePhase phase, double seconds )
+{
+	PhaseTable &table = phase_tables[phase];
+	double ns = std::min( seconds * 1e9, 4e9 );
+	table.calls.fetch_add( 1, std::memory_order_relaxed );
+	table.total_ns.fetch_add( (long long)ns, std::memory_order_relaxed );
+	unsigned int slot = table.next.fetch_add( 1, std::memory_order_relaxed ) % ROLLING_SAMPLES;
+	table.samples_ns[slot].store( (unsigned int)ns, std::memory_order_relaxed );
+}
+
+void Profiler::count( ProfileCounter counter, long n )
+{
+	counters[counter].fetch_add( n, std::memory_order_relaxed );
+}
+
+long Profiler::counter( ProfileCounter counter )
+{
+	return counters[counter].load( std::memory_order_relaxed );
+}
+
+const char *Profiler::phase_name( ProfilePhase phase )
+{
+	return PHASE_NAMES[phase];
+}
+
+int Profiler::find_phase( const std::string &name )
+{
+	for ( int pi = 0; pi < PHASE_COUNT; pi++ )
+		if ( name == PHASE_NAMES[pi] )
+			return pi;
+	return -1;
+}
+
+const char *Profiler::counter_name( ProfileCounter counter )
+{
+	return COUNTER_NAMES[counter];
+}
+
+void Profiler::reset()
+{
+	for ( int pi = 0; pi < PHASE_COUNT; pi++ ) {
+		phase_tables[pi].calls = 0;
+		phase_tables[pi].total_ns = 0;
+		phase_tables[pi].next = 0;
+		phase_tables[pi].hardware_calls = 0;
+		for ( int ei = 0; ei < PERF_EVENT_COUNT; ei++ ) {
+			phase_tables[pi].hardware_valid_calls[ei] = 0;
+			phase_tables[pi].hardware_total[ei] = 0;
+		}
+	}
+	for ( int ci = 0; ci < COUNTER_COUNT; ci++ )
+		counters[ci] = 0;
+}
+
+bool Profiler::count_hardware( ProfilePhase phase, std::string *error )
+{
+	PerfCounters *counters = local_counters();
+	if ( !counters->available() ) {
+		*error = counters->error();
+		return false;
+	}
+	hardware_phases |= 1u << phase;
+	return true;
+}
+
+bool Profiler::counting_hardware( ProfilePhase phase )
+{
+	return ( hardware_phases.load( std::memory_order_relaxed ) >> phase ) & 1;
+}
+
+void Profiler::read_hardware( PerfSample *sample )
+{
+	local_counters()->read( sample );
+}
+
+void Profiler::record_hardware( ProfilePhase phase, const PerfSample &begin )
+{
+	PerfSample end;
+	read_hardware( &end );
+	PerfSample delta = PerfSample::difference( begin, end );
+	PhaseTable &table = phase_tables[phase];
+	table.hardware_calls.fetch_add( 1, std::memory_order_relaxed );
+	for ( int ei = 0; ei < PERF_EVENT_COUNT; ei++ )
+		if ( delta.valid[ei] ) {
+			table.hardware_valid_calls[ei].fetch_add( 1, std::memory_order_relaxed );
+			table.hardware_total[ei].fetch_add( delta.value[ei], std::memory_order_relaxed );
+		}
+}
+
+void Profiler::phase_stats( ProfilePhase phase, ProfilePhaseStats *stats )
+{
+	PhaseTable &table = phase_tables[phase];
+	stats->name = PHASE_NAMES[phase];
+	stats->hardware_calls = table.hardware_calls.load( std::memory_order_relaxed );
+	for ( int ei = 0; ei < PERF_EVENT_COUNT; ei++ ) {
+		long valid_calls = table.hardware_valid_calls[ei].load( std::memory_order_relaxed );
+		stats->hardware_valid[ei] = valid_calls > 0;
+		stats->hardware_per_call[ei] = valid_calls > 0 ? (double)table.hardware_total[ei].load( std::memory_order_relaxed ) / valid_calls : 0.0;
+	}
+	stats->calls = table.calls.load( std::memory_order_relaxed );
+	stats->total_ms = table.total_ns.load( std::memory_order_relaxed ) * 1e-6;
+
+	int samples = std::min( (long)ROLLING_SAMPLES, stats->calls );
+	std::vector<double> us( samples );
+	for ( int si = 0; si < samples; si++ )
+		us[si] = table.samples_ns[si].load( std::memory_order_relaxed ) * 1e-3;
+	std::sort( us.begin(), us.end() );
+
+	stats->samples = samples;
+	stats->mean_us = stats->p50_us = stats->p95_us = stats->max_us = 0.0;
+	std::fill( stats->histogram, stats->histogram + PROFILE_HISTOGRAM_BUCKETS, 0 );
+	if ( samples == 0 )
+		return;
+
+	double sum = 0.0;
+	for ( int si = 0; si < samples; si++ ) {
+		sum += us[si];
+		int bucket = us[si] < 2.0 ? 0 : (int)std::log2( us[si] );
+		stats->histogram[ std::min( bucket, PROFILE_HISTOGRAM_BUCKETS - 1 ) ]++;
+	}
+	stats->mean_us = sum / samples;
+	stats->p50_us = us[ samples / 2 ];
+	stats->p95_us = us[ std::min( samples - 1, samples * 95 / 100 ) ];
+	stats->max_us = us[ samples - 1 ];
+}
+
+std::string Profiler::summary( ProfilePhase phase )
+{
+	ProfilePhaseStats stats;
+	phase_stats( phase, &stats );
+	char line[128];
+	snprintf( line, sizeof( line ), "%-13s %8.1f us  p95 %8.1f us  max %8.1f us",
+		stats.name, stats.mean_us, stats.p95_us, stats.max_us );
+	return line;
+}
+
+bool Profiler::write_json( const char *fileName )
+{
+	FILE *fp = fopen( fileName, "w" );
+	if ( !fp ) {
+		fprintf( stderr, "Cannot write profile %s\n", fileName );
+		return false;
+	}
+
+	fprintf( fp, "{\n  \"compiled_in\": %s,\n  \"rolling_samples\": %d,\n  \"phases\": {", compiled_in() ? "true" : "false", ROLLING_SAMPLES );
+	for ( int pi = 0; pi < PHASE_COUNT; pi++ )
+	{
+		ProfilePhaseStats stats;
+		phase_stats( (ProfilePhase)pi, &stats );
+		fprintf( fp, "%s\n    \"%s\": { \"calls\": %ld, \"total_ms\": %.3f, \"mean_us\": %.3f, \"p50_us\": %.3f, "
+		             "\"p95_us\": %.3f, \"max_us\": %.3f, \"histogram_log2_us\": [",
+			pi ? "," : "", stats.name, stats.calls, stats.total_ms, stats.mean_us, stats.p50_us, stats.p95_us, stats.max_us );
+		for ( int bi = 0; bi < PROFILE_HISTOGRAM_BUCKETS; bi++ )
+			fprintf( fp, "%s%d", bi ? ", " : "", stats.histogram[bi] );
+		fprintf( fp, "]" );
+		if ( stats.hardware_calls > 0 ) {
+			fprintf( fp, ", \"hardware_per_call\": {" );
+			const char *separator = " ";
+			for ( int ei = 0; ei < PERF_EVENT_COUNT; ei++ )
+				if ( stats.hardware_valid[ei] ) {
+					fprintf( fp, "%s\"%s\": %.1f", separator, PerfCounters::event_name( (PerfEvent)ei ), stats.hardware_per_call[ei] );
+					separator = ", ";
+				}
+			fprintf( fp, " }" );
+		}
+		fprintf( fp, " }" );
+	}
+	fprintf( fp, "\n  },\n  \"counters\": {" );
+	for ( int ci = 0; ci < COUNTER_COUNT; ci++ )
+		fprintf( fp, "%s\n    \"%s\": %ld", ci ? "," : "", COUNTER_NAMES[ci], counter( (ProfileCounter)ci ) );
+	fprintf( fp, "\n  }\n}\n" );
+	fclose( fp );
+	return true;
+}
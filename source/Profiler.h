@@ -0,0 +1,130 @@
+#pragma once
+
+#include "PerfCounters.h"
+
+#include <string>
+
+// Phase timers and event counters for the hot paths.
+// Build with -DCLOTH_PROFILE ( make PROFILE=1 ) to compile them in; otherwise PROFILE_SCOPE and
+// PROFILE_COUNT expand to nothing and the only cost left is an empty report.
+// Phases nest: "step" contains "integrate", which contains "gather" and "forces".
+// Recording is lock-free and safe from any thread, so the simulation thread, pool workers and
+// the GLUT thread can all report into the same tables.
+// Scoped phases can also read hardware counters ( see count_hardware ), each thread uses its own.
+
+enum ProfilePhase {
+	PHASE_STEP,				// one ClothWorld::simulation_step
+	PHASE_GATHER,			// copying particle state into the integrator
+	PHASE_FORCES,			// one force evaluation
+	PHASE_INTEGRATE,		// one integrator step, gather and forces included
+	PHASE_COLLISION,		// obstacle pass
+	PHASE_CG_ITERATION,		// one ConjGrad iteration
+	PHASE_MESH_BUILD,		// filling the vertex and color arrays
+	PHASE_GL_UPLOAD,		// buffer uploads to the GPU
+	PHASE_FRAME_CAPTURE,	// reading back and saving a frame
+	PHASE_COUNT
+};
+
+enum ProfileCounter {
+	COUNTER_STEPS,
+	COUNTER_FORCE_EVALUATIONS,
+	COUNTER_CG_ITERATIONS,
+	COUNTER_FRAMES,
+	COUNTER_COUNT
+};
+
+const int PROFILE_HISTOGRAM_BUCKETS = 24;	// bucket b holds durations in [ 2^b, 2^(b+1) ) microseconds, the first one everything below 2 us
+
+// statistics over the last ROLLING_SAMPLES samples of a phase, plus totals since the last reset
+struct ProfilePhaseStats {
+	const char *name;
+	long calls;				// since the last reset
+	double total_ms;		// since the last reset
+	int samples;			// in the rolling window
+	double mean_us, p50_us, p95_us, max_us;		// over the rolling window
+	int histogram[PROFILE_HISTOGRAM_BUCKETS];	// over the rolling window
+	long hardware_calls;						// calls that read hardware counters
+	double hardware_per_call[PERF_EVENT_COUNT];	// mean over those calls, 0 where the event is missing
+	bool hardware_valid[PERF_EVENT_COUNT];
+};
+
+class Profiler {
+	public:
+		static bool compiled_in();
+
+		static void record( ProfilePhase phase, double seconds );
+		static void count( ProfileCounter counter, long n );
+
+		static void phase_stats( ProfilePhase phase, ProfilePhaseStats *stats );
+		static long counter( ProfileCounter counter );
+		static const char *phase_name( ProfilePhase phase );
+		static int find_phase( const std::string &name );	// -1 if there is no such phase
+		static const char *counter_name( ProfileCounter counter );
+		static void reset();
+
+		// read hardware counters around every PROFILE_SCOPE of "phase" from now on; returns
+		// false and says why in "error" when the calling thread cannot open any counter
+		static bool count_hardware( ProfilePhase phase, std::string *error );
+		static bool counting_hardware( ProfilePhase phase );
+		static void read_hardware( PerfSample *sample );	// running totals of the calling thread
+		static void record_hardware( ProfilePhase phase, const PerfSample &begin );
+
+		// one line per phase that ran, for the on-screen overlay
+		static std::string summary( ProfilePhase phase );
+		// every phase and counter, returns false if the file cannot be written
+		static bool write_json( const char *fileName );
+};
+
+#ifdef CLOTH_PROFILE
+
+#include "Trace.h"
+
+#include <chrono>
+
+// a timed phase is also a span on the trace timeline while tracing is on
+inline void profile_stop( ProfilePhase phase, std::chrono::steady_clock::time_point start )
+{
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	Profiler::record( phase, std::chrono::duration<double>( end - start ).count() );
+	if ( Trace::enabled() )
+		Trace::span( Profiler::phase_name( phase ), start, end );
+}
+
+class ProfileScope {
+	public:
+		explicit ProfileScope( ProfilePhase phase ) : m_Phase( phase ), m_Hardware( Profiler::counting_hardware( phase ) )
+		{
+			if ( m_Hardware )
+				Profiler::read_hardware( &m_Counters );
+			m_Start = std::chrono::steady_clock::now();
+		}
+		~ProfileScope()
+		{
+			profile_stop( m_Phase, m_Start );
+			if ( m_Hardware )
+				Profiler::record_hardware( m_Phase, m_Counters );
+		}
+
+	private:
+		ProfilePhase m_Phase;
+		bool m_Hardware;
+		PerfSample m_Counters;
+		std::chrono::steady_clock::time_point m_Start;
+};
+
+#define PROFILE_CONCAT2( a, b ) a##b
+#define PROFILE_CONCAT( a, b ) PROFILE_CONCAT2( a, b )
+#define PROFILE_SCOPE( phase ) ProfileScope PROFILE_CONCAT( profile_scope_, __LINE__ )( phase )
+#define PROFILE_COUNT( counter, n ) Profiler::count( counter, n )
+// for spans that do not match a block
+#define PROFILE_START( timer ) std::chrono::steady_clock::time_point timer = std::chrono::steady_clock::now()
+#define PROFILE_STOP( timer, phase ) profile_stop( phase, timer )
+
+#else
+
+#define PROFILE_SCOPE( phase ) ((void)0)
+#define PROFILE_COUNT( counter, n ) ((void)0)
+#define PROFILE_START( timer ) ((void)0)
+#define PROFILE_STOP( timer, phase ) ((void)0)
+
+#endif
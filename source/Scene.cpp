@@ -0,0 +1,452 @@
+#include "Scene.h"
+#include "ClothMesh.h"
+
+#include <cmath>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <map>
+#include <stdio.h>
+#include <sys/stat.h>
+
+const int SLEEP_PATCH_SIZE = 5;		// cloth is put to sleep in tiles of SLEEP_PATCH_SIZE x SLEEP_PATCH_SIZE particles
+const int SCENE_SDF_RESOLUTION = 64;	// collider default
+const uint64_t SCENE_COMPILER_VERSION = 1;	// part of the cache key, bump when build_scene() changes its output
+
+SceneDescription::SceneDescription() :
+	integrator( "RK4" ), dt( 0.01 ), sleep_patch( SLEEP_PATCH_SIZE ), source_hash( 0 )
+{
+	gravity[0] = 0.0;
+	gravity[1] = -0.03;
+	gravity[2] = 0.0;
+}
+
+int SceneDescription::particle_count() const
+{
+	int count = 0;
+	for ( int ci = 0; ci < cloths.size(); ci++ ) {
+		if ( !cloths[ci].mesh_file.empty() )
+			return -1;
+		count += cloths[ci].rows * cloths[ci].columns;
+	}
+	return count;
+}
+
+// 64 bit FNV-1a
+static uint64_t hash_bytes( const std::string &bytes, uint64_t hash )
+{
+	for ( int bi = 0; bi < bytes.size(); bi++ ) {
+		hash ^= (unsigned char)bytes[bi];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+bool load_scene( const char *fileName, SceneDescription *pScene )
+{
+	std::ifstream in( fileName, std::ios::binary );
+	if ( !in.is_open() ) {
+		fprintf( stderr, "Cannot open scene %s\n", fileName );
+		return false;
+	}
+	std::string text( ( std::istreambuf_iterator<char>( in ) ), std::istreambuf_iterator<char>() );
+
+	SceneDescription &scene = *pScene;
+	scene = SceneDescription();
+	scene.source_file = fileName;
+	scene.source_hash = hash_bytes( text, 0xcbf29ce484222325ULL ^ SCENE_COMPILER_VERSION );
+	std::string directory( fileName );
+	directory = directory.find( '/' ) == std::string::npos ? "" : directory.substr( 0, directory.rfind( '/' ) + 1 );
+
+	std::istringstream lines( text );
+	std::string line;
+	for ( int number = 1; std::getline( lines, line ); number++ )
+	{
+		line = line.substr( 0, line.find( '#' ) );
+		std::istringstream record( line );
+		std::string tag;
+		if ( !( record >> tag ) )
+			continue;
+
+		bool ok = true;
+		std::string error = "cannot read the " + tag + " record";
+		if ( tag == "integrator" ) {
+			ok = !!( record >> scene.integrator );
+		} else if ( tag == "dt" ) {
+			ok = record >> scene.dt && scene.dt > 0.0;
+		} else if ( tag == "gravity" ) {
+			ok = !!( record >> scene.gravity[0] >> scene.gravity[1] >> scene.gravity[2] );
+		} else if ( tag == "sleep" ) {
+			ok = record >> scene.sleep_patch && scene.sleep_patch >= 0;
+		} else if ( tag == "material" ) {
+			SceneMaterial material;
+			ok = !!( record >> material.name >> material.stretch[0] >> material.stretch[1]
+			         >> material.shear[0] >> material.shear[1] >> material.bend[0] >> material.bend[1] );
+			scene.materials.push_back( material );
+		} else if ( tag == "cloth" ) {
+			SceneCloth cloth;
+			std::string material;
+			float o[3], r[3], c[3];
+			ok = !!( record >> cloth.rows >> cloth.columns >> cloth.spacing >> material
+			         >> o[0] >> o[1] >> o[2] >> r[0] >> r[1] >> r[2] >> c[0] >> c[1] >> c[2] );
+			cloth.material = -1;
+			for ( int mi = 0; mi < scene.materials.size(); mi++ )
+				if ( scene.materials[mi].name == material )
+					cloth.material = mi;
+			if ( ok && cloth.material < 0 ) {
+				ok = false;
+				error = "unknown material " + material;
+			}
+			if ( ok && ( cloth.rows < 2 || cloth.columns < 2 || cloth.spacing <= 0.0 ) ) {
+				ok = false;
+				error = "a cloth needs at least 2 x 2 particles";
+			}
+			cloth.origin = Vec3f( o[0], o[1], o[2] );
+			cloth.row_direction = Vec3f( r[0], r[1], r[2] );
+			cloth.column_direction = Vec3f( c[0], c[1], c[2] );
+			scene.cloths.push_back( cloth );
+		} else if ( tag == "mesh" ) {
+			SceneCloth cloth;
+			std::string material;
+			float o[3];
+			ok = !!( record >> cloth.mesh_file >> material >> o[0] >> o[1] >> o[2] >> cloth.spacing );
+			cloth.rows = cloth.columns = 0;
+			cloth.material = -1;
+			for ( int mi = 0; mi < scene.materials.size(); mi++ )
+				if ( scene.materials[mi].name == material )
+					cloth.material = mi;
+			if ( ok && cloth.material < 0 ) {
+				ok = false;
+				error = "unknown material " + material;
+			}
+			if ( ok && cloth.mesh_file[0] != '/' )
+				cloth.mesh_file = directory + cloth.mesh_file;
+
+			// the cache is only as fresh as the meshes it was built from
+			struct stat st;
+			if ( ok && stat( cloth.mesh_file.c_str(), &st ) != 0 ) {
+				ok = false;
+				error = "cannot find " + cloth.mesh_file;
+			}
+			if ( ok ) {
+				char stamp[64];
+				snprintf( stamp, sizeof( stamp ), "%lld %lld", (long long)st.st_size, (long long)st.st_mtime );
+				scene.source_hash = hash_bytes( stamp, scene.source_hash );
+			}
+			cloth.origin = Vec3f( o[0], o[1], o[2] );
+			scene.cloths.push_back( cloth );
+		} else if ( tag == "pin" ) {
+			int r0, c0, r1, c1;
+			ok = !!( record >> r0 >> c0 >> r1 >> c1 );
+			if ( ok && ( scene.cloths.empty() || !scene.cloths.back().mesh_file.empty() ) ) {
+				ok = false;
+				error = "pin needs a grid cloth before it";
+			}
+			if ( ok ) {
+				SceneCloth &cloth = scene.cloths.back();
+				if ( r0 < 0 || c0 < 0 || r1 >= cloth.rows || c1 >= cloth.columns || r0 > r1 || c0 > c1 ) {
+					ok = false;
+					error = "pinned rows or columns outside the cloth";
+				}
+				for ( int i = r0; ok && i <= r1; i++ )
+					for ( int j = c0; j <= c1; j++ )
+						cloth.pins.push_back( i * cloth.columns + j );
+			}
+		} else if ( tag == "pinbox" ) {
+			float box[6];
+			ok = !!( record >> box[0] >> box[1] >> box[2] >> box[3] >> box[4] >> box[5] );
+			if ( ok && scene.cloths.empty() ) {
+				ok = false;
+				error = "pinbox before the first cloth";
+			}
+			if ( ok )
+				scene.cloths.back().pin_boxes.insert( scene.cloths.back().pin_boxes.end(), box, box + 6 );
+		} else if ( tag == "collider" ) {
+			SceneCollider collider;
+			ok = !!( record >> collider.mesh_file );
+			if ( !( record >> collider.resolution ) )
+				collider.resolution = SCENE_SDF_RESOLUTION;
+			if ( ok && collider.mesh_file[0] != '/' )
+				collider.mesh_file = directory + collider.mesh_file;
+			scene.colliders.push_back( collider );
+		} else {
+			ok = false;
+			error = "unknown record " + tag;
+		}
+
+		if ( !ok ) {
+			fprintf( stderr, "%s:%d: %s\n", fileName, number, error.c_str() );
+			return false;
+		}
+	}
+	return true;
+}
+
+SceneDescription grid_scene( int N )
+{
+	SceneDescription scene;
+
+	// original value, 60 and 20
+	SceneMaterial material = { "default", { 30, 15 }, { 30, 15 }, { 50, 15 } };
+	scene.materials.push_back( material );
+
+	// hanging at the center of the screen, rows run along -x and columns along z
+	SceneCloth cloth;
+	cloth.rows = cloth.columns = N;
+	cloth.spacing = 0.05;
+	cloth.material = 0;
+	cloth.origin = Vec3f( 0.5, 0.5, 0.0 );
+	cloth.row_direction = Vec3f( -1.0, 0.0, 0.0 );
+	cloth.column_direction = Vec3f( 0.0, 0.0, 1.0 );
+
+	// one edge of the cloth is held in place
+	for ( int i = 0; i < N; i++ )
+		cloth.pins.push_back( i * N );
+	scene.cloths.push_back( cloth );
+	return scene;
+}
+
+template <class P>
+static void add_spring( ClothWorldT<P> *pWorld, int p1, int p2, double dist, const double *constants )
+{
+	SpringForceT<typename P::Real> *pSpring = new SpringForceT<typename P::Real>( pWorld->pVector[p1], pWorld->pVector[p2], dist, constants[0], constants[1] );
+	pSpring->set_index( p1, p2 );
+	pWorld->add_force( pSpring );
+}
+
+// pins the particles from "first" on that lie inside a pinbox of "cloth"
+template <class P>
+static void pin_boxes( ClothWorldT<P> *pWorld, const SceneCloth &cloth, int first )
+{
+	for ( int pi = first; pi < pWorld->particle_count(); pi++ )
+		for ( int bi = 0; bi < cloth.pin_boxes.size(); bi += 6 ) {
+			const float *box = &cloth.pin_boxes[bi];
+			const typename ClothWorldT<P>::Vec &x = pWorld->pVector[pi]->m_ConstructPos;
+			if ( x[0] >= box[0] && x[1] >= box[1] && x[2] >= box[2] && x[0] <= box[3] && x[1] <= box[4] && x[2] <= box[5] ) {
+				pWorld->pin( pi );
+				break;
+			}
+		}
+}
+
+/* Simple description of spring-particle model of cloth:
+   rows x columns particle grid,
+   three type of springs
+   		stretch spring: grid side, connecting two nearest particles
+   		shear spring: diagonal of a grid block
+		bend spring: contains two grid side, connecting every other two particles
+*/
+template <class P>
+static void build_cloth( ClothWorldT<P> *pWorld, const SceneCloth &cloth, const SceneMaterial &material )
+{
+	const int R = cloth.rows, C = cloth.columns, base = pWorld->particle_count();
+	const double grid_length = cloth.spacing;
+	const double diagonal_length = sqrt(2.0) * grid_length;
+	const float step = grid_length;
+
+	// Create particles as a rows x columns grid
+	for(int i=0; i<R; i++)
+		for(int j=0; j<C; j++)
+			pWorld->add_particle( cloth.origin + cloth.row_direction * ( i * step ) + cloth.column_direction * ( j * step ) );
+
+	for(int pi=0; pi<cloth.pins.size(); pi++)
+		pWorld->pin( base + cloth.pins[pi] );
+	pin_boxes( pWorld, cloth, base );
+
+	// 1. Stretch springs
+	// R x (C-1) springs along the rows
+	for(int i=0; i<R; i++)
+		for(int j=0; j<(C-1); j++)
+			add_spring( pWorld, base + i*C+j, base + i*C+j+1, grid_length, material.stretch );
+
+	// C x (R-1) springs along the columns
+	for(int j=0; j<C; j++)
+		for(int i=0; i<(R-1); i++)
+			add_spring( pWorld, base + i*C+j, base + (i+1)*C+j, grid_length, material.stretch );
+
+	// 2. Shear springs
+	// In total 2 X (R-1) x (C-1) diagonal springs
+	// those connecting bottom-left and upper-right particles
+	for(int i=0; i<(R-1); i++)
+		for(int j=0; j<(C-1); j++)
+			add_spring( pWorld, base + i*C+j, base + (i+1)*C+(j+1), diagonal_length, material.shear );
+
+	// those connecting bottom-right and upper-left particles
+	for(int i=1; i<R; i++)
+		for(int j=0; j<(C-1); j++)
+			add_spring( pWorld, base + i*C+j, base + (i-1)*C+(j+1), diagonal_length, material.shear );
+
+	// 3. Bend springs ( also a way to prevent self penetration in nearby region )
+	for(int i=0; i<R; i++)
+		for(int j=0; j<(C-2); j++)
+			add_spring( pWorld, base + i*C+j, base + i*C+j+2, 2 * grid_length, material.bend );
+
+	for(int j=0; j<C; j++)
+		for(int i=0; i<(R-2); i++)
+			add_spring( pWorld, base + i*C+j, base + (i+2)*C+j, 2 * grid_length, material.bend );
+}
+
+// Particles from the vertices of the mesh, springs from its edges ( see ClothMesh.h ) in vertex
+// pair order. Returns the mean stretch spring length, 0 if the mesh cannot be read.
+template <class P>
+static double build_mesh_cloth( ClothWorldT<P> *pWorld, const SceneCloth &cloth, const SceneMaterial &material )
+{
+	ClothMesh mesh;
+	if ( !load_cloth_mesh( cloth.mesh_file.c_str(), &mesh ) )
+		return 0.0;
+
+	const int base = pWorld->particle_count();
+	for ( int vi = 0; vi < mesh.vertices.size(); vi++ ) {
+		mesh.vertices[vi] = cloth.origin + mesh.vertices[vi] * (float)cloth.spacing;
+		pWorld->add_particle( mesh.vertices[vi] );
+	}
+	pin_boxes( pWorld, cloth, base );
+
+	// large garments import in a fraction of the time on every core
+	ThreadPool pool( 0 );
+	std::vector<MeshSpring> springs;
+	generate_mesh_springs( mesh, springs, &pool );
+
+	const double *constants[] = { material.stretch, material.shear, material.bend };
+	double stretch_length = 0.0;
+	int stretch_springs = 0;
+	for ( int si = 0; si < springs.size(); si++ ) {
+		add_spring( pWorld, base + springs[si].p1, base + springs[si].p2, springs[si].rest, constants[ springs[si].kind ] );
+		if ( springs[si].kind == MESH_STRETCH ) {
+			stretch_length += springs[si].rest;
+			stretch_springs++;
+		}
+	}
+	return stretch_springs ? stretch_length / stretch_springs : 0.0;
+}
+
+// patches of a mesh cloth are cubes of "size" along the axes, numbered from "patches" on
+template <class P>
+static int mesh_patches( ClothWorldT<P> *pWorld, int first, int last, double size, int patches, std::vector<int> &patch_of_particle )
+{
+	std::map< std::vector<long>, int > cells;
+	for ( int pi = first; pi < last; pi++ ) {
+		const typename ClothWorldT<P>::Vec &x = pWorld->pVector[pi]->m_ConstructPos;
+		std::vector<long> cell( 3 );
+		for ( int k = 0; k < 3; k++ )
+			cell[k] = (long)floor( x[k] / size );
+		std::map< std::vector<long>, int >::iterator found = cells.find( cell );
+		if ( found == cells.end() )
+			found = cells.insert( std::make_pair( cell, patches + (int)cells.size() ) ).first;
+		patch_of_particle.push_back( found->second );
+	}
+	return patches + cells.size();
+}
+
+template <class P>
+static bool compile_scene( ClothWorldT<P> *pWorld, const SceneDescription &scene )
+{
+	pWorld->m_Gravity = typename ClothWorldT<P>::Vec( scene.gravity[0], scene.gravity[1], scene.gravity[2] );
+
+	// Universal gravity force, this force is just a dummy one
+	pWorld->add_force( new GravityForce( Vec3f(0, 0, 0) ) );
+
+	if ( scene.particle_count() > 0 )
+		pWorld->pVector.reserve( scene.particle_count() );
+	std::vector<int> first_particle;
+	std::vector<double> edge_length;
+	for ( int ci = 0; ci < scene.cloths.size(); ci++ ) {
+		const SceneCloth &cloth = scene.cloths[ci];
+		first_particle.push_back( pWorld->particle_count() );
+		edge_length.push_back( cloth.spacing );
+		if ( cloth.mesh_file.empty() )
+			build_cloth( pWorld, cloth, scene.materials[ cloth.material ] );
+		else if ( ( edge_length.back() = build_mesh_cloth( pWorld, cloth, scene.materials[ cloth.material ] ) ) <= 0.0 )
+			return false;
+	}
+	first_particle.push_back( pWorld->particle_count() );
+
+	// Resting regions are deactivated patch by patch, patches never span two cloths
+	if ( scene.sleep_patch > 0 ) {
+		const int S = scene.sleep_patch;
+		std::vector<int> patch_of_particle;
+		int patches = 0;
+		for ( int ci = 0; ci < scene.cloths.size(); ci++ ) {
+			const SceneCloth &cloth = scene.cloths[ci];
+			if ( !cloth.mesh_file.empty() ) {
+				patches = mesh_patches( pWorld, first_particle[ci], first_particle[ci+1], S * edge_length[ci], patches, patch_of_particle );
+				continue;
+			}
+			const int patches_per_row = ( cloth.columns + S - 1 ) / S;
+			for(int i=0; i<cloth.rows; i++)
+				for(int j=0; j<cloth.columns; j++)
+					patch_of_particle.push_back( patches + ( i / S ) * patches_per_row + j / S );
+			patches += ( ( cloth.rows + S - 1 ) / S ) * patches_per_row;
+		}
+		pWorld->enable_sleeping( patch_of_particle );
+	}
+	return true;
+}
+
+template <class P>
+bool build_scene( ClothWorldT<P> *pWorld, const SceneDescription &scene )
+{
+	if ( scene.source_file.empty() )
+		return compile_scene( pWorld, scene );
+
+	char key[32];
+	snprintf( key, sizeof( key ), ".%016llx.f%d.ckpt", (unsigned long long)scene.source_hash, (int)( 8 * sizeof( typename P::Real ) ) );
+	std::string cache_file = scene.source_file + key;
+	FILE *fp = fopen( cache_file.c_str(), "rb" );
+	if ( fp ) {
+		fclose( fp );
+		if ( pWorld->load_checkpoint( cache_file.c_str() ) && ( scene.particle_count() < 0 || pWorld->particle_count() == scene.particle_count() ) )
+			return true;
+		// a bad cache only costs compiling the scene, which writes a new one
+		fprintf( stderr, "Rebuilding the unreadable scene cache %s\n", cache_file.c_str() );
+		pWorld->clear();
+	}
+
+	if ( !compile_scene( pWorld, scene ) )
+		return false;
+	if ( !pWorld->save_checkpoint( cache_file.c_str() ) )
+		fprintf( stderr, "Cannot write scene cache %s\n", cache_file.c_str() );
+	return true;
+}
+
+template <class P>
+bool add_scene_colliders( ClothWorldT<P> *pWorld, const SceneDescription &scene )
+{
+	for ( int ci = 0; ci < scene.colliders.size(); ci++ )
+		if ( !add_obstacle( pWorld, scene.colliders[ci].mesh_file.c_str(), scene.colliders[ci].resolution ) )
+			return false;
+	return true;
+}
+
+template <class P>
+void build_grid_cloth( ClothWorldT<P> *pWorld, int N )
+{
+	build_scene( pWorld, grid_scene( N ) );
+}
+
+template <class P>
+bool add_obstacle( ClothWorldT<P> *pWorld, const char *meshFile, int resolution )
+{
+	// the distance field is cached next to the mesh and memory-mapped on later runs
+	std::string cache_file = std::string( meshFile ) + ".sdf";
+	SdfCollider *pCollider = SdfCollider::load_or_bake( meshFile, cache_file.c_str(), resolution );
+	if ( !pCollider )
+		return false;
+	pWorld->add_collider( pCollider );
+	return true;
+}
+
+template bool build_scene( ClothWorldT<FloatPrecision> *, const SceneDescription & );
+template bool build_scene( ClothWorldT<DoublePrecision> *, const SceneDescription & );
+template bool build_scene( ClothWorldT<MixedPrecision> *, const SceneDescription & );
+template bool add_scene_colliders( ClothWorldT<FloatPrecision> *, const SceneDescription & );
+template bool add_scene_colliders( ClothWorldT<DoublePrecision> *, const SceneDescription & );
+template bool add_scene_colliders( ClothWorldT<MixedPrecision> *, const SceneDescription & );
+template void build_grid_cloth( ClothWorldT<FloatPrecision> *, int );
+template void build_grid_cloth( ClothWorldT<DoublePrecision> *, int );
+template void build_grid_cloth( ClothWorldT<MixedPrecision> *, int );
+template bool add_obstacle( ClothWorldT<FloatPrecision> *, const char *, int );
+template bool add_obstacle( ClothWorldT<DoublePrecision> *, const char *, int );
+template bool add_obstacle( ClothWorldT<MixedPrecision> *, const char *, int );
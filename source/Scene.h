@@ -0,0 +1,88 @@
+#pragma once
+
+#include "ClothWorld.h"
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+// Scene construction shared by the viewer and the headless simulator
+
+/* Scene files, one record per line, '#' starts a comment:
+     integrator MODE                  Euler, Midpoint or RK4
+     dt DT
+     gravity X Y Z                    acceleration of every particle
+     sleep SIZE                       cloth sleeps in SIZE x SIZE particle tiles, 0 never sleeps
+     material NAME KS KD KS KD KS KD  stiffness and damping of the stretch, shear and bend springs
+     cloth ROWS COLS SPACING MATERIAL OX OY OZ RX RY RZ CX CY CZ
+                                      grid of particles at O + SPACING * ( row * R + column * C )
+     mesh FILE MATERIAL OX OY OZ SCALE
+                                      cloth from an OBJ or PLY mesh, vertex v at O + SCALE * v,
+                                      the path is relative to the scene file, see ClothMesh.h
+     pin R0 C0 R1 C1                  pins rows R0..R1, columns C0..C1 of the last grid cloth
+     pinbox X0 Y0 Z0 X1 Y1 Z1         pins the particles of the last cloth inside the box
+     collider FILE.obj [RESOLUTION]   static obstacle, the path is relative to the scene file
+   Every grid cloth gets stretch springs between neighbours, shear springs along both diagonals
+   and bend springs between every other particle, in that order. Mesh cloths get theirs from
+   the mesh adjacency.
+*/
+
+struct SceneMaterial {
+	std::string name;
+	double stretch[2], shear[2], bend[2];	// ks, kd
+};
+
+struct SceneCloth {
+	std::string mesh_file;			// empty for a grid
+	int rows, columns;				// 0 for a mesh
+	double spacing;					// of the grid, the scale of a mesh
+	int material;					// index into SceneDescription::materials
+	Vec3f origin, row_direction, column_direction;
+	std::vector<int> pins;			// row * columns + column
+	std::vector<float> pin_boxes;	// 6 per box, low and high corner
+};
+
+struct SceneCollider {
+	std::string mesh_file;
+	int resolution;					// distance field cells along the longest side
+};
+
+struct SceneDescription {
+	std::string integrator;
+	double dt;
+	double gravity[3];
+	int sleep_patch;
+	std::vector<SceneMaterial> materials;
+	std::vector<SceneCloth> cloths;
+	std::vector<SceneCollider> colliders;
+
+	std::string source_file;		// empty for generated scenes
+	uint64_t source_hash;			// of the file text and the size and time of its meshes, names the compiled cache
+
+	SceneDescription();				// no cloth, the defaults of the viewer and clothsim
+	int particle_count() const;		// -1 if there are mesh cloths, their size is known once they are read
+};
+
+// returns false and prints the line at fault if the file cannot be read
+bool load_scene( const char *fileName, SceneDescription *pScene );
+
+/* The original scene: N X N particle grid hanging from one edge, spacing 0.05 */
+SceneDescription grid_scene( int N );
+
+// Particles, springs, pins and sleep patches of "scene", colliders are added separately.
+// A scene read from a file is compiled once into a checkpoint next to it, named after the
+// hash of the file text and the precision, which later runs load instead of building.
+// A cache that cannot be read is rebuilt. Returns false if a mesh cannot be read, the world
+// is partly built then.
+template <class P>
+bool build_scene( ClothWorldT<P> *pWorld, const SceneDescription &scene );
+
+template <class P>
+bool add_scene_colliders( ClothWorldT<P> *pWorld, const SceneDescription &scene );
+
+template <class P>
+void build_grid_cloth( ClothWorldT<P> *pWorld, int N );	// build_scene( grid_scene( N ) )
+
+// static obstacle from an OBJ mesh, returns false if the mesh cannot be read
+template <class P>
+bool add_obstacle( ClothWorldT<P> *pWorld, const char *meshFile, int resolution );
@@ -0,0 +1,434 @@
+#include "SdfCollider.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cfloat>
+#include <cmath>
+#include <string>
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// cache file layout, the voxel data follows directly after the header
+struct SdfFileHeader {
+	char magic[4];			// "CSDF"
+	unsigned int version;
+	int nx, ny, nz;
+	int resolution;
+	float origin[3];
+	float cell_size;
+};
+
+static const unsigned int SDF_FILE_VERSION = 1;
+static const int SDF_PADDING = 3;		// empty cells around the mesh bounding box
+static const int SDF_EXACT_BAND = 1;	// cells around each triangle that get exact distances before sweeping
+
+SdfCollider::SdfCollider() :
+	m_Nx(0), m_Ny(0), m_Nz(0), m_Resolution(0), m_Origin(0.0, 0.0, 0.0), m_CellSize(1.0f),
+	m_Data(NULL), m_Map(NULL), m_MapSize(0) {
+}
+
+SdfCollider::~SdfCollider() {
+	release();
+}
+
+void SdfCollider::release() {
+	if (m_Map) {
+		munmap(m_Map, m_MapSize);
+		m_Map = NULL;
+		m_MapSize = 0;
+	}
+	m_Baked.clear();
+	m_Data = NULL;
+}
+
+/*
+----------------------------------------------------------------------
+baking
+----------------------------------------------------------------------
+*/
+
+// closest point on triangle abc to p ( Ericson, Real-Time Collision Detection 5.1.5 )
+static Vec3f closest_point_on_triangle( const Vec3f &p, const Vec3f &a, const Vec3f &b, const Vec3f &c )
+{
+	Vec3f ab = b - a, ac = c - a, ap = p - a;
+	float d1 = ab * ap, d2 = ac * ap;
+	if ( d1 <= 0.0f && d2 <= 0.0f ) return a;
+
+	Vec3f bp = p - b;
+	float d3 = ab * bp, d4 = ac * bp;
+	if ( d3 >= 0.0f && d4 <= d3 ) return b;
+
+	float vc = d1 * d4 - d3 * d2;
+	if ( vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f )
+		return a + ( d1 / ( d1 - d3 ) ) * ab;
+
+	Vec3f cp = p - c;
+	float d5 = ab * cp, d6 = ac * cp;
+	if ( d6 >= 0.0f && d5 <= d6 ) return c;
+
+	float vb = d5 * d2 - d1 * d6;
+	if ( vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f )
+		return a + ( d2 / ( d2 - d6 ) ) * ac;
+
+	float va = d3 * d6 - d5 * d4;
+	if ( va <= 0.0f && ( d4 - d3 ) >= 0.0f && ( d5 - d6 ) >= 0.0f )
+		return b + ( ( d4 - d3 ) / ( ( d4 - d3 ) + ( d5 - d6 ) ) ) * ( c - b );
+
+	float denom = 1.0f / ( va + vb + vc );
+	return a + ab * ( vb * denom ) + ac * ( vc * denom );
+}
+
+// does the line parallel to x through (y, z) cross the triangle, and if so at which x
+static bool x_ray_hits_triangle( float y, float z, const Vec3f &a, const Vec3f &b, const Vec3f &c, float *x )
+{
+	// signed areas in the yz plane, a half-open rule on ties keeps shared edges from being counted twice
+	float wa = ( b[1] - y ) * ( c[2] - z ) - ( b[2] - z ) * ( c[1] - y );
+	float wb = ( c[1] - y ) * ( a[2] - z ) - ( c[2] - z ) * ( a[1] - y );
+	float wc = ( a[1] - y ) * ( b[2] - z ) - ( a[2] - z ) * ( b[1] - y );
+
+	bool all_pos = ( wa > 0.0f || ( wa == 0.0f && b[1] > c[1] ) ) &&
+	               ( wb > 0.0f || ( wb == 0.0f && c[1] > a[1] ) ) &&
+	               ( wc > 0.0f || ( wc == 0.0f && a[1] > b[1] ) );
+	bool all_neg = ( wa < 0.0f || ( wa == 0.0f && b[1] < c[1] ) ) &&
+	               ( wb < 0.0f || ( wb == 0.0f && c[1] < a[1] ) ) &&
+	               ( wc < 0.0f || ( wc == 0.0f && a[1] < b[1] ) );
+	if ( !all_pos && !all_neg )
+		return false;
+
+	float sum = wa + wb + wc;
+	if ( sum == 0.0f )
+		return false;
+	*x = ( wa * a[0] + wb * b[0] + wc * c[0] ) / sum;
+	return true;
+}
+
+bool SdfCollider::bake( const std::vector<Vec3f> &vertices, const std::vector<int> &triangles, int resolution )
+{
+	if ( vertices.empty() || triangles.size() < 3 || resolution < 1 )
+		return false;
+
+	release();
+
+	Vec3f lo = vertices[0], hi = vertices[0];
+	for ( size_t vi = 1; vi < vertices.size(); vi++ )
+		for ( int d = 0; d < 3; d++ ) {
+			lo[d] = std::min( lo[d], vertices[vi][d] );
+			hi[d] = std::max( hi[d], vertices[vi][d] );
+		}
+
+	Vec3f extent = hi - lo;
+	float longest = std::max( extent[0], std::max( extent[1], extent[2] ) );
+	m_CellSize = ( longest > 0.0f ? longest : 1.0f ) / resolution;
+	m_Resolution = resolution;
+	m_Origin = lo - Vec3f( SDF_PADDING * m_CellSize, SDF_PADDING * m_CellSize, SDF_PADDING * m_CellSize );
+	m_Nx = (int)ceil( extent[0] / m_CellSize ) + 2 * SDF_PADDING + 1;
+	m_Ny = (int)ceil( extent[1] / m_CellSize ) + 2 * SDF_PADDING + 1;
+	m_Nz = (int)ceil( extent[2] / m_CellSize ) + 2 * SDF_PADDING + 1;
+
+	const int cells = m_Nx * m_Ny * m_Nz;
+	const float far_away = ( m_Nx + m_Ny + m_Nz ) * m_CellSize;
+	m_Baked.assign( cells, far_away );
+	std::vector<int> closest_tri( cells, -1 );
+	std::vector<int> crossings( cells, 0 );
+
+	const int tri_count = triangles.size() / 3;
+	for ( int t = 0; t < tri_count; t++ )
+	{
+		const Vec3f &a = vertices[ triangles[3*t] ], &b = vertices[ triangles[3*t+1] ], &c = vertices[ triangles[3*t+2] ];
+
+		// triangle bounding box in grid coordinates
+		Vec3f ga = ( a - m_Origin ) / m_CellSize, gb = ( b - m_Origin ) / m_CellSize, gc = ( c - m_Origin ) / m_CellSize;
+		int i0 = std::max( 0, (int)floor( std::min( ga[0], std::min( gb[0], gc[0] ) ) ) - SDF_EXACT_BAND );
+		int i1 = std::min( m_Nx - 1, (int)ceil( std::max( ga[0], std::max( gb[0], gc[0] ) ) ) + SDF_EXACT_BAND );
+		int j0 = std::max( 0, (int)floor( std::min( ga[1], std::min( gb[1], gc[1] ) ) ) - SDF_EXACT_BAND );
+		int j1 = std::min( m_Ny - 1, (int)ceil( std::max( ga[1], std::max( gb[1], gc[1] ) ) ) + SDF_EXACT_BAND );
+		int k0 = std::max( 0, (int)floor( std::min( ga[2], std::min( gb[2], gc[2] ) ) ) - SDF_EXACT_BAND );
+		int k1 = std::min( m_Nz - 1, (int)ceil( std::max( ga[2], std::max( gb[2], gc[2] ) ) ) + SDF_EXACT_BAND );
+
+		// exact distances in a narrow band around the triangle
+		for ( int k = k0; k <= k1; k++ )
+			for ( int j = j0; j <= j1; j++ )
+				for ( int i = i0; i <= i1; i++ )
+				{
+					Vec3f p = m_Origin + Vec3f( i * m_CellSize, j * m_CellSize, k * m_CellSize );
+					float dist = norm( p - closest_point_on_triangle( p, a, b, c ) );
+					int idx = ( k * m_Ny + j ) * m_Nx + i;
+					if ( dist < m_Baked[idx] ) {
+						m_Baked[idx] = dist;
+						closest_tri[idx] = t;
+					}
+				}
+
+		// count crossings of the grid lines parallel to x, used for the inside/outside test
+		for ( int k = k0; k <= k1; k++ )
+			for ( int j = j0; j <= j1; j++ )
+			{
+				float x;
+				if ( !x_ray_hits_triangle( (float)j, (float)k, ga, gb, gc, &x ) )
+					continue;
+				int i = (int)ceil( x );
+				if ( i < 0 )
+					crossings[ ( k * m_Ny + j ) * m_Nx ]++;
+				else if ( i < m_Nx )
+					crossings[ ( k * m_Ny + j ) * m_Nx + i ]++;
+			}
+	}
+
+	// propagate closest triangles to the rest of the grid with fast sweeping in all eight directions
+	for ( int pass = 0; pass < 2; pass++ )
+		for ( int dir = 0; dir < 8; dir++ )
+		{
+			int di = ( dir & 1 ) ? -1 : 1, dj = ( dir & 2 ) ? -1 : 1, dk = ( dir & 4 ) ? -1 : 1;
+			int ib = di > 0 ? 1 : m_Nx - 2, ie = di > 0 ? m_Nx : -1;
+			int jb = dj > 0 ? 1 : m_Ny - 2, je = dj > 0 ? m_Ny : -1;
+			int kb = dk > 0 ? 1 : m_Nz - 2, ke = dk > 0 ? m_Nz : -1;
+
+			for ( int k = kb; k != ke; k += dk )
+				for ( int j = jb; j != je; j += dj )
+					for ( int i = ib; i != ie; i += di )
+					{
+						int idx = ( k * m_Ny + j ) * m_Nx + i;
+						Vec3f p = m_Origin + Vec3f( i * m_CellSize, j * m_CellSize, k * m_CellSize );
+						const int neighbours[7][3] = { { -di, 0, 0 }, { 0, -dj, 0 }, { -di, -dj, 0 }, { 0, 0, -dk },
+						                               { -di, 0, -dk }, { 0, -dj, -dk }, { -di, -dj, -dk } };
+						for ( int n = 0; n < 7; n++ )
+						{
+							int t = closest_tri[ ( ( k + neighbours[n][2] ) * m_Ny + ( j + neighbours[n][1] ) ) * m_Nx + ( i + neighbours[n][0] ) ];
+							if ( t < 0 )
+								continue;
+							const Vec3f &a = vertices[ triangles[3*t] ], &b = vertices[ triangles[3*t+1] ], &c = vertices[ triangles[3*t+2] ];
+							float dist = norm( p - closest_point_on_triangle( p, a, b, c ) );
+							if ( dist < m_Baked[idx] ) {
+								m_Baked[idx] = dist;
+								closest_tri[idx] = t;
+							}
+						}
+					}
+		}
+
+	// a cell is inside when an odd number of surfaces lies between it and the -x border
+	for ( int k = 0; k < m_Nz; k++ )
+		for ( int j = 0; j < m_Ny; j++ )
+		{
+			int total = 0;
+			for ( int i = 0; i < m_Nx; i++ )
+			{
+				int idx = ( k * m_Ny + j ) * m_Nx + i;
+				total += crossings[idx];
+				if ( total % 2 == 1 )
+					m_Baked[idx] = -m_Baked[idx];
+			}
+		}
+
+	m_Data = &m_Baked[0];
+	return true;
+}
+
+/*
+----------------------------------------------------------------------
+cache file
+----------------------------------------------------------------------
+*/
+
+bool SdfCollider::save( const char *fileName ) const
+{
+	if ( !m_Data )
+		return false;
+
+	FILE *fp = fopen( fileName, "wb" );
+	if ( !fp )
+		return false;
+
+	SdfFileHeader header;
+	memcpy( header.magic, "CSDF", 4 );
+	header.version = SDF_FILE_VERSION;
+	header.nx = m_Nx;
+	header.ny = m_Ny;
+	header.nz = m_Nz;
+	header.resolution = m_Resolution;
+	header.origin[0] = m_Origin[0];
+	header.origin[1] = m_Origin[1];
+	header.origin[2] = m_Origin[2];
+	header.cell_size = m_CellSize;
+
+	size_t cells = (size_t)m_Nx * m_Ny * m_Nz;
+	bool ok = fwrite( &header, sizeof(header), 1, fp ) == 1 &&
+	          fwrite( m_Data, sizeof(float), cells, fp ) == cells;
+	fclose( fp );
+	return ok;
+}
+
+bool SdfCollider::load( const char *fileName )
+{
+	int fd = open( fileName, O_RDONLY );
+	if ( fd < 0 )
+		return false;
+
+	struct stat st;
+	if ( fstat( fd, &st ) != 0 || (size_t)st.st_size < sizeof(SdfFileHeader) ) {
+		close( fd );
+		return false;
+	}
+
+	void *map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );	// the mapping stays valid after closing the descriptor
+	if ( map == MAP_FAILED )
+		return false;
+
+	const SdfFileHeader *header = (const SdfFileHeader *)map;
+	size_t cells = (size_t)header->nx * header->ny * header->nz;
+	if ( memcmp( header->magic, "CSDF", 4 ) != 0 || header->version != SDF_FILE_VERSION ||
+	     header->nx < 2 || header->ny < 2 || header->nz < 2 ||
+	     (size_t)st.st_size != sizeof(SdfFileHeader) + cells * sizeof(float) ) {
+		munmap( map, st.st_size );
+		return false;
+	}
+
+	release();
+	m_Map = map;
+	m_MapSize = st.st_size;
+	m_Nx = header->nx;
+	m_Ny = header->ny;
+	m_Nz = header->nz;
+	m_Resolution = header->resolution;
+	m_Origin = Vec3f( header->origin[0], header->origin[1], header->origin[2] );
+	m_CellSize = header->cell_size;
+	m_Data = (const float *)( (const char *)map + sizeof(SdfFileHeader) );
+	return true;
+}
+
+SdfCollider* SdfCollider::load_or_bake( const char *meshFile, const char *cacheFile, int resolution )
+{
+	SdfCollider *pCollider = new SdfCollider();
+
+	struct stat mesh_st, cache_st;
+	bool mesh_exists = stat( meshFile, &mesh_st ) == 0;
+	bool cache_fresh = stat( cacheFile, &cache_st ) == 0 && ( !mesh_exists || cache_st.st_mtime >= mesh_st.st_mtime );
+
+	if ( cache_fresh && pCollider->load( cacheFile ) && pCollider->resolution() == resolution )
+		return pCollider;
+
+	std::vector<Vec3f> vertices;
+	std::vector<int> triangles;
+	if ( !load_obj_triangles( meshFile, vertices, triangles ) || !pCollider->bake( vertices, triangles, resolution ) ) {
+		fprintf( stderr, "Cannot build a distance field from %s\n", meshFile );
+		delete pCollider;
+		return NULL;
+	}
+
+	if ( !pCollider->save( cacheFile ) )
+		fprintf( stderr, "Cannot write distance field cache %s\n", cacheFile );
+	return pCollider;
+}
+
+/*
+----------------------------------------------------------------------
+queries
+----------------------------------------------------------------------
+*/
+
+float SdfCollider::sample( const Vec3f &p, Vec3f *gradient ) const
+{
+	Vec3f g = ( p - m_Origin ) / m_CellSize;
+	if ( !m_Data || g[0] < 0.0f || g[1] < 0.0f || g[2] < 0.0f ||
+	     g[0] >= m_Nx - 1 || g[1] >= m_Ny - 1 || g[2] >= m_Nz - 1 ) {
+		if ( gradient )
+			*gradient = Vec3f( 0.0, 0.0, 0.0 );
+		return FLT_MAX;		// the padding keeps every surface inside the grid
+	}
+
+	int i = (int)g[0], j = (int)g[1], k = (int)g[2];
+	float fx = g[0] - i, fy = g[1] - j, fz = g[2] - k;
+
+	float c000 = cell( i, j, k ),     c100 = cell( i+1, j, k ),
+	      c010 = cell( i, j+1, k ),   c110 = cell( i+1, j+1, k ),
+	      c001 = cell( i, j, k+1 ),   c101 = cell( i+1, j, k+1 ),
+	      c011 = cell( i, j+1, k+1 ), c111 = cell( i+1, j+1, k+1 );
+
+	// interpolate along x, then y, then z
+	float c00 = c000 + fx * ( c100 - c000 ), c10 = c010 + fx * ( c110 - c010 ),
+	      c01 = c001 + fx * ( c101 - c001 ), c11 = c011 + fx * ( c111 - c011 );
+	float c0 = c00 + fy * ( c10 - c00 ), c1 = c01 + fy * ( c11 - c01 );
+
+	if ( gradient )
+	{
+		// analytic derivative of the trilinear interpolant
+		float dx00 = c100 - c000, dx10 = c110 - c010, dx01 = c101 - c001, dx11 = c111 - c011;
+		float dx0 = dx00 + fy * ( dx10 - dx00 ), dx1 = dx01 + fy * ( dx11 - dx01 );
+		float dy0 = c10 - c00, dy1 = c11 - c01;
+		*gradient = Vec3f( dx0 + fz * ( dx1 - dx0 ), dy0 + fz * ( dy1 - dy0 ), c1 - c0 ) / m_CellSize;
+	}
+
+	return c0 + fz * ( c1 - c0 );
+}
+
+bool SdfCollider::collide( Vec3f &position, Vec3f &velocity, float thickness, float friction ) const
+{
+	Vec3f gradient;
+	float phi = sample( position, &gradient );
+	if ( phi >= thickness )
+		return false;
+
+	float length = norm( gradient );
+	if ( length < 1e-6f )
+		return false;
+	Vec3f normal = gradient / length;
+
+	position += ( thickness - phi ) * normal;
+
+	float vn = velocity * normal;
+	if ( vn < 0.0f )
+		velocity = ( velocity - vn * normal ) * ( 1.0f - friction );	// drop the inward part, damp sliding
+	return true;
+}
+
+/*
+----------------------------------------------------------------------
+mesh input
+----------------------------------------------------------------------
+*/
+
+bool load_obj_triangles( const char *fileName, std::vector<Vec3f> &vertices, std::vector<int> &triangles )
+{
+	std::ifstream in( fileName );
+	if ( !in.is_open() )
+		return false;
+
+	std::string line;
+	while ( std::getline( in, line ) )
+	{
+		if ( line.size() < 2 )
+			continue;
+		std::istringstream record( line );
+		std::string tag;
+		record >> tag;
+		if ( tag == "v" ) {
+			float x, y, z;
+			record >> x >> y >> z;
+			vertices.push_back( Vec3f( x, y, z ) );
+		} else if ( tag == "f" ) {
+			// "f a b c ...", each entry may be "v", "v/vt", "v//vn" or "v/vt/vn", indices are 1-based or negative
+			std::vector<int> face;
+			std::string entry;
+			while ( record >> entry ) {
+				int index = atoi( entry.c_str() );
+				face.push_back( index < 0 ? (int)vertices.size() + index : index - 1 );
+			}
+			for ( size_t fi = 2; fi < face.size(); fi++ ) {
+				triangles.push_back( face[0] );
+				triangles.push_back( face[fi-1] );
+				triangles.push_back( face[fi] );
+			}
+		}
+	}
+
+	for ( size_t ti = 0; ti < triangles.size(); ti++ )
+		if ( triangles[ti] < 0 || triangles[ti] >= (int)vertices.size() )
+			return false;
+	return !triangles.empty();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Particle.h"
+#include <vector>
+#include <cstddef>
+
+// Static obstacle represented by a signed distance field sampled on a regular voxel grid.
+// The field is baked once from a closed triangle mesh and cached in a binary file
+// ( header followed by nx * ny * nz floats, x fastest ) which later runs memory-map directly.
+class SdfCollider {
+	public:
+		SdfCollider();
+		~SdfCollider();
+
+		// bake the field from a triangle mesh, "resolution" cells along the longest side of the bounding box
+		bool bake( const std::vector<Vec3f> &vertices, const std::vector<int> &triangles, int resolution );
+
+		bool save( const char *fileName ) const;
+		bool load( const char *fileName );	// memory-maps the file, no copy is made
+
+		// use "cacheFile" if it is newer than "meshFile" and baked at the same resolution, otherwise bake and write it
+		static SdfCollider* load_or_bake( const char *meshFile, const char *cacheFile, int resolution );
+
+		// trilinearly interpolated signed distance ( negative inside ), gradient is optional
+		float sample( const Vec3f &p, Vec3f *gradient ) const;
+
+		// push a particle closer than "thickness" back onto the surface and remove its inward velocity,
+		// returns true on contact
+		bool collide( Vec3f &position, Vec3f &velocity, float thickness, float friction ) const;
+
+		int resolution() const { return m_Resolution; }
+
+	private:
+		void release();
+		float cell( int i, int j, int k ) const { return m_Data[ ( k * m_Ny + j ) * m_Nx + i ]; }
+
+		int m_Nx, m_Ny, m_Nz;
+		int m_Resolution;
+		Vec3f m_Origin;			// world position of voxel (0,0,0)
+		float m_CellSize;
+
+		const float *m_Data;		// points into m_Baked or into the mapping
+		std::vector<float> m_Baked;
+		void *m_Map;
+		size_t m_MapSize;
+};
+
+// minimal Wavefront OBJ reader, only "v" and "f" records are used ( polygons are fanned into triangles )
+bool load_obj_triangles( const char *fileName, std::vector<Vec3f> &vertices, std::vector<int> &triangles );
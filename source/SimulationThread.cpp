@@ -0,0 +1,133 @@
+#include "SimulationThread.h"
+#include "Trace.h"
+
+#include <algorithm>
+
+SimulationThread::SimulationThread( ClothWorld *pWorld, float dt, const std::string &mode, double step_rate, int max_steps_per_frame ) :
+	m_pWorld( pWorld ), m_Dt( dt ), m_Mode( mode ), m_Scheduler( step_rate, max_steps_per_frame ),
+	m_Running( false ), m_Quit( false ), m_ResetsRequested( 0 ), m_ResetsDone( 0 ) {
+}
+
+SimulationThread::~SimulationThread()
+{
+	{
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		m_Quit = true;
+	}
+	m_Wake.notify_one();
+	m_ResetDone.notify_all();
+	if ( m_Thread.joinable() )
+		m_Thread.join();
+}
+
+void SimulationThread::start()
+{
+	publish_frame( 1.0f );
+	m_Thread = std::thread( &SimulationThread::run, this );
+}
+
+void SimulationThread::set_running( bool running )
+{
+	{
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		m_Running = running;
+	}
+	m_Wake.notify_one();
+}
+
+void SimulationThread::request_reset()
+{
+	{
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		m_ResetsRequested++;
+	}
+	m_Wake.notify_one();
+}
+
+void SimulationThread::wait_for_reset()
+{
+	std::unique_lock<std::mutex> lock( m_Mutex );
+	const long requested = m_ResetsRequested;
+	m_ResetDone.wait( lock, [&]{ return m_Quit || m_ResetsDone >= requested; } );
+}
+
+const ClothFrame &SimulationThread::latest_frame()
+{
+	m_Frames.update();
+	return m_Frames.read_buffer();
+}
+
+float SimulationThread::interpolation( const ClothFrame &frame ) const
+{
+	double since = std::chrono::duration<double>( std::chrono::steady_clock::now() - frame.published ).count();
+	return std::min( 1.0, frame.interpolation + since / m_Scheduler.step_period() );
+}
+
+// the positions of "previous" and "current" are copied, the world keeps running meanwhile
+void SimulationThread::publish_frame( float interpolation )
+{
+	std::vector<Particle*> &pVector = m_pWorld->pVector;
+	int ii, size = pVector.size();
+	ClothFrame &frame = m_Frames.write_buffer();
+	frame.current.resize( size );
+	for(ii=0; ii<size; ii++)
+		frame.current[ii] = pVector[ii]->m_Position;
+	frame.previous = m_Previous.size() == size ? m_Previous : frame.current;
+	frame.step = m_pWorld->step_count();
+	frame.interpolation = interpolation;
+	frame.published = std::chrono::steady_clock::now();
+	m_Frames.publish();
+}
+
+void SimulationThread::run()
+{
+	TRACE_THREAD_NAME( "simulation" );
+	bool was_running = false;
+	for ( ;; )
+	{
+		long reset;		// requests served by this pass, 0 for none
+		{
+			// a paused simulation sleeps here instead of stepping with dt = 0
+			std::unique_lock<std::mutex> lock( m_Mutex );
+			m_Wake.wait( lock, [&]{ return m_Quit || m_Running || m_ResetsRequested != m_ResetsDone; } );
+			if ( m_Quit )
+				return;
+			reset = m_ResetsRequested != m_ResetsDone ? m_ResetsRequested : 0;
+			if ( m_Running && !was_running )
+				m_Scheduler.restart();	// time spent paused is not owed
+			was_running = m_Running;
+		}
+
+		if ( reset ) {
+			m_pWorld->reset();
+			m_Previous.clear();
+			m_Scheduler.restart();
+			publish_frame( 1.0f );
+			{
+				std::lock_guard<std::mutex> lock( m_Mutex );
+				m_ResetsDone = reset;
+			}
+			m_ResetDone.notify_all();
+			continue;
+		}
+		if ( !was_running )
+			continue;
+
+		std::vector<Particle*> &pVector = m_pWorld->pVector;
+		int steps = m_Scheduler.steps_due();
+		for ( int si = 0; si < steps; si++ )
+		{
+			if ( si == steps - 1 ) {
+				m_Previous.resize( pVector.size() );
+				for ( int ii = 0; ii < pVector.size(); ii++ )
+					m_Previous[ii] = pVector[ii]->m_Position;
+			}
+			m_pWorld->simulation_step( m_Dt, m_Mode );
+		}
+
+		if ( steps > 0 )
+			publish_frame( m_Scheduler.interpolation() );
+		else
+			std::this_thread::sleep_for( std::chrono::duration<double>( m_Scheduler.seconds_to_next_step() ) );
+	}
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "ClothWorld.h"
+#include "FrameScheduler.h"
+#include "TripleBuffer.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// One complete simulation state as the renderer sees it
+struct ClothFrame {
+	std::vector<Vec3f> previous;	// positions before the last step of the batch
+	std::vector<Vec3f> current;		// positions after it
+	int step;						// world step count of "current"
+	float interpolation;			// how far past "current" the fixed step clock already was when published
+	std::chrono::steady_clock::time_point published;
+};
+
+// Runs a ClothWorld on its own thread at a fixed step rate and hands finished states to the
+// renderer through a triple buffer, so neither side waits for the other ( vsync, glReadPixels,
+// mesh building ). Once started, the world belongs to the thread: everything else goes through
+// set_running(), request_reset() and latest_frame().
+class SimulationThread {
+	public:
+		SimulationThread( ClothWorld *pWorld, float dt, const std::string &mode, double step_rate, int max_steps_per_frame );
+		~SimulationThread();	// stops and joins the thread, the world is not deleted
+
+		void start();	// starts paused, with the initial state already published
+		void set_running( bool running );
+		void request_reset();	// back to the construction state at the next opportunity
+		void wait_for_reset();	// until the state of the last request_reset() is published, after start()
+
+		// newest published frame, never blocks; only valid until the next call
+		const ClothFrame &latest_frame();
+		// blend factor between previous and current for drawing a frame now
+		float interpolation( const ClothFrame &frame ) const;
+
+	private:
+		SimulationThread( const SimulationThread & );
+		void operator = ( const SimulationThread & );
+
+		void run();
+		void publish_frame( float interpolation );
+
+		ClothWorld *m_pWorld;
+		float m_Dt;
+		std::string m_Mode;
+		FrameScheduler m_Scheduler;		// only touched by the simulation thread once started
+		std::vector<Vec3f> m_Previous;
+		TripleBuffer<ClothFrame> m_Frames;
+
+		std::thread m_Thread;
+		std::mutex m_Mutex;				// guards the flags and counts below
+		std::condition_variable m_Wake, m_ResetDone;
+		bool m_Running, m_Quit;
+		long m_ResetsRequested, m_ResetsDone;
+};
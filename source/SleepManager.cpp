@@ -0,0 +1,124 @@
+#include "SleepManager.h"
+
+#include <algorithm>
+
+const float SLEEP_ENERGY = 1e-9f;
+const float WAKE_ENERGY = 1e-7f;
+const int SLEEP_STEPS = 60;
+
+SleepManager::SleepManager() :
+	m_SleepEnergy(SLEEP_ENERGY), m_WakeEnergy(WAKE_ENERGY), m_SleepSteps(SLEEP_STEPS), m_Enabled(false) {
+}
+
+void SleepManager::init( const std::vector<int> &patch_of_particle )
+{
+	int patches = 0;
+	for ( int ii = 0; ii < patch_of_particle.size(); ii++ )
+		patches = std::max( patches, patch_of_particle[ii] + 1 );
+
+	m_PatchOf = patch_of_particle;
+	m_PreviousVelocity.assign( patch_of_particle.size(), Vec3f(0.0, 0.0, 0.0) );
+	m_ParticleEnergy.assign( patch_of_particle.size(), 0.0f );
+	m_PatchEnergy.assign( patches, 0.0f );
+	m_PatchQuietSteps.assign( patches, 0 );
+	m_PatchAsleep.assign( patches, 0 );
+	m_Enabled = true;
+}
+
+void SleepManager::disable()
+{
+	m_Enabled = false;
+}
+
+void SleepManager::wake_patch( int patch )
+{
+	m_PatchAsleep[patch] = 0;
+	m_PatchQuietSteps[patch] = 0;
+}
+
+void SleepManager::wake_particle( int particle )
+{
+	if ( m_Enabled )
+		wake_patch( m_PatchOf[particle] );
+}
+
+void SleepManager::wake_all()
+{
+	for ( int pi = 0; pi < m_PatchAsleep.size(); pi++ )
+		wake_patch( pi );
+}
+
+int SleepManager::active_particle_count() const
+{
+	if ( !m_Enabled )
+		return m_PatchOf.size();
+
+	int count = 0;
+	for ( int ii = 0; ii < m_PatchOf.size(); ii++ )
+		if ( !m_PatchAsleep[ m_PatchOf[ii] ] )
+			count++;
+	return count;
+}
+
+template <class Real>
+void SleepManager::update( const std::vector<ParticleT<Real>*> &pVector, const std::vector<NonconstraintForce*> &pNonconstraintForceVector )
+{
+	if ( !m_Enabled )
+		return;
+
+	int ii, size = pVector.size();
+
+	// 1. per-particle and per-patch energy of the awake particles
+	std::fill( m_PatchEnergy.begin(), m_PatchEnergy.end(), 0.0f );
+	for ( ii = 0; ii < size; ii++ )
+	{
+		int patch = m_PatchOf[ii];
+		if ( m_PatchAsleep[patch] ) {
+			m_ParticleEnergy[ii] = 0.0f;
+			continue;
+		}
+		Vec3f velocity = pVector[ii]->m_Velocity;
+		Vec3f delta_Velocity = velocity - m_PreviousVelocity[ii];
+		m_ParticleEnergy[ii] = 0.5f * ( velocity * velocity + delta_Velocity * delta_Velocity );
+		m_PreviousVelocity[ii] = velocity;
+		m_PatchEnergy[patch] = std::max( m_PatchEnergy[patch], m_ParticleEnergy[ii] );
+	}
+
+	// 2. sleeping patches next to a moving neighbour wake up
+	int fi, forceVectorSize = pNonconstraintForceVector.size();
+	for ( fi = 0; fi < forceVectorSize; fi++ )
+	{
+		if ( !pNonconstraintForceVector[fi]->is_spring )
+			continue;
+		SpringForceT<Real>* pSpring = ( SpringForceT<Real>* )( pNonconstraintForceVector[fi] );
+		int p1 = pSpring->index_of_p1(), p2 = pSpring->index_of_p2();
+		bool asleep1 = m_PatchAsleep[ m_PatchOf[p1] ], asleep2 = m_PatchAsleep[ m_PatchOf[p2] ];
+		if ( asleep1 == asleep2 )
+			continue;
+		if ( asleep1 && m_ParticleEnergy[p2] > m_WakeEnergy )
+			wake_patch( m_PatchOf[p1] );
+		else if ( asleep2 && m_ParticleEnergy[p1] > m_WakeEnergy )
+			wake_patch( m_PatchOf[p2] );
+	}
+
+	// 3. quiet patches fall asleep and stop dead
+	for ( int pi = 0; pi < m_PatchAsleep.size(); pi++ )
+	{
+		if ( m_PatchAsleep[pi] )
+			continue;
+		if ( m_PatchEnergy[pi] < m_SleepEnergy )
+			m_PatchQuietSteps[pi]++;
+		else
+			m_PatchQuietSteps[pi] = 0;
+		if ( m_PatchQuietSteps[pi] >= m_SleepSteps )
+			m_PatchAsleep[pi] = 1;
+	}
+	for ( ii = 0; ii < size; ii++ )
+		if ( m_PatchAsleep[ m_PatchOf[ii] ] ) {
+			pVector[ii]->m_Velocity = Vec3f(0.0, 0.0, 0.0);
+			m_PreviousVelocity[ii] = pVector[ii]->m_Velocity;
+		}
+}
+
+template void SleepManager::update( const std::vector<ParticleT<float>*> &, const std::vector<NonconstraintForce*> & );
+template void SleepManager::update( const std::vector<ParticleT<double>*> &, const std::vector<NonconstraintForce*> & );
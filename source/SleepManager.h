@@ -0,0 +1,50 @@
+#pragma once
+
+#include "Particle.h"
+#include "SpringForce.h"
+#include <vector>
+
+template <class P> class ClothWorldT;
+
+// Deactivation of cloth regions at rest.
+// Particles are grouped into patches; a patch falls asleep once every particle in it has stayed
+// below SLEEP_ENERGY for SLEEP_STEPS consecutive steps. Sleeping particles are frozen: the solver
+// skips springs whose both ends sleep and leaves their state out of the integrator update.
+// A patch wakes when a spring neighbour moves faster than WAKE_ENERGY, on an obstacle contact,
+// or explicitly through wake_particle() ( impulses, user interaction ).
+class SleepManager {
+	public:
+		SleepManager();
+
+		// patch_of_particle[i] is the patch id of particle i, ids are 0 .. patch count - 1
+		void init( const std::vector<int> &patch_of_particle );
+		void disable();
+		bool enabled() const { return m_Enabled; }
+
+		// measure energies after an integration step and put quiet patches to sleep / wake disturbed ones
+		template <class Real>
+		void update( const std::vector<ParticleT<Real>*> &pVector, const std::vector<NonconstraintForce*> &pNonconstraintForceVector );
+
+		bool is_asleep( int particle ) const { return m_Enabled && m_PatchAsleep[ m_PatchOf[particle] ]; }
+		void wake_particle( int particle );
+		void wake_patch( int patch );
+		void wake_all();
+
+		int active_particle_count() const;
+		int patch_count() const { return m_PatchAsleep.size(); }
+
+		float m_SleepEnergy;	// per-particle energy below which a particle counts as resting
+		float m_WakeEnergy;		// energy of an awake neighbour that wakes a sleeping patch
+		int m_SleepSteps;		// consecutive quiet steps before a patch sleeps
+
+	private:
+		template <class P> friend class ClothWorldT;	// saves and restores the state in checkpoints
+
+		bool m_Enabled;
+		std::vector<int> m_PatchOf;
+		std::vector<Vec3f> m_PreviousVelocity;
+		std::vector<float> m_ParticleEnergy;	// 1/2 |v|^2 + 1/2 |dv|^2 of the last step, unit mass
+		std::vector<float> m_PatchEnergy;		// largest particle energy in the patch
+		std::vector<int> m_PatchQuietSteps;
+		std::vector<char> m_PatchAsleep;
+};
@@ -1,5 +1,6 @@
-#include "Particle.h"
-#include "SpringForce.h"	// definition of NonconstraintForce
+#include "ClothWorld.h"
+#include "Profiler.h"
+#include "Trace.h"
 
 #include <vector>
 #include <cstdio>
@@ -7,20 +8,37 @@
 
 #include <cmath>
 #include <cstring>
-
-std::vector<Vec3f> variableVector;		// in our case, should be [x1,v1,x2,v2,...,xn,vn]
-std::vector<Vec3f> derivativeVector;	// should be [v1,f1/m1,...,vn,fn/mn]
+#include <algorithm>
+#include <functional>
 
 const Vec3f ZERO_FORCE(0.0, 0.0, 0.0);
-const int N = 20;
 
-bool are_nodes_adjacent( int i, int j ){
-	return ( abs( i-j ) == N ) || ( ( abs( i-j ) == 1 ) && !( ( (i+j+1) % (2*N) ) == 0 ) )
-	       || ( ( abs	( (i%N) - (j%N) ) == 1 ) && ( abs( i - j ) == N ) );
+const float COLLISION_THICKNESS = 0.01f;	// particles are kept this far outside of obstacle surfaces
+const float COLLISION_FRICTION = 0.1f;		// fraction of tangential velocity lost on contact
+const float COLLISION_WAKE_DEPTH = 0.5f * COLLISION_THICKNESS;	// contact this deep wakes a sleeping particle
+
+// work items per parallel task; a constant, so partitions never depend on the thread count
+const int PARALLEL_CHUNK = 1024;
+
+// list the state entries the integrators have to update, sleeping particles are left out
+template <class P>
+void ClothWorldT<P>::interface_update_active_variables()
+{
+	int ii, size = pVector.size();
+	activeVariableVector.clear();
+	for(ii=0; ii<size; ii++)
+	{
+		if ( sleepManager.is_asleep( ii ) )
+			continue;
+		activeVariableVector.push_back( 2 * ii );
+		activeVariableVector.push_back( 2 * ii + 1 );
+	}
 }
 
-void interface_get_variable_data( std::vector<Particle*> pVector )
+template <class P>
+void ClothWorldT<P>::interface_get_variable_data()
 {
+	PROFILE_SCOPE( PHASE_GATHER );
 	int ii, size = pVector.size();
 	for(ii=0; ii<size; ii++)
 	{
@@ -30,15 +48,28 @@ void interface_get_variable_data( std::vector<Particle*> pVector )
 }
 
 // accumulate all forces on a particle and evaluate acceleration
-void interface_derivative_evaluation( std::vector<Particle*> pVector, std::vector<NonconstraintForce*> pNonconstraintForceVector )
+template <class P>
+void ClothWorldT<P>::interface_derivative_evaluation()
 {
+	PROFILE_SCOPE( PHASE_FORCES );
+	PROFILE_COUNT( COUNTER_FORCE_EVALUATIONS, 1 );
+
+	if ( m_pPool && m_pPool->size() > 1 ) {
+		if ( m_Deterministic )
+			derivative_evaluation_deterministic();
+		else
+			derivative_evaluation_fast();
+		return;
+	}
+
 	int ii, size = pVector.size();
 	
 	for(ii=0; ii<size; ii++)
 	{
 		derivativeVector.push_back( pVector[ii]->m_Velocity );
-		derivativeVector.push_back( ZERO_FORCE );	// initialize force accumulator as zero
+		derivativeVector.push_back( ZERO_FORCE );
 	}
+	accelerationVector.assign( size, ZERO_FORCE );	// initialize force accumulator as zero
 	
 	// Nonconstraint forces
 	int fi, forceVectorSize = pNonconstraintForceVector.size();	// forceVectorSize = 2 * size
@@ -47,16 +78,20 @@ void interface_derivative_evaluation( std::vector<Particle*> pVector, std::vecto
 		if( pNonconstraintForceVector[fi]->is_spring )
 		{
 			// spring force, add to connected particles' force accumulator
-			SpringForce* pCurrentForce = ( SpringForce* )( pNonconstraintForceVector[fi] );
+			SpringType* pCurrentForce = ( SpringType* )( pNonconstraintForceVector[fi] );
 			
 			pCurrentForce->update_index( pVector );
 			
 			int index_of_p1 = pCurrentForce->index_of_p1(),
 				index_of_p2 = pCurrentForce->index_of_p2();
 			
+			// both ends frozen, nothing to integrate
+			if ( sleepManager.is_asleep( index_of_p1 ) && sleepManager.is_asleep( index_of_p2 ) )
+				continue;
+			
 			// Suppose that every particle has unit mass	
-			derivativeVector[ 2 * index_of_p1 + 1 ] += pCurrentForce->force_on_p1();	
-			derivativeVector[ 2 * index_of_p2 + 1 ] += pCurrentForce->force_on_p2();
+			accelerationVector[ index_of_p1 ] += pCurrentForce->force_on_p1();	
+			accelerationVector[ index_of_p2 ] += pCurrentForce->force_on_p2();
 		}
 		else
 		{
@@ -67,18 +102,180 @@ void interface_derivative_evaluation( std::vector<Particle*> pVector, std::vecto
 				//derivativeVector[ 2 * ii + 1 ] += pCurrentForce->force();
 				
 				// to increase efficiency
-				Vec3f gravity(0.0,-0.03,0.0);
-				derivativeVector[ 2 * ii + 1 ] += gravity;
+				accelerationVector[ ii ] += m_Gravity;
 			}						
 		}
 	}
 	
-	// TODO just for test, let us keep particle0 fixed, i.e. set its acceleration to zero
-	for (int i=0; i<N; i++)
-		derivativeVector[ 1 + 2 * i * N ] = ZERO_FORCE;
+	for(ii=0; ii<size; ii++)
+		derivativeVector[ 2 * ii + 1 ] = accelerationVector[ ii ];
+	
+	// pinned particles keep their position, i.e. set their acceleration to zero
+	for (int pi=0; pi<pinnedVector.size(); pi++)
+		derivativeVector[ 1 + 2 * pinnedVector[pi] ] = ZERO_FORCE;
+}
+
+// per particle list of the springs acting on it, in force order, plus the gravity forces
+template <class P>
+void ClothWorldT<P>::update_spring_incidence()
+{
+	int forceVectorSize = pNonconstraintForceVector.size();
+	if ( m_IncidenceForceCount == forceVectorSize )
+		return;
+
+	int ii, fi, size = pVector.size();
+	incidentOffsetVector.assign( size + 1, 0 );
+	gravityForceVector.clear();
+	for( fi=0; fi<forceVectorSize; fi++ )
+	{
+		if( !pNonconstraintForceVector[fi]->is_spring ) {
+			gravityForceVector.push_back( fi );
+			continue;
+		}
+		SpringType* pCurrentForce = ( SpringType* )( pNonconstraintForceVector[fi] );
+		pCurrentForce->update_index( pVector );
+		incidentOffsetVector[ pCurrentForce->index_of_p1() + 1 ]++;
+		incidentOffsetVector[ pCurrentForce->index_of_p2() + 1 ]++;
+	}
+	for( ii=0; ii<size; ii++ )
+		incidentOffsetVector[ ii + 1 ] += incidentOffsetVector[ ii ];
+
+	// filling in force order keeps every particle's list sorted
+	std::vector<int> fill( incidentOffsetVector.begin(), incidentOffsetVector.end() - 1 );
+	incidentForceVector.resize( incidentOffsetVector[size] );
+	for( fi=0; fi<forceVectorSize; fi++ )
+	{
+		if( !pNonconstraintForceVector[fi]->is_spring )
+			continue;
+		SpringType* pCurrentForce = ( SpringType* )( pNonconstraintForceVector[fi] );
+		incidentForceVector[ fill[ pCurrentForce->index_of_p1() ]++ ] = 2 * fi;
+		incidentForceVector[ fill[ pCurrentForce->index_of_p2() ]++ ] = 2 * fi + 1;
+	}
+
+	springForceVector.resize( 2 * forceVectorSize );
+	springActiveVector.resize( forceVectorSize );
+	m_IncidenceForceCount = forceVectorSize;
+}
+
+// Every spring writes its two forces into its own slots, then every particle sums the
+// slots of its springs in force order. No two tasks write the same memory and the
+// summation order is the serial one, so the result is independent of the thread count.
+template <class P>
+void ClothWorldT<P>::derivative_evaluation_deterministic()
+{
+	update_spring_incidence();
+
+	int size = pVector.size(), forceVectorSize = pNonconstraintForceVector.size();
+	derivativeVector.resize( 2 * size );
+
+	m_pPool->parallel_for( ( forceVectorSize + PARALLEL_CHUNK - 1 ) / PARALLEL_CHUNK, [&]( int chunk ) {
+		TRACE_SCOPE( "spring batch" );
+		int end = std::min( forceVectorSize, ( chunk + 1 ) * PARALLEL_CHUNK );
+		for( int fi = chunk * PARALLEL_CHUNK; fi < end; fi++ )
+		{
+			if( !pNonconstraintForceVector[fi]->is_spring )
+				continue;
+			SpringType* pCurrentForce = ( SpringType* )( pNonconstraintForceVector[fi] );
+			pCurrentForce->update_index( pVector );
+			springActiveVector[fi] = !( sleepManager.is_asleep( pCurrentForce->index_of_p1() ) &&
+			                            sleepManager.is_asleep( pCurrentForce->index_of_p2() ) );
+			if ( !springActiveVector[fi] )
+				continue;
+			springForceVector[ 2 * fi ] = pCurrentForce->force_on_p1();
+			springForceVector[ 2 * fi + 1 ] = pCurrentForce->force_on_p2();
+		}
+	} );
+
+	m_pPool->parallel_for( ( size + PARALLEL_CHUNK - 1 ) / PARALLEL_CHUNK, [&]( int chunk ) {
+		TRACE_SCOPE( "gather batch" );
+		int end = std::min( size, ( chunk + 1 ) * PARALLEL_CHUNK );
+		int gravityCount = gravityForceVector.size();
+		for( int ii = chunk * PARALLEL_CHUNK; ii < end; ii++ )
+		{
+			// merge the particle's springs with the gravity forces, both ascending in force index
+			AccumVec force = ZERO_FORCE;
+			int ei = incidentOffsetVector[ii], eEnd = incidentOffsetVector[ ii + 1 ], gi = 0;
+			while ( ei < eEnd || gi < gravityCount )
+			{
+				if ( gi < gravityCount && ( ei == eEnd || gravityForceVector[gi] < incidentForceVector[ei] / 2 ) ) {
+					force += m_Gravity;
+					gi++;
+					continue;
+				}
+				int entry = incidentForceVector[ei++];
+				if ( springActiveVector[ entry / 2 ] )
+					force += springForceVector[entry];
+			}
+			derivativeVector[ 2 * ii ] = pVector[ii]->m_Velocity;
+			derivativeVector[ 2 * ii + 1 ] = force;
+		}
+	} );
+
+	// pinned particles keep their position, i.e. set their acceleration to zero
+	for (int pi=0; pi<pinnedVector.size(); pi++)
+		derivativeVector[ 1 + 2 * pinnedVector[pi] ] = ZERO_FORCE;
+}
+
+// Chunks of springs go to whichever thread is free and each thread adds into its own
+// accumulator, the accumulators are summed afterwards. Cheaper than the deterministic
+// gather, but the grouping of the sums follows the scheduling.
+template <class P>
+void ClothWorldT<P>::derivative_evaluation_fast()
+{
+	int size = pVector.size(), forceVectorSize = pNonconstraintForceVector.size();
+	int threads = m_pPool->size();
+	derivativeVector.resize( 2 * size );
+	workerForceVector.resize( threads );
+
+	m_pPool->parallel_for( threads, [&]( int worker ) {
+		workerForceVector[worker].assign( size, ZERO_FORCE );
+	} );
+
+	m_pPool->parallel_for( ( forceVectorSize + PARALLEL_CHUNK - 1 ) / PARALLEL_CHUNK, [&]( int chunk, int worker ) {
+		TRACE_SCOPE( "spring batch" );
+		std::vector<AccumVec> &accumulator = workerForceVector[worker];
+		int end = std::min( forceVectorSize, ( chunk + 1 ) * PARALLEL_CHUNK );
+		for( int fi = chunk * PARALLEL_CHUNK; fi < end; fi++ )
+		{
+			if( !pNonconstraintForceVector[fi]->is_spring )
+				continue;
+			SpringType* pCurrentForce = ( SpringType* )( pNonconstraintForceVector[fi] );
+			pCurrentForce->update_index( pVector );
+			int index_of_p1 = pCurrentForce->index_of_p1(),
+				index_of_p2 = pCurrentForce->index_of_p2();
+			if ( sleepManager.is_asleep( index_of_p1 ) && sleepManager.is_asleep( index_of_p2 ) )
+				continue;
+			accumulator[index_of_p1] += pCurrentForce->force_on_p1();
+			accumulator[index_of_p2] += pCurrentForce->force_on_p2();
+		}
+	} );
+
+	int gravityCount = 0;
+	for( int fi=0; fi<forceVectorSize; fi++ )
+		if( !pNonconstraintForceVector[fi]->is_spring )
+			gravityCount++;
+
+	m_pPool->parallel_for( ( size + PARALLEL_CHUNK - 1 ) / PARALLEL_CHUNK, [&]( int chunk ) {
+		TRACE_SCOPE( "reduce batch" );
+		int end = std::min( size, ( chunk + 1 ) * PARALLEL_CHUNK );
+		for( int ii = chunk * PARALLEL_CHUNK; ii < end; ii++ )
+		{
+			AccumVec force = ZERO_FORCE;
+			for( int gi = 0; gi < gravityCount; gi++ )
+				force += m_Gravity;
+			for( int wi = 0; wi < threads; wi++ )
+				force += workerForceVector[wi][ii];
+			derivativeVector[ 2 * ii ] = pVector[ii]->m_Velocity;
+			derivativeVector[ 2 * ii + 1 ] = force;
+		}
+	} );
+
+	for (int pi=0; pi<pinnedVector.size(); pi++)
+		derivativeVector[ 1 + 2 * pinnedVector[pi] ] = ZERO_FORCE;
 }
 
-void interface_return_variable_data( std::vector<Particle*> pVector )
+template <class P>
+void ClothWorldT<P>::interface_return_variable_data()
 {
 	int ii, size = pVector.size();
 	for(ii=0; ii<size; ii++)
@@ -88,236 +285,263 @@ void interface_return_variable_data( std::vector<Particle*> pVector )
 	}
 }
 
-void euler_method( std::vector<Particle*> pVector, std::vector<NonconstraintForce*> pNonconstraintForceVector, float dt ) {
+template <class P>
+void ClothWorldT<P>::euler_method( Real dt ) {
 	/*****Euler's Method******/
-	// printf("\n==============================\nSIMULATION_STEP\n\nI.Getting variable data\n");	
-	interface_get_variable_data( pVector );	
+	// the state used to be dumped to stdout here, record a trajectory instead ( TrajectoryRecorder.h )
+	interface_get_variable_data();	
 	
-	int vi, size = variableVector.size();
+	int vi;
+	int ai, active_size = activeVariableVector.size();
 	
-	printf("variable vector:" );
-	for(vi=0; vi<size; vi++)
-	{
-		std::cout << variableVector[vi] << "\t";
-	}
-	printf("\n");
-	
-	interface_derivative_evaluation( pVector, pNonconstraintForceVector );
+	interface_derivative_evaluation();
 
-	printf("derivative vector:" );
-	for(vi=0; vi<size; vi++)
-	{
-		std::cout << derivativeVector[vi] << "\t";
-	}
-	printf("\n");
-	
-	// int vi, size = variableVector.size();
-	
-	printf("\nII.Euler Step\n");
-
-	for(vi=0; vi<size; vi++)
+	for(ai=0; ai<active_size; ai++)
 	{
+		vi = activeVariableVector[ai];
 		variableVector[vi] += dt * derivativeVector[vi];
 	}
 
-	printf("\nIII.Returning variable data\n");
-	
-	printf("variable vector:" );
-	for(vi=0; vi<size; vi++)
-	{
-		std::cout << variableVector[vi] << "\t";
-	}
-	printf("\n");
-	
-	printf("derivative vector:" );
-	for(vi=0; vi<size; vi++)
-	{
-		std::cout << derivativeVector[vi] << "\t";
-	}
-	printf("\n==============================\n");
-	
-	interface_return_variable_data( pVector );
+	interface_return_variable_data();
 	
 	variableVector.clear();
 	derivativeVector.clear();
 
 }
 
-void midpoint_method( std::vector<Particle*> pVector, std::vector<NonconstraintForce*> pNonconstraintForceVector, float dt ) {
+template <class P>
+void ClothWorldT<P>::midpoint_method( Real dt ) {
 	/*****The Midpoint Method or Runge-Kutta 2 Method******/
 	
-	interface_get_variable_data( pVector );	
+	interface_get_variable_data();	
 
-	int vi, size = variableVector.size();
+	int vi;
+	int ai, active_size = activeVariableVector.size();
 
-	interface_derivative_evaluation( pVector, pNonconstraintForceVector );
+	TRACE_START( k1_timer );
+	interface_derivative_evaluation();
 
-	for(vi=0; vi<size; vi++)
+	for(ai=0; ai<active_size; ai++)
 	{
+		vi = activeVariableVector[ai];
 		variableVector[vi] += dt * derivativeVector[vi] / 2;
 	}
 
-	interface_return_variable_data( pVector );
+	interface_return_variable_data();
 
-	for(vi=0; vi<size; vi++)
+	for(ai=0; ai<active_size; ai++)
 	{
+		vi = activeVariableVector[ai];
 		variableVector[vi] -= dt * derivativeVector[vi] / 2;
 	}
+	TRACE_STOP( k1_timer, "midpoint k1" );
 
 	derivativeVector.clear();
 	
-	interface_derivative_evaluation( pVector, pNonconstraintForceVector );
+	TRACE_START( k2_timer );
+	interface_derivative_evaluation();
 
-	for(vi=0; vi<size; vi++)
+	for(ai=0; ai<active_size; ai++)
 	{
+		vi = activeVariableVector[ai];
 		variableVector[vi] += dt * derivativeVector[vi];
 	}
 
-	interface_return_variable_data( pVector );
+	interface_return_variable_data();
+	TRACE_STOP( k2_timer, "midpoint k2" );
 
 	variableVector.clear();
 	derivativeVector.clear();
 }
 
-void runge_kutta4_method( std::vector<Particle*> pVector, std::vector<NonconstraintForce*> pNonconstraintForceVector, float dt ) {
+template <class P>
+void ClothWorldT<P>::runge_kutta4_method( Real dt ) {
 	/*****Runge-Kutta 4 Method******/
-	interface_get_variable_data( pVector );
-	std::vector<Vec3f> tempVariableVector = variableVector,
+	interface_get_variable_data();
+	std::vector<Vec> tempVariableVector = variableVector,
 					   tempSumVector = variableVector;	
 	
-	int vi, size = variableVector.size();
+	int vi;
+	int ai, active_size = activeVariableVector.size();
 	
-	// Generate an independent copy of pVector called pTempParticleVector
-	std::vector<Particle*> pTempParticleVector;
-	
-	// deep copy construction
-	for (int ii=0; ii<pVector.size(); ii++ )
-	{
-		pTempParticleVector.push_back( new Particle( Vec3f(0.0, 0.0, 0.0) ) );	
-		*( pTempParticleVector.back() ) = pVector[ii];
-	}
+	// keep x_0, every stage restarts from it
+	initialVariableVector = variableVector;
 	
 	// k_1 = hf( x_0 , t_0 )
-	interface_derivative_evaluation( pVector, pNonconstraintForceVector );	// f(x_0)
+	TRACE_START( k1_timer );
+	interface_derivative_evaluation();	// f(x_0)
 	
-	for(vi=0; vi<size; vi++)
+	for(ai=0; ai<active_size; ai++)
 	{
+		vi = activeVariableVector[ai];
 		tempVariableVector[vi] = dt * derivativeVector[vi];		// k_1
 		tempSumVector[vi] += dt * tempVariableVector[vi] / 6;	// x_0 + k_1 / 6
 	}
 	
-	for(vi=0; vi<size; vi++)
+	for(ai=0; ai<active_size; ai++)
 	{
+		vi = activeVariableVector[ai];
 		variableVector[vi] += tempVariableVector[vi] / 2;
 	}
 	
-	interface_return_variable_data( pVector );	// x_0 + k_1 / 2
+	interface_return_variable_data();	// x_0 + k_1 / 2
+	TRACE_STOP( k1_timer, "rk4 k1" );
 	
 	variableVector.clear();
 	derivativeVector.clear();
 	
 	// k_2 = hf( x_0 + k_1 / 2 , t_0 + h / 2 )	
-	interface_derivative_evaluation( pVector, pNonconstraintForceVector );	
+	TRACE_START( k2_timer );
+	interface_derivative_evaluation();	
 	
-	for(vi=0; vi<size; vi++)
+	for(ai=0; ai<active_size; ai++)
 	{
+		vi = activeVariableVector[ai];
 		tempVariableVector[vi] = dt * derivativeVector[vi];	// k_2
 		tempSumVector[vi] += dt * tempVariableVector[vi] / 3;	// x_0 + k_1 / 6 + k_2 / 3 
 	}
 	
-	interface_get_variable_data( pTempParticleVector );	
+	variableVector = initialVariableVector;	
 	
-	for(vi=0; vi<size; vi++)
+	for(ai=0; ai<active_size; ai++)
 	{
+		vi = activeVariableVector[ai];
 		variableVector[vi] += tempVariableVector[vi] / 2;
 	}
 	
-	interface_return_variable_data( pVector );	// x_0 + k_2 / 2
+	interface_return_variable_data();	// x_0 + k_2 / 2
+	TRACE_STOP( k2_timer, "rk4 k2" );
 	
 	variableVector.clear();
 	derivativeVector.clear();
 	
 	// k_3 = hf( x_0 + k_2 / 2 , t_0 + h / 2 )
-	interface_derivative_evaluation( pVector, pNonconstraintForceVector );	
+	TRACE_START( k3_timer );
+	interface_derivative_evaluation();	
 	
-	for(vi=0; vi<size; vi++)
+	for(ai=0; ai<active_size; ai++)
 	{
+		vi = activeVariableVector[ai];
 		tempVariableVector[vi] = dt * derivativeVector[vi];	// k_3
 		tempSumVector[vi] += dt * tempVariableVector[vi] / 3;	// x_0 + k_1 / 6 + k_2 / 3 + k_3 / 3
 	}
 	
-	interface_get_variable_data( pTempParticleVector );
+	variableVector = initialVariableVector;
 	
-	for(vi=0; vi<size; vi++)
+	for(ai=0; ai<active_size; ai++)
 	{
+		vi = activeVariableVector[ai];
 		variableVector[vi] += tempVariableVector[vi];
 	}
 	
-	interface_return_variable_data( pVector );	// x_0 + k_3
+	interface_return_variable_data();	// x_0 + k_3
+	TRACE_STOP( k3_timer, "rk4 k3" );
 	
 	variableVector.clear();
 	derivativeVector.clear();
 	
 	// k4 = hf( x_0 + k_3, t_0 + h )	
-	interface_derivative_evaluation( pVector, pNonconstraintForceVector );	
+	TRACE_START( k4_timer );
+	interface_derivative_evaluation();	
 	
-	interface_get_variable_data( pTempParticleVector );	
+	variableVector = initialVariableVector;	
 	
-	for(vi=0; vi<size; vi++)
+	for(ai=0; ai<active_size; ai++)
 	{
+		vi = activeVariableVector[ai];
 		variableVector[vi] = dt * derivativeVector[vi];		// k_4
 		tempSumVector[vi] += dt * derivativeVector[vi] / 6;	// tempSum = x_0 + k_1 / 6 + k_2 / 3 + k_3 / 3 + k_4 /6
 		variableVector[vi] = tempSumVector[vi];				// variable = tempSum
 	}
-	
-	/*
-	// a very simple self-collision detection mechanism described in https://graphics.stanford.edu/~mdfisher/cloth.html
-	// approximate each node particle as a marble with certain radius
-	const float NODE_RADIUS = 0.0225;
-	for (int ii=0; ii < pVector.size(); ii++ ){
-		for (int jj=(ii+1); jj < pVector.size(); jj++ )
-		{
-			if( ( norm( variableVector[ 2 * ii ] - variableVector[ 2 * jj ] ) < ( 2 * NODE_RADIUS ) )
-				&& ! are_nodes_adjacent( ii, jj ) ) 
-				{
-					variableVector[ 2 * ii ] = pVector[ii]->m_Position;
-					variableVector[ 2 * jj ] = pVector[jj]->m_Position;
-					
-					/*
-					variableVector[ 2 * ii + 1 ] = -variableVector[ 2 * ii + 1] * 0.3;
-					variableVector[ 2 * jj + 1 ] = -variableVector[ 2 * ii + 1] * 0.3;
-					*
-					
-					variableVector[ 2 * ii + 1 ] = Vec3f(0.0f,0.0f,0.0f);
-					variableVector[ 2 * jj + 1 ] = Vec3f(0.0f,0.0f,0.0f);
-					
-					/*printf("\nmodified nodes: %d and %d, original distance: %f\n", ii, jj, norm( pVector[ii]->m_Position - pVector[jj]->m_Position ) );*		
-				
-				}
-		}		
-	}
-	
-	for (int i=0; i<N; i++)
-		variableVector[ 1 + 2 * i * N ] = Vec3f(0.0f,0.0f,0.0f);
-	
-	interface_return_variable_data( pVector );
-	*/
+	TRACE_STOP( k4_timer, "rk4 k4" );
 	
 	variableVector.clear();
 	derivativeVector.clear();
 
 }
 
-void simulation_step( std::vector<Particle*> pVector, std::vector<NonconstraintForce*> pNonconstraintForceVector, float dt, std::string mode )
+// push particles out of the static obstacles, one field lookup per particle and collider
+template <class P>
+void ClothWorldT<P>::collision_pass()
 {
-	if ( mode == "Euler" )
-		euler_method( pVector, pNonconstraintForceVector, dt );
-	else if ( mode == "Midpoint" )
-		midpoint_method( pVector, pNonconstraintForceVector, dt );
-	else if ( mode == "RK4")
-		runge_kutta4_method( pVector, pNonconstraintForceVector, dt );
+	if ( colliderVector.empty() )
+		return;
+	PROFILE_SCOPE( PHASE_COLLISION );
+
+	// particles are independent, only the wake-ups are collected and applied afterwards
+	int size = pVector.size();
+	wakeVector.assign( size, 0 );
+	std::function<void(int)> collide_chunk = [&]( int chunk ) {
+		int end = std::min( size, ( chunk + 1 ) * PARALLEL_CHUNK );
+		for ( int ii = chunk * PARALLEL_CHUNK; ii < end; ii++ )
+			for ( int ci = 0; ci < colliderVector.size(); ci++ )
+			{
+				// the distance fields are single precision whatever the state is
+				Vec3f position = pVector[ii]->m_Position, velocity = pVector[ii]->m_Velocity;
+				if ( !sleepManager.is_asleep( ii ) ) {
+					if ( colliderVector[ci]->collide( position, velocity, COLLISION_THICKNESS, COLLISION_FRICTION ) ) {
+						pVector[ii]->m_Position = position;
+						pVector[ii]->m_Velocity = velocity;
+					}
+					continue;
+				}
+				// a sleeping particle only wakes when an obstacle reaches into it
+				if ( colliderVector[ci]->sample( position, NULL ) < COLLISION_WAKE_DEPTH )
+					wakeVector[ii] = 1;
+			}
+	};
+
+	int chunks = ( size + PARALLEL_CHUNK - 1 ) / PARALLEL_CHUNK;
+	if ( m_pPool )
+		m_pPool->parallel_for( chunks, collide_chunk );
 	else
-		std::cout << "No matching integration mode!";	
+		for ( int chunk = 0; chunk < chunks; chunk++ )
+			collide_chunk( chunk );
+
+	for ( int ii = 0; ii < size; ii++ )
+		if ( wakeVector[ii] )
+			sleepManager.wake_particle( ii );
 }
 
+template <class P>
+void ClothWorldT<P>::simulation_step( float dt, const std::string &mode )
+{
+	PROFILE_SCOPE( PHASE_STEP );
+	interface_update_active_variables();
+
+	{
+		PROFILE_SCOPE( PHASE_INTEGRATE );
+		if ( mode == "Euler" )
+			euler_method( dt );
+		else if ( mode == "Midpoint" )
+			midpoint_method( dt );
+		else if ( mode == "RK4")
+			runge_kutta4_method( dt );
+		else
+			std::cout << "No matching integration mode!";	
+	}
+
+	collision_pass();
+
+	// a paused simulation does not move, so it must not count towards falling asleep either
+	if ( dt > 0.0f ) {
+		sleepManager.update( pVector, pNonconstraintForceVector );
+		m_StepCount++;
+		PROFILE_COUNT( COUNTER_STEPS, 1 );
+	}
+}
+
+template <class P>
+void ClothWorldT<P>::evaluate_forces()
+{
+	derivativeVector.clear();
+	interface_derivative_evaluation();
+}
 
+// simulation_step and evaluate_forces reach every member defined in this file
+template void ClothWorldT<FloatPrecision>::simulation_step( float dt, const std::string &mode );
+template void ClothWorldT<DoublePrecision>::simulation_step( float dt, const std::string &mode );
+template void ClothWorldT<MixedPrecision>::simulation_step( float dt, const std::string &mode );
+template void ClothWorldT<FloatPrecision>::evaluate_forces();
+template void ClothWorldT<DoublePrecision>::evaluate_forces();
+template void ClothWorldT<MixedPrecision>::evaluate_forces();
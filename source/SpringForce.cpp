@@ -1,5 +1,4 @@
 #include "SpringForce.h"
-#include <GL/glut.h>
 
 #include <algorithm>	// to use find(InputIterator first, InputIterator last, const T& val)
 #include <iterator>
@@ -16,64 +15,67 @@ Vec3f GravityForce::force()
   return gravity;	// for unit mass
 }
 
-SpringForce::SpringForce(Particle *p1, Particle * p2, double dist, double ks, double kd) :
-  m_p1(p1), m_p2(p2), m_dist(dist), m_ks(ks), m_kd(kd) {
+template <class Real>
+SpringForceT<Real>::SpringForceT(ParticleT<Real> *p1, ParticleT<Real> * p2, double dist, double ks, double kd) :
+  m_p1(p1), m_p2(p2), m_dist(dist), m_ks(ks), m_kd(kd), index_p1(-1), index_p2(-1) {
   	is_spring = true;
   }
   
-void SpringForce::update_index( std::vector<Particle*> pVector )
+// the cached indices are only searched for again when the particle vector no longer matches them
+template <class Real>
+void SpringForceT<Real>::update_index( const std::vector<ParticleT<Real>*> &pVector )
 {
+  if( index_p1 >= 0 && index_p1 < pVector.size() && pVector[index_p1] == m_p1 &&
+      index_p2 >= 0 && index_p2 < pVector.size() && pVector[index_p2] == m_p2 )
+  	return;
   for( index_p1 = 0; pVector[index_p1] != m_p1; index_p1++ )
   	;
-  for( index_p1 = 0; pVector[index_p2] != m_p2; index_p2++ )
+  for( index_p2 = 0; pVector[index_p2] != m_p2; index_p2++ )
   	; 
 } 
 
-int SpringForce::index_of_p1()
+template <class Real>
+int SpringForceT<Real>::index_of_p1()
 {
   return index_p1; 
 }
 
-int SpringForce::index_of_p2()
+template <class Real>
+int SpringForceT<Real>::index_of_p2()
 {
   return index_p2;
 }
 
-const float air_res = 5.0f;
+const double air_res = 5.0;
 
-Vec3f SpringForce::force_on_p1()
+template <class Real>
+typename SpringForceT<Real>::Vec SpringForceT<Real>::force_on_p1()
 {
-  Vec3f delta_Position = m_p1->m_Position - m_p2->m_Position;
-  Vec3f delta_Velocity = m_p1->m_Velocity - m_p2->m_Velocity;
-  float delta_Distance = norm(delta_Position);
+  Vec delta_Position = m_p1->m_Position - m_p2->m_Position;
+  Vec delta_Velocity = m_p1->m_Velocity - m_p2->m_Velocity;
+  Real delta_Distance = norm(delta_Position);
   
-  Vec3f force_on_p1 = - ( delta_Position / delta_Distance ) * ( m_ks * ( delta_Distance - m_dist ) + m_kd * ( Dot( delta_Velocity, delta_Position / delta_Distance ) ) )
-  					   - Dot( m_p1->m_Velocity, m_p1->m_Velocity ) * air_res * ( m_p1->m_Velocity );
+  Vec force_on_p1 = - ( delta_Position / delta_Distance ) * ( m_ks * ( delta_Distance - m_dist ) + m_kd * ( Dot( delta_Velocity, delta_Position / delta_Distance ) ) )
+  					   - Dot( m_p1->m_Velocity, m_p1->m_Velocity ) * Real( air_res ) * ( m_p1->m_Velocity );
   
   return force_on_p1;
 }
 
-Vec3f SpringForce::force_on_p2()
+template <class Real>
+typename SpringForceT<Real>::Vec SpringForceT<Real>::force_on_p2()
 {
 
-  Vec3f delta_Position = m_p2->m_Position - m_p1->m_Position;
-  Vec3f delta_Velocity = m_p2->m_Velocity - m_p1->m_Velocity;
-  float delta_Distance = norm(delta_Position);
+  Vec delta_Position = m_p2->m_Position - m_p1->m_Position;
+  Vec delta_Velocity = m_p2->m_Velocity - m_p1->m_Velocity;
+  Real delta_Distance = norm(delta_Position);
   
-  Vec3f force_on_p2 = - ( delta_Position / delta_Distance ) * ( m_ks * ( delta_Distance - m_dist ) + m_kd * ( Dot( delta_Velocity, delta_Position / delta_Distance ) ) )
-  					  - ( Dot( m_p2->m_Velocity, m_p1->m_Velocity ) ) * air_res * ( m_p2->m_Velocity ); 
+  Vec force_on_p2 = - ( delta_Position / delta_Distance ) * ( m_ks * ( delta_Distance - m_dist ) + m_kd * ( Dot( delta_Velocity, delta_Position / delta_Distance ) ) )
+  					  - ( Dot( m_p2->m_Velocity, m_p1->m_Velocity ) ) * Real( air_res ) * ( m_p2->m_Velocity ); 
   
   return force_on_p2;
   
   // return ( -force_on_p1() );
 }
 
-void SpringForce::draw()
-{
-  glBegin( GL_LINES );
-  glColor3f(0.6, 0.7, 0.8);
-  glVertex2f( m_p1->m_Position[0], m_p1->m_Position[1] );
-  glColor3f(0.6, 0.7, 0.8);
-  glVertex2f( m_p2->m_Position[0], m_p2->m_Position[1] );
-  glEnd();
-}
+template class SpringForceT<float>;
+template class SpringForceT<double>;
@@ -3,7 +3,8 @@
 #include "Particle.h"
 #include <vector>
 
-inline float Dot( const Vec3f &u, const Vec3f &v )
+template <class Real>
+inline Real Dot( const TVec3<Real> &u, const TVec3<Real> &v )
 {
   return (u[0]*v[0]) + (u[1]*v[1]) + (u[2]*v[2]);
 }
@@ -12,9 +13,7 @@ class NonconstraintForce {
 	public:
 		bool is_spring;		// identify whether this force is gravity or spring force
 		
-		virtual void draw() {
-			return;
-		}					// a virtual function, if this is spring force, draw it, otherwise does nothing
+		virtual ~NonconstraintForce() {}
 };
 
 class GravityForce: public NonconstraintForce {
@@ -27,23 +26,37 @@ class GravityForce: public NonconstraintForce {
 		Vec3f const gravity; 	
 };
 
-class SpringForce: public NonconstraintForce {
+// the whole force evaluation runs in "Real", constants included
+template <class Real>
+class SpringForceT: public NonconstraintForce {
 	public:
-  		SpringForce(Particle *p1, Particle * p2, double dist, double ks, double kd);
+  		typedef TVec3<Real> Vec;
 
-  		void draw();
+  		SpringForceT(ParticleT<Real> *p1, ParticleT<Real> * p2, double dist, double ks, double kd);
+
+  		void draw();	// defined in Drawing.cpp, only the viewer links it
   		
-  		void update_index( std::vector<Particle*> pVector );
+  		void update_index( const std::vector<ParticleT<Real>*> &pVector );
   		int index_of_p1();
   		int index_of_p2();
   		
-  		Vec3f force_on_p1();
-  		Vec3f force_on_p2();
+  		Vec force_on_p1();
+  		Vec force_on_p2();
+
+  		Real stiffness() const { return m_ks; }
+  		Real damping() const { return m_kd; }
+  		Real rest_length() const { return m_dist; }
+
+  		// for callers that already know the indices, saves update_index() its search
+  		void set_index( int i1, int i2 ) { index_p1 = i1; index_p2 = i2; }
 
  	private:
-  		Particle * const m_p1;   // particle 1
-  		Particle * const m_p2;   // particle 2 
-  		double const m_dist;     // rest length
-  		double const m_ks, m_kd; // spring strength constants ( first as stiffness( coefficient in Hooke's law ), second as damping coeffecient )
+  		ParticleT<Real> * const m_p1;   // particle 1
+  		ParticleT<Real> * const m_p2;   // particle 2 
+  		Real const m_dist;     // rest length
+  		Real const m_ks, m_kd; // spring strength constants ( first as stiffness( coefficient in Hooke's law ), second as damping coeffecient )
   		int index_p1, index_p2;
 };
+
+typedef SpringForceT<float> SpringForce;
+template <> void SpringForceT<float>::draw();	// defined in Drawing.cpp
@@ -0,0 +1,87 @@
+#include "ThreadPool.h"
+#include "Trace.h"
+
+#include <string>
+
+// set while a thread runs pool tasks, nested loops then run inline instead of deadlocking
+static thread_local bool inside_pool_task = false;
+
+ThreadPool::ThreadPool( int threads ) :
+	m_Task(NULL), m_Count(0), m_Next(0), m_Busy(0), m_Generation(0), m_Quit(false)
+{
+	if ( threads <= 0 )
+		threads = std::max( 1u, std::thread::hardware_concurrency() );
+	for ( int ti = 1; ti < threads; ti++ )
+		m_Workers.push_back( std::thread( &ThreadPool::worker_loop, this, ti ) );
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		m_Quit = true;
+	}
+	m_Wake.notify_all();
+	for ( int ti = 0; ti < m_Workers.size(); ti++ )
+		m_Workers[ti].join();
+}
+
+void ThreadPool::run_tasks( int worker )
+{
+	inside_pool_task = true;
+	for ( int index = m_Next++; index < m_Count; index = m_Next++ )
+		( *m_Task )( index, worker );
+	inside_pool_task = false;
+}
+
+void ThreadPool::worker_loop( int worker )
+{
+	TRACE_THREAD_NAME( "pool worker " + std::to_string( worker ) );
+	unsigned int seen = 0;
+	for ( ;; )
+	{
+		{
+			std::unique_lock<std::mutex> lock( m_Mutex );
+			m_Wake.wait( lock, [&]{ return m_Quit || m_Generation != seen; } );
+			if ( m_Quit )
+				return;
+			seen = m_Generation;
+		}
+
+		run_tasks( worker );
+
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		if ( --m_Busy == 0 )
+			m_Done.notify_one();
+	}
+}
+
+void ThreadPool::parallel_for( int count, const std::function<void(int)> &task )
+{
+	parallel_for( count, std::function<void(int, int)>( [&]( int index, int ) { task( index ); } ) );
+}
+
+void ThreadPool::parallel_for( int count, const std::function<void(int, int)> &task )
+{
+	if ( m_Workers.empty() || count <= 1 || inside_pool_task ) {
+		for ( int index = 0; index < count; index++ )
+			task( index, 0 );
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		m_Task = &task;
+		m_Count = count;
+		m_Next = 0;
+		m_Busy = m_Workers.size();
+		m_Generation++;
+	}
+	m_Wake.notify_all();
+
+	run_tasks( 0 );
+
+	std::unique_lock<std::mutex> lock( m_Mutex );
+	m_Done.wait( lock, [&]{ return m_Busy == 0; } );
+	m_Task = NULL;
+}
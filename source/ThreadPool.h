@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
+// Fixed set of worker threads running parallel loops.
+// parallel_for hands out indices one at a time, so uneven tasks balance themselves;
+// the calling thread works along and the call returns once every index is done.
+// A parallel_for issued from inside a task runs inline on the calling thread.
+class ThreadPool {
+	public:
+		explicit ThreadPool( int threads );	// threads <= 0 uses every hardware thread
+		~ThreadPool();
+
+		int size() const { return m_Workers.size() + 1; }	// workers plus the calling thread
+
+		void parallel_for( int count, const std::function<void(int)> &task );
+
+		// same, the task also gets the id ( 0 .. size() - 1 ) of the thread running it,
+		// e.g. to pick a per-thread scratch buffer
+		void parallel_for( int count, const std::function<void(int index, int worker)> &task );
+
+	private:
+		ThreadPool( const ThreadPool & );
+		void operator = ( const ThreadPool & );
+
+		void worker_loop( int worker );
+		void run_tasks( int worker );
+
+		std::vector<std::thread> m_Workers;
+		std::mutex m_Mutex;
+		std::condition_variable m_Wake, m_Done;
+
+		const std::function<void(int, int)> *m_Task;
+		int m_Count;
+		std::atomic<int> m_Next;
+		int m_Busy;				// workers still inside the current loop
+		unsigned int m_Generation;	// bumped for every parallel_for so workers join each loop once
+		bool m_Quit;
+};
@@ -1,8 +1,14 @@
 // TinkerToy.cpp : Defines the entry point for the console application.
 
 // Physics
-#include "Particle.h"
-#include "SpringForce.h"
+#include "ClothWorld.h"
+#include "Scene.h"
+#include "ClothMesh.h"
+#include "SimulationThread.h"
+#include "FrameScheduler.h"
+#include "TrajectoryFile.h"
+#include "Profiler.h"
+#include "Trace.h"
 
 // Extensible parts for constrained dynamics, unnecessary for cloth simulation
 #include "RodConstraint.h"
@@ -11,7 +17,8 @@
 // Screenshot
 #include "imageio.h"
 // Render
-#include "shader.h"
+#include "ClothRenderer.h"
+#include "FrameCapture.h"
 
 // Graphics libraries
 #include <GL/glew.h>
@@ -22,6 +29,7 @@
 #include <cstring>
 #include <math.h>
 #include <vector>
+#include <algorithm>
 #include <iostream>
 #include <stdlib.h>
 #include <stdio.h>
@@ -36,19 +44,45 @@ using namespace glm;
  */
 const std::string MODE = "RK4";
 
-/* external definitions (from solver.cpp) */
-extern void simulation_step( std::vector<Particle*> pVector, std::vector<NonconstraintForce*> pNonconstraintForceVector, float dt, std::string mode );
-
 /* global variables */
 
-static int N;
+static int N;			// side of the grid scene built when no scene file is given
+static std::vector<int> mesh_triangles;	// particles drawn as the cloth, 3 per triangle, the first cloth of the scene
+static std::string mode = MODE;
 static float dt, d;		// dt is time step in solver, ?d is the step size in dumping? 
 static int dsim;		// if dsim == 0, simulation is in or will be set to initial state, else it is running.		
 static int dump_frames;		// if is true, then frame dumping function is active
-static int frame_number;	// the sequence number of current frame	
+static int show_profile;	// if is true, phase timings are drawn over the cloth
+static int frame_number;	// frames dumped so far, numbers the PNGs
+static long render_step;		// simulation step, or frame of the recording, being drawn
+static long dumped_step;		// render_step of the last dumped frame, -1 before the first
+static const char *obstacle_file;	// optional OBJ mesh of a static obstacle
+static const char *checkpoint_file;	// start from a saved state instead of the flat cloth
+static const char *scene_file;		// see Scene.h, otherwise an N x N grid
+static const char *video_file;		// dumped frames go into this one stream instead of PNGs, "-" is stdout
+static CaptureFormat video_format;
+
+const int SDF_RESOLUTION = 64;		// distance field cells along the longest side of the obstacle
+
+const double SIMULATION_RATE = 60.0;	// simulation steps per second of wall clock time, what one step per vsynced frame used to give
+const int MAX_STEPS_PER_FRAME = 8;	// catch-up limit after a slow frame
+const int FRAME_INTERVAL = 1;		// a frame is dumped every this many simulation steps
 
 // static Particle *pList;
-static std::vector<Particle*> pVector;	// keyword static means this variable can't be accessed from any other translation unit
+static ClothWorld *pWorld;	// the cloth being simulated and displayed, owns all particles and forces
+
+static SimulationThread *sim_thread;	// steps pWorld in the background, the only thing touching it once started
+static std::vector<Vec3f> render_positions;		// positions drawn this frame, blended between the last two published states
+static const Vec3f *render_source;		// what the mesh is built from, render_positions or a frame of the trajectory
+
+// playback of a recorded trajectory instead of simulating ( "project1 run.traj" )
+static ClothRenderer *renderer;	// shader program and buffers of the cloth, created with the window
+static ThreadPool *render_pool;		// computes the normals of large cloths, NULL on one or two cores
+static FrameCapture *capture;		// reads back dumped frames and writes them on encoder threads
+
+static TrajectoryFile *playback;
+static FrameScheduler *playback_clock;	// plays one recorded frame per simulation step period
+static long playback_frame;
 
 static int win_id;		// window id returned by glutCreateWindow()
 static int win_x, win_y;	// size of window
@@ -58,21 +92,9 @@ static int mouse_shiftclick[3];
 static int omx, omy, mx, my;
 static int hmx, hmy;
 
-static std::vector<NonconstraintForce*> pNonconstraintForceVector;
 static RodConstraint * delete_this_dummy_rod = NULL;
 static CircularWireConstraint * delete_this_dummy_wire = NULL;
 
-Vec3f rotate( Vec3f vector)		// identical to multiply by a rotation matrix
-{
-  // return Vec3f( sqrt(2.0)/2 * ( vector[0] - vector[1] ), -1, sqrt(2.0)/2 * ( vector[0] + vector[1] ));
-  return Vec3f( -vector[1], -vector[2], vector[0] );
-}
-
-Vec3f rotate2( Vec3f vector)		// identical to multiply by a rotation matrix
-{
-  return Vec3f( vector[2], vector[1], vector[0] );
-}
-
 /*
 ----------------------------------------------------------------------
 free/clear/allocate simulation data
@@ -81,14 +103,24 @@ free/clear/allocate simulation data
 
 static void free_data ( void )
 {
-	pVector.clear();
+	if (playback) {
+		delete playback;
+		delete playback_clock;
+		playback = NULL;
+		playback_clock = NULL;
+	}
+	if (sim_thread) {
+		delete sim_thread;
+		sim_thread = NULL;
+	}
+	if (pWorld) {
+		delete pWorld;
+		pWorld = NULL;
+	}
 	if (delete_this_dummy_rod) {
 		delete delete_this_dummy_rod;
 		delete_this_dummy_rod = NULL;
 	}
-	if ( pNonconstraintForceVector.size() > 0 ) {
-		pNonconstraintForceVector.clear();
-	}
 	if (delete_this_dummy_wire) {
 		delete delete_this_dummy_wire;
 		delete_this_dummy_wire = NULL;
@@ -97,76 +129,101 @@ static void free_data ( void )
 
 static void clear_data ( void )
 {
-	int ii, size = pVector.size();
+	if ( playback )
+		playback_frame = 0;
+	else {
+		// a paused simulation posts no redisplays, so the one after this must see the reset state
+		sim_thread->request_reset();
+		sim_thread->wait_for_reset();
+	}
+}
+
+// two triangles per grid cell, wound so that the front of the cloth faces +z
+static void set_grid_mesh ( int R, int C )
+{
+	mesh_triangles.clear();
+	for ( int i = 0; i < (R-1); i++ )
+		for ( int j = 0; j < (C-1); j++ ) {
+			const int lower_left[] = { i * C + j, i * C + j + 1, (i+1) * C + j };
+			const int upper_right[] = { (i+1) * C + j, i * C + j + 1, (i+1) * C + (j+1) };
+			mesh_triangles.insert( mesh_triangles.end(), lower_left, lower_left + 3 );
+			mesh_triangles.insert( mesh_triangles.end(), upper_right, upper_right + 3 );
+		}
+	N = R;
+}
+
+// recordings and checkpoints carry no mesh, their particles are drawn as a square grid
+static bool set_square_mesh ( int particles )
+{
+	int side = (int)( sqrt( (double)particles ) + 0.5 );
+	if ( side < 2 || side * side != particles )
+		return false;
+	set_grid_mesh( side, side );
+	return true;
+}
 
-	for(ii=0; ii<size; ii++){
-		pVector[ii]->reset();
+// a mesh cloth is drawn with the faces of its file, quads split in two
+static bool set_cloth_mesh ( const SceneCloth &cloth )
+{
+	if ( cloth.mesh_file.empty() ) {
+		set_grid_mesh( cloth.rows, cloth.columns );
+		return true;
 	}
+	ClothMesh mesh;
+	if ( !load_cloth_mesh( cloth.mesh_file.c_str(), &mesh ) )
+		return false;
+	mesh_triangles = mesh.triangles;
+	for ( int qi = 0; qi < mesh.quads.size(); qi += 4 ) {
+		const int *q = &mesh.quads[qi];
+		const int halves[] = { q[0], q[1], q[2], q[0], q[2], q[3] };
+		mesh_triangles.insert( mesh_triangles.end(), halves, halves + 6 );
+	}
+	return true;
+}
+
+static bool open_playback ( const char *fileName )
+{
+	playback = new TrajectoryFile();
+	if ( !playback->open( fileName ) )
+		return false;
+	if ( !set_square_mesh( playback->particles() ) || playback->frames() == 0 ) {
+		fprintf( stderr, "%s: the viewer plays square grids with at least one frame\n", fileName );
+		return false;
+	}
+	playback_clock = new FrameScheduler( SIMULATION_RATE, MAX_STEPS_PER_FRAME );
+	playback_frame = 0;
+	printf( "Playing %s: %ld frames, %s, dt=%g\n", fileName, playback->frames(), playback->integrator().c_str(), playback->dt() );
+	return true;
 }
 
 static void init_system(void)
 {
-	/* Simple description of spring-particle model of cloth:
-	   N X N particle grid, 
-	   three type of springs
-	   		stretch spring: grid side, connecting two nearest particles
-	   		shear spring: diagonal of a grid block
-			bend spring: contains two grid side, connecting every other two particles
-	*/
+	if ( playback )
+		return;		// nothing to simulate
+
+	pWorld = new ClothWorld();
+	if ( checkpoint_file ) {
+		if ( !pWorld->load_checkpoint( checkpoint_file ) || !set_square_mesh( pWorld->particle_count() ) ) {
+			fprintf( stderr, "%s: the viewer simulates square grids\n", checkpoint_file );
+			exit( 1 );
+		}
+	} else {
+		SceneDescription scene = scene_file ? SceneDescription() : grid_scene( N );
+		if ( scene_file && !load_scene( scene_file, &scene ) )
+			exit( 1 );
+		if ( scene.cloths.empty() || !build_scene( pWorld, scene ) || !add_scene_colliders( pWorld, scene ) || !set_cloth_mesh( scene.cloths[0] ) )
+			exit( 1 );
+		if ( scene_file ) {
+			dt = scene.dt;
+			mode = scene.integrator;
+		}
+	}
 
-	// define particle grid
-	const double grid_length = 0.05;
-	const double diagonal_length = sqrt(2.0) * grid_length;
-	const int N = 20;			
-	
-	// offset from the center of the screen 
-	const Vec3f x_positive_offset(grid_length, 0.0, 0.0 ),
-				y_positive_offset(0.0, grid_length, 0.0);
-			
-	// Create particles as an N x N grid 
-	for(int i=0; i<N; i++)
-		for(int j=0; j<N; j++)
-			pVector.push_back(new Particle( rotate( i * y_positive_offset + j * x_positive_offset ) + Vec3f(0.5, 0.5, 0.0)  ) );
-			
-	// 1. Create universal gravity force
-	// this force is just a dummy one
-	pNonconstraintForceVector.push_back(new GravityForce( Vec3f(0, 0, 0) ));
-	
-	const float ks_stretch = 30, ks_shear = 30, ks_bend = 50,
-				kd_stretch = 15, kd_shear = 15, kd_bend = 15;
-	
-	// original value, 60 and 20
-	// 2. Stretch springs 
-	// (N-1) x N horizontal spring constraint
-	for(int i=0; i<N; i++)
-		for(int j=0; j<(N-1); j++)
-			pNonconstraintForceVector.push_back(new SpringForce(pVector[i*N+j], pVector[i*N+j+1], grid_length, ks_stretch, kd_stretch));
-			
-	// N x (N-1) vertical spring constraint
-	for(int j=0; j<N; j++)
-		for(int i=0; i<(N-1); i++)
-			pNonconstraintForceVector.push_back(new SpringForce(pVector[i*N+j], pVector[(i+1)*N+j], grid_length, ks_stretch, kd_stretch));
-
-	// 3. Shear springs 		
-	// In total 2 X (N-1) x (N-1) diagonal spring constraint
-	// those connecting bottom-left and upper-right particles
-	for(int i=0; i<(N-1); i++)
-		for(int j=0; j<(N-1); j++)
-			pNonconstraintForceVector.push_back(new SpringForce(pVector[i*N+j], pVector[(i+1)*N+(j+1)], diagonal_length, ks_shear, kd_shear));
-
-	// those connecting bottom-right and upper-left particles
-	for(int i=1; i<N; i++)
-		for(int j=0; j<(N-1); j++)
-			pNonconstraintForceVector.push_back(new SpringForce(pVector[i*N+j], pVector[(i-1)*N+(j+1)], diagonal_length, ks_shear, kd_shear));
-
-	// 4. Bend springs ( also a way to prevent self penetration in nearby region )
-	for(int i=0; i<N; i++)
-		for(int j=0; j<(N-2); j++)
-			pNonconstraintForceVector.push_back(new SpringForce(pVector[i*N+j], pVector[i*N+j+2], 2 * grid_length, ks_bend, kd_bend));
-
-	for(int j=0; j<N; j++)
-		for(int i=0; i<(N-2); i++)
-			pNonconstraintForceVector.push_back(new SpringForce(pVector[i*N+j], pVector[(i+2)*N+j], 2 * grid_length, ks_bend, kd_bend));	
+	if ( obstacle_file )
+		add_obstacle( pWorld, obstacle_file, SDF_RESOLUTION );
+
+	sim_thread = new SimulationThread( pWorld, dt, mode, SIMULATION_RATE, MAX_STEPS_PER_FRAME );
+	sim_thread->start();
 }
 
 /*
@@ -195,34 +252,59 @@ static void pre_display ( void )
 	glClear ( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
 }
 
+// one line per phase, legacy raster text on top of everything
+static void draw_profile_overlay ( void )
+{
+	std::vector<std::string> lines;
+	if ( !Profiler::compiled_in() )
+		lines.push_back( "profiling is compiled out, rebuild with make PROFILE=1" );
+	for ( int pi = 0; pi < PHASE_COUNT; pi++ ) {
+		ProfilePhaseStats stats;
+		Profiler::phase_stats( (ProfilePhase)pi, &stats );
+		if ( stats.calls > 0 )
+			lines.push_back( Profiler::summary( (ProfilePhase)pi ) );
+	}
+
+	glUseProgram( 0 );
+	glDisable( GL_DEPTH_TEST );
+	glColor3f( 1.0f, 1.0f, 1.0f );
+	for ( int li = 0; li < lines.size(); li++ ) {
+		glRasterPos2f( -0.98f, 0.94f - 0.06f * li );
+		for ( int ci = 0; ci < lines[li].size(); ci++ )
+			glutBitmapCharacter( GLUT_BITMAP_8_BY_13, lines[li][ci] );
+	}
+	glEnable( GL_DEPTH_TEST );
+}
+
 static void post_display ( void )
 {
-	// Write frames if necessary.
-	if (dump_frames) {
-		const int FRAME_INTERVAL = 4;
-		if ((frame_number % FRAME_INTERVAL) == 0) {
-			const unsigned int w = glutGet(GLUT_WINDOW_WIDTH);
-			const unsigned int h = glutGet(GLUT_WINDOW_HEIGHT);
-			unsigned char * buffer = (unsigned char *) malloc(w * h * 4 * sizeof(unsigned char));
-			if (!buffer)
-				exit(-1);
-			// glRasterPos2i(0, 0);
-			glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, buffer);
-			char filename[13];
-			sprintf(filename, "img%.5i.png", frame_number / FRAME_INTERVAL);
-			printf("Dumped %s.\n", filename);
-			saveImageRGBA(filename, buffer, w, h);
-		}
+	// Write frames if necessary. They follow the simulation steps, not the redisplays, so a video
+	// has SIMULATION_RATE / FRAME_INTERVAL frames per second of simulation at any display rate
+	if (dump_frames && ( dumped_step < 0 || render_step < dumped_step || render_step >= dumped_step + FRAME_INTERVAL )) {
+		PROFILE_SCOPE( PHASE_FRAME_CAPTURE );
+		// steps a slow display skipped repeat the frame in a video, a reset or a seek back starts over
+		long copies = dumped_step >= 0 && render_step > dumped_step ? ( render_step - dumped_step ) / FRAME_INTERVAL : 1;
+		dumped_step = render_step;
+		// only starts the readback, the PNG is written frames later on an encoder thread
+		char filename[32];
+		sprintf(filename, "img%.5i.png", frame_number);
+		capture->capture(filename, glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT), (int)std::min( copies, (long)MAX_STEPS_PER_FRAME ));
+		frame_number++;
 	}
-	frame_number++;
+	PROFILE_COUNT( COUNTER_FRAMES, 1 );
 	
 	// std::cout << "rendered frame: " << frame_number;
+
+	// drawn after the capture so that dumped frames stay clean
+	if (show_profile)
+		draw_profile_overlay ();
 	
 	glutSwapBuffers ();
 }
 
 static void draw_particles ( void )
 {
+	std::vector<Particle*> &pVector = pWorld->pVector;
 	int size = pVector.size();
 
 	for(int ii=0; ii< size; ii++)
@@ -235,9 +317,9 @@ static void draw_forces ( void )
 {
 	// change this to iteration over full set
 	std::vector<NonconstraintForce*>::iterator it;
-	for( it = pNonconstraintForceVector.begin(); it < pNonconstraintForceVector.end(); it++ )
+	for( it = pWorld->pNonconstraintForceVector.begin(); it < pWorld->pNonconstraintForceVector.end(); it++ )
 		if ( (*it)->is_spring )
-			(*it)->draw();
+			( ( SpringForce* )(*it) )->draw();
 }
 
 static void draw_constraints ( void )
@@ -288,6 +370,7 @@ static void get_from_UI ()
 
 static void remap_GUI()
 {
+	std::vector<Particle*> &pVector = pWorld->pVector;
 	int ii, size = pVector.size();
 	for(ii=0; ii<size; ii++)
 	{
@@ -302,6 +385,8 @@ GLUT callback routines
 ----------------------------------------------------------------------
 */
 
+static void idle_func ( void );
+
 static void key_func ( unsigned char key, int x, int y )
 {
 	switch ( key )
@@ -309,21 +394,90 @@ static void key_func ( unsigned char key, int x, int y )
 	case 'c':
 	case 'C':
 		clear_data ();
+		glutPostRedisplay ();
 		break;
 
 	case 'd':
 	case 'D':
 		dump_frames = !dump_frames;
+		dumped_step = -1;
+		if ( !dump_frames )
+			capture->finish ();		// the last frames are on disk once dumping stops
+		break;
+
+	case 'p':
+	case 'P':
+		show_profile = !show_profile;
+		glutPostRedisplay ();
+		break;
+
+	case 'j':
+	case 'J':
+		if ( Profiler::write_json( "profile.json" ) )
+			printf( "Wrote profile.json.\n" );
+		break;
+
+	case 'b':
+	case 'B':
+		if ( !renderer->set_persistent( !renderer->persistent() ) )
+			printf( "Persistent vertex buffers need GL 4.4 or ARB_buffer_storage.\n" );
+		else
+			printf( "%s vertex buffers.\n", renderer->persistent() ? "Persistent" : "Streamed" );
+		glutPostRedisplay ();
+		break;
+
+	case 't':
+	case 'T':
+		if ( !Trace::enabled() ) {
+			Trace::start();
+			printf( "Tracing, press 't' again to write trace.json.\n" );
+		} else {
+			Trace::stop();
+			if ( Trace::write_json( "trace.json" ) )
+				printf( "Wrote trace.json.\n" );
+		}
 		break;
 
 	case 'q':
 	case 'Q':
 		free_data ();
+		delete capture;		// writes the frames still queued
+		delete renderer;
+		delete render_pool;
 		exit ( 0 );
 		break;
 
 	case ' ':
 		dsim = !dsim;
+		// a paused simulation has nothing to do between frames, so it does not idle at all
+		if ( playback ) {
+			if ( dsim && playback_frame == playback->frames() - 1 )
+				playback_frame = 0;		// play again from the start
+			playback_clock->restart ();
+		} else
+			sim_thread->set_running ( dsim );
+		glutIdleFunc ( dsim ? idle_func : NULL );
+		glutPostRedisplay ();
+		break;
+
+	// scrubbing a recording, any frame costs the same to reach
+	case ',':
+	case '.':
+	case '<':
+	case '>':
+		if ( playback ) {
+			long delta = key == ',' ? -1 : key == '.' ? 1 : key == '<' ? -100 : 100;
+			playback_frame = std::max( 0L, std::min( playback->frames() - 1, playback_frame + delta ) );
+			glutPostRedisplay ();
+		}
+		break;
+
+	default:
+		// '0' to '9' jump to 0% to 90% of a recording
+		if ( playback && key >= '0' && key <= '9' ) {
+			playback_frame = ( key - '0' ) * ( playback->frames() - 1 ) / 10;
+			glutPostRedisplay ();
+		}
 		break;
 	}
 }
@@ -354,55 +508,78 @@ static void reshape_func ( int width, int height )
 	win_y = height;
 }
 
+// the simulation runs on its own thread, the GLUT thread only keeps drawing
 static void idle_func ( void )
 {
-	if ( dsim ) simulation_step( pVector, pNonconstraintForceVector, dt, MODE );
-	else        {simulation_step( pVector, pNonconstraintForceVector, 0.0f, MODE );
-				 /* get_from_UI();remap_GUI(); what is the purpose of this line ? */ }
-
 	glutSetWindow ( win_id );
 	glutPostRedisplay ();
 }
 
-// define the front and back color of the cloth
-	const Vec3f FRONT_COLOR(1.0f, 0.647f, 0.0f);	// orange
-	const Vec3f BACK_COLOR(0.0f, 1.0f, 0.498f); 	// spring green
+// points render_source at the current recorded frame; float recordings are used in place
+static void update_playback_positions ( GLfloat *mapped, int mapped_count )
+{
+	if ( dsim ) {
+		playback_frame += playback_clock->steps_due();
+		if ( playback_frame >= playback->frames() - 1 ) {
+			playback_frame = playback->frames() - 1;
+			dsim = 0;	// stop at the end
+			glutIdleFunc ( NULL );
+		}
+	}
+	render_step = playback_frame;
 
-// using vector function from <gfx/Vec3.h> 
-Vec3f compute_lambertian_color( Vec3f p1_position, Vec3f p2_position, Vec3f p3_position ){
-	Vec3f side1 = p2_position - p1_position;
-	Vec3f side2 = p3_position - p1_position;
-	
-	Vec3f surface_normal;
-	surface_normal = cross(side1, side2) / ( norm( cross(side1, side2) ) );
-	
-	if ( surface_normal[2] >= 0 )
-		return FRONT_COLOR * surface_normal[2];
-	else
-		return BACK_COLOR * abs( surface_normal[2] );
+	if ( playback->scalar_bytes() == sizeof( float ) ) {
+		render_source = ( const Vec3f* )playback->positions<float>( playback_frame );
+		if ( mapped )
+			memcpy( mapped, render_source, mapped_count * 3 * sizeof( GLfloat ) );
+		return;
+	}
+	const double *positions = playback->positions<double>( playback_frame );
+	int ii, size = playback->particles();
+	render_positions.resize( size );
+	for(ii=0; ii<size; ii++)
+		render_positions[ii] = Vec3f( positions[ 3 * ii ], positions[ 3 * ii + 1 ], positions[ 3 * ii + 2 ] );
+	for(ii=0; mapped && ii<mapped_count; ii++)
+		for ( int c = 0; c < 3; c++ )
+			mapped[ 3 * ii + c ] = render_positions[ii][c];
+	render_source = &render_positions[0];
 }
 
+// blend the newest published state for drawing, never waits for the simulation;
+// with persistent buffers the drawn particles also go straight into "mapped" in the same pass
+static void update_render_positions ( GLfloat *mapped, int mapped_count )
+{
+	if ( playback ) {
+		update_playback_positions ( mapped, mapped_count );
+		return;
+	}
+
+	const ClothFrame &frame = sim_thread->latest_frame();
+	float alpha = sim_thread->interpolation( frame );
+	render_step = frame.step;
+	int ii, size = frame.current.size();
+	render_positions.resize( size );
+	for(ii=0; ii<size; ii++) {
+		render_positions[ii] = frame.previous[ii] + alpha * ( frame.current[ii] - frame.previous[ii] );
+		if ( ii < mapped_count && mapped )
+			for ( int c = 0; c < 3; c++ )
+				mapped[ 3 * ii + c ] = render_positions[ii][c];
+	}
+	render_source = &render_positions[0];
+}
+
+// define the front and back color of the cloth, the shaders light it with these
+	const Vec3f FRONT_COLOR(1.0f, 0.647f, 0.0f);	// orange
+	const Vec3f BACK_COLOR(0.0f, 1.0f, 0.498f); 	// spring green
 
 static void display_func ( void )
 {
+	// NULL unless the buffers are persistent, the mapped slot is never read back
+	GLfloat *mapped = renderer->map_positions();
+	update_render_positions ( mapped, renderer->vertex_count() );
 	pre_display ();
 	
 	// ****************************************************************************
-	GLuint VertexArrayID;
-	
-	glGenVertexArrays(1, &VertexArrayID);
-	glBindVertexArray(VertexArrayID);
-
-	// Create and compile our GLSL program from the shaders
-	GLuint programID = LoadShaders( "VertexShader.vertexshader", "FragmentShader.fragmentshader" );
-	glBindAttribLocation(programID, 0, "vertexPosition_modelspace");
-	glBindAttribLocation(programID, 1, "vertexColor");
-	
-	// Get a handle for our "MVP" uniform
-	// Returns the index of the uniform variable name associated with the shader program
-	// MVP stands for matrix-view-projection matrix
-	GLuint MatrixID = glGetUniformLocation(programID, "MVP");
-
 	/*
 	// Projection matrix : 45?Field of View, 4:3 ratio, display range : 0.1 unit <-> 100 units
 	// TODO win_x = win_y = 512
@@ -420,135 +597,19 @@ static void display_func ( void )
 	*/
 	glm::mat4 MVP = glm::ortho(-1.0f,1.0f,-1.0f,1.0f,-1.0f,1.0f);
 
-	const int N = 20;
-		
-	// Our vertices. Three consecutive floats give a 3D vertex; Three consecutive vertices give a triangle.
-	// the cloth has N*N faces with 2 triangles each, so this makes 2*(N-1)*(N-1) triangles, and 2*(N-1)*(N-1)*3 vertices, and each vertex has 3 coordinate
-	GLfloat g_vertex_buffer_data[ 2 * (N-1) * (N-1) * 3 * 3 ];
-	for ( int i = 0; i < (N-1); i++ ){ 
-		for ( int j = 0; j < (N-1); j++ ){
-			// lower-left triangle
-		
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) ] = pVector[ i * N + j ]->m_Position[0];
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 1 ] = pVector[ i * N + j ]->m_Position[1];
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 2 ] = pVector[ i * N + j ]->m_Position[2];
-			
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 3 ] = pVector[ i * N + j + 1 ]->m_Position[0];
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 4 ] = pVector[ i * N + j + 1 ]->m_Position[1];
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 5 ] = pVector[ i * N + j + 1 ]->m_Position[2];
-			
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 6 ] = pVector[ (i+1) * N + j ]->m_Position[0];
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 7 ] = pVector[ (i+1) * N + j ]->m_Position[1];
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 8 ] = pVector[ (i+1) * N + j ]->m_Position[2];
-			
-						
-			// upper-right triangle
-				
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 9 ] = pVector[ i * N + j + 1 ]->m_Position[0];
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 10 ] = pVector[ i * N + j + 1 ]->m_Position[1];
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 11 ] = pVector[ i * N + j + 1 ]->m_Position[2];
-			
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 12 ] = pVector[ (i+1) * N + j ]->m_Position[0];
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 13 ] = pVector[ (i+1) * N + j ]->m_Position[1];
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 14 ] = pVector[ (i+1) * N + j ]->m_Position[2];
-			
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 15 ] = pVector[ (i+1) * N + (j+1) ]->m_Position[0];
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 16 ] = pVector[ (i+1) * N + (j+1) ]->m_Position[1];
-			g_vertex_buffer_data[ 18 * ( i * (N-1) + j ) + 17 ] = pVector[ (i+1) * N + (j+1) ]->m_Position[2];
-		}
-	}
-	
+	PROFILE_START( mesh_timer );
+	// smooth normals, the shaders light the cloth with them
+	renderer->compute_normals( (const GLfloat *)render_source );	// Vec3f is 3 packed floats
+	PROFILE_STOP( mesh_timer, PHASE_MESH_BUILD );
 
-	// One color for each vertex. They were generated by applying lambertian shading
-	GLfloat g_color_buffer_data[ 2 * (N-1) * (N-1) * 3 * 3 + 9 ];
-	for ( int i = 0; i < (N-1); i++ ){ 
-		for ( int j = 0; j < (N-1); j++ ){
-			// lower-left triangle
-			Vec3f color1 = compute_lambertian_color( pVector[ i * N + j ]->m_Position, pVector[ i * N + j + 1 ]->m_Position, pVector[ (i+1) * N + j ]->m_Position );
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) ] = color1[0];
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 1 ] = color1[1];
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 2 ] = color1[2];
-			
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 3 ] = color1[0];
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 4 ] = color1[1];
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 5 ] = color1[2];
-			
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 6 ] = color1[0];
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 7 ] = color1[1];
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 8 ] = color1[2];
-						
-			// upper-right triangle
-			Vec3f color2 = compute_lambertian_color( pVector[ (i+1) * N + j ]->m_Position, pVector[ i * N + j + 1 ]->m_Position, pVector[ (i+1) * N + (j+1) ]->m_Position );
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 9 ] = color2[0];
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 10 ] = color2[1];
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 11 ] = color2[2];
-			
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 12 ] = color2[0];
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 13 ] = color2[1];
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 14 ] = color2[2];
-			
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 15 ] = color2[0];
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 16 ] = color2[1];
-			g_color_buffer_data[ 18 * ( i * (N-1) + j ) + 17 ] = color2[2];
-		}
+	if ( !mapped ) {
+		PROFILE_START( upload_timer );
+		renderer->upload( (const GLfloat *)render_source );
+		PROFILE_STOP( upload_timer, PHASE_GL_UPLOAD );
 	}
 
-	GLuint vertexbuffer;
-	glGenBuffers(1, &vertexbuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(g_vertex_buffer_data), g_vertex_buffer_data, GL_DYNAMIC_DRAW);
-
-	GLuint colorbuffer;
-	glGenBuffers(1, &colorbuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, colorbuffer);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(g_color_buffer_data), g_color_buffer_data, GL_DYNAMIC_DRAW);
-
-		// Use our shader
-		glUseProgram(programID);
-
-		// Send our transformation to the currently bound shader, 
-		// in the "MVP" uniform
-		glUniformMatrix4fv(MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-		// 1rst attribute buffer : vertices
-		glEnableVertexAttribArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
-		glVertexAttribPointer(
-			0,                  // attribute. No particular reason for 0, but must match the layout in the shader.
-			3,                  // size
-			GL_FLOAT,           // type
-			GL_FALSE,           // normalized?
-			0,                  // stride
-			(void*)0            // array buffer offset
-		);
-
-		// 2nd attribute buffer : colors
-		glEnableVertexAttribArray(1);
-		glBindBuffer(GL_ARRAY_BUFFER, colorbuffer);
-		glVertexAttribPointer(
-			1,                                // attribute. No particular reason for 1, but must match the layout in the shader.
-			3,                                // size
-			GL_FLOAT,                         // type
-			GL_FALSE,                         // normalized?
-			0,                                // stride
-			(void*)0                          // array buffer offset
-		);
-
-		
-		// Draw the triangle !
-		glDrawArrays(GL_TRIANGLES, 0, 2*(N-1)*(N-1)*3 ); // indices starting at 0 -> 2(N-1)*(N-1) triangles
-		
-		// glDrawArrays(GL_TRIANGLES, 0, 12*3); // 12*3 indices starting at 0 -> 12 triangles
-
-		glDisableVertexAttribArray(0);
-		glDisableVertexAttribArray(1);
-
-
-	// Cleanup VBO and shader
-	glDeleteBuffers(1, &vertexbuffer);
-	glDeleteBuffers(1, &colorbuffer);
-	glDeleteProgram(programID);
-	glDeleteVertexArrays(1, &VertexArrayID);
+	// Draw the triangles, indexed into the particles
+	renderer->draw( &MVP[0][0] );
 
 	
 	/*********************************************************/
@@ -600,6 +661,28 @@ static void open_glut_window ( void )
 
 	glEnable(GL_LINE_SMOOTH);
 	glEnable(GL_POLYGON_SMOOTH);
+
+	renderer = new ClothRenderer();
+	if ( !renderer->create( "VertexShader.vertexshader", "FragmentShader.fragmentshader" ) )
+		exit( 1 );
+	renderer->set_triangles( mesh_triangles );
+	renderer->set_colors( FRONT_COLOR, BACK_COLOR );
+	renderer->set_persistent( true );	// streams the vertices where the GL cannot map them persistently
+	// the simulation thread keeps one core busy, the normals of large cloths use the others
+	int cores = std::thread::hardware_concurrency();
+	if ( cores > 2 ) {
+		render_pool = new ThreadPool( cores - 1 );
+		renderer->set_parallel( render_pool );
+	}
+	// fast PNGs without alpha, the encoders and their strips use about half the cores
+	int encoders = std::max( 1, cores / 4 );
+	PngOptions png;
+	png.level = 1;
+	png.filters = PNG_FILTER_UP;
+	png.rgb = true;
+	png.threads = std::max( 1, cores / 2 / encoders );
+	capture->create( encoders );
+	capture->set_png_options( png );
 	
 	clear_data ();
 
@@ -609,7 +692,7 @@ static void open_glut_window ( void )
 	glutMouseFunc ( mouse_func );
 	glutMotionFunc ( motion_func );
 	glutReshapeFunc ( reshape_func );
-	glutIdleFunc ( idle_func );
+	glutIdleFunc ( dsim ? idle_func : NULL );	// started by the spacebar
 	glutDisplayFunc ( display_func );
 }
 
@@ -623,28 +706,69 @@ main --- main routine
 int main ( int argc, char ** argv )
 {
 	glutInit ( &argc, argv );
+	TRACE_THREAD_NAME( "viewer" );
+
+	// --video FILE and --video-rgba FILE can come first, the rest is read by position
+	while ( argc > 2 && ( !strcmp( argv[1], "--video" ) || !strcmp( argv[1], "--video-rgba" ) ) ) {
+		video_format = !strcmp( argv[1], "--video" ) ? CAPTURE_Y4M : CAPTURE_RGBA;
+		video_file = argv[2];
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+
+	// before anything is printed, stdout may be the video
+	capture = new FrameCapture();
+	// one frame per FRAME_INTERVAL steps, see post_display()
+	if ( video_file && !capture->open_stream( video_file, video_format, (int)( SIMULATION_RATE / FRAME_INTERVAL ) ) )
+		exit( 1 );
 
 	if ( argc == 1 ) {
-		N = 64;
+		N = 20;
 		/*dt = 0.15f;*/
 		dt = 0.015f;
 		d = 5.f;
 		fprintf ( stderr, "Using defaults : N=%d dt=%g d=%g\n",
 			N, dt, d );
+	} else if ( argc == 2 && strstr( argv[1], ".traj" ) ) {
+		dt = 0.015f;
+		d = 5.f;
+		if ( !open_playback( argv[1] ) )
+			exit( 1 );
+	} else if ( argc == 2 && strstr( argv[1], ".ckpt" ) ) {
+		dt = 0.015f;
+		d = 5.f;
+		checkpoint_file = argv[1];
+	} else if ( argc == 2 && strstr( argv[1], ".cloth" ) ) {
+		dt = 0.015f;	// replaced by the scene's
+		d = 5.f;
+		scene_file = argv[1];
 	} else {
 		N = atoi(argv[1]);
 		dt = atof(argv[2]);
 		d = atof(argv[3]);
+		if ( argc > 4 )
+			obstacle_file = argv[4];
 	}
 
 	printf ( "\n\nHow to use this application:\n\n" );
 	printf ( "\t Toggle construction/simulation display with the spacebar key\n" );
-	printf ( "\t Dump frames by pressing the 'd' key\n" );
+	printf ( "\t Dump frames by pressing the 'd' key, into one video with project1 --video out.y4m ...\n" );
+	printf ( "\t ( --video - pipes it to stdout, --video-rgba writes raw RGBA frames )\n" );
+	printf ( "\t Toggle the timing overlay with 'p', write profile.json with 'j'\n" );
+	printf ( "\t Start and stop a timeline trace with 't', it is written to trace.json\n" );
+	printf ( "\t Switch between persistently mapped and streamed vertex buffers with 'b'\n" );
+	printf ( "\t Playing a recording ( project1 run.traj ): spacebar plays and pauses, ',' and '.' step\n" );
+	printf ( "\t a frame, '<' and '>' 100 frames, '0' to '9' jump to 0%% to 90%%, 'c' rewinds\n" );
+	printf ( "\t Start from a checkpoint with project1 state.ckpt ( clothsim --checkpoint state.ckpt )\n" );
+	printf ( "\t Simulate a scene file with project1 scenes/hanging.cloth, the first cloth is drawn\n" );
 	printf ( "\t Quit by pressing the 'q' key\n" );
 
 	dsim = 0;
 	dump_frames = 0;
+	show_profile = 0;
 	frame_number = 0;
+	dumped_step = -1;
 	
 	init_system();
 	
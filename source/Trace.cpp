@@ -0,0 +1,152 @@
+#include "Trace.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+
+// one span; "sequence" is odd while the owner thread rewrites the slot and 2 * ( n + 1 )
+// once span number n is complete, so a reader can tell a torn slot from a finished one
+struct TraceEvent {
+	std::atomic<unsigned long long> sequence;
+	std::atomic<const char*> name;
+	std::atomic<long long> begin_ns, duration_ns;
+};
+
+struct TraceRing {
+	int thread_id;
+	std::string thread_name;			// guarded by ring_mutex
+	unsigned long long next;			// only touched by the owner thread
+	TraceEvent events[TRACE_RING_EVENTS];
+};
+
+// rings are registered once per thread and never freed, so spans of finished threads stay
+// exportable; the mutex guards only the list and the names, never the recording
+static std::mutex ring_mutex;
+static std::vector<TraceRing*> rings;
+static thread_local TraceRing *local_ring = NULL;
+static thread_local std::string *local_thread_name = NULL;
+
+static std::atomic<bool> tracing( false );
+static std::atomic<long long> start_ns( 0 );
+
+static long long to_ns( Trace::TimePoint time )
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>( time.time_since_epoch() ).count();
+}
+
+static TraceRing *register_thread()
+{
+	TraceRing *ring = new TraceRing();
+	ring->next = 0;
+	for ( int ei = 0; ei < TRACE_RING_EVENTS; ei++ )
+		ring->events[ei].sequence.store( 0, std::memory_order_relaxed );
+
+	std::lock_guard<std::mutex> lock( ring_mutex );
+	ring->thread_id = rings.size() + 1;
+	if ( local_thread_name )
+		ring->thread_name = *local_thread_name;
+	else {
+		char name[32];
+		snprintf( name, sizeof( name ), "thread %d", ring->thread_id );
+		ring->thread_name = name;
+	}
+	rings.push_back( ring );
+	return ring;
+}
+
+void Trace::start()
+{
+	start_ns = to_ns( std::chrono::steady_clock::now() );
+	tracing = true;
+}
+
+void Trace::stop()
+{
+	tracing = false;
+}
+
+bool Trace::enabled()
+{
+	return tracing.load( std::memory_order_relaxed );
+}
+
+void Trace::span( const char *name, TimePoint begin, TimePoint end )
+{
+	if ( !local_ring )
+		local_ring = register_thread();
+	TraceRing *ring = local_ring;
+	unsigned long long n = ring->next++;
+	TraceEvent &event = ring->events[ n % TRACE_RING_EVENTS ];
+
+	event.sequence.store( 2 * n + 1, std::memory_order_relaxed );
+	std::atomic_thread_fence( std::memory_order_release );
+	event.name.store( name, std::memory_order_relaxed );
+	event.begin_ns.store( to_ns( begin ), std::memory_order_relaxed );
+	event.duration_ns.store( to_ns( end ) - to_ns( begin ), std::memory_order_relaxed );
+	event.sequence.store( 2 * n + 2, std::memory_order_release );
+}
+
+void Trace::set_thread_name( const std::string &name )
+{
+	if ( !local_thread_name )
+		local_thread_name = new std::string();
+	*local_thread_name = name;
+	if ( local_ring ) {
+		std::lock_guard<std::mutex> lock( ring_mutex );
+		local_ring->thread_name = name;
+	}
+}
+
+struct ExportedSpan {
+	const char *name;
+	long long begin_ns, duration_ns;
+	bool operator < ( const ExportedSpan &other ) const { return begin_ns < other.begin_ns; }
+};
+
+bool Trace::write_json( const char *fileName )
+{
+	FILE *fp = fopen( fileName, "w" );
+	if ( !fp ) {
+		fprintf( stderr, "Cannot write trace %s\n", fileName );
+		return false;
+	}
+
+	long long origin = start_ns.load();
+	std::lock_guard<std::mutex> lock( ring_mutex );
+	fprintf( fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+	fprintf( fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"cloth\"}}" );
+	for ( int ri = 0; ri < rings.size(); ri++ )
+	{
+		TraceRing *ring = rings[ri];
+		fprintf( fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			ring->thread_id, ring->thread_name.c_str() );
+
+		std::vector<ExportedSpan> spans;
+		spans.reserve( TRACE_RING_EVENTS );
+		for ( int ei = 0; ei < TRACE_RING_EVENTS; ei++ )
+		{
+			TraceEvent &event = ring->events[ei];
+			unsigned long long sequence = event.sequence.load( std::memory_order_acquire );
+			ExportedSpan span;
+			span.name = event.name.load( std::memory_order_relaxed );
+			span.begin_ns = event.begin_ns.load( std::memory_order_relaxed );
+			span.duration_ns = event.duration_ns.load( std::memory_order_relaxed );
+			std::atomic_thread_fence( std::memory_order_acquire );
+			if ( sequence == 0 || ( sequence & 1 ) || event.sequence.load( std::memory_order_relaxed ) != sequence )
+				continue;	// never written or being rewritten right now
+			if ( span.begin_ns >= origin )
+				spans.push_back( span );
+		}
+		std::sort( spans.begin(), spans.end() );
+
+		// trace-event timestamps are microseconds, relative to start() here
+		for ( int si = 0; si < spans.size(); si++ )
+			fprintf( fp, ",\n{\"name\":\"%s\",\"cat\":\"cloth\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				spans[si].name, ring->thread_id, ( spans[si].begin_ns - origin ) * 1e-3, spans[si].duration_ns * 1e-3 );
+	}
+	fprintf( fp, "\n]}\n" );
+	fclose( fp );
+	return true;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+
+// Per-thread timeline of timed spans, exported as Chrome trace-event JSON that loads in
+// Perfetto ( ui.perfetto.dev ) or chrome://tracing.
+// Every thread that records gets its own ring of TRACE_RING_EVENTS spans the first time it
+// records; only the newest spans of each thread survive. A thread writes only its own ring,
+// so recording takes no lock; the exporter reads the rings with a per-slot sequence number
+// and skips the few spans that are being overwritten while it reads.
+// Compiled in with the profiler ( make PROFILE=1 ), recording starts with Trace::start().
+// Every PROFILE_SCOPE is also a span, TRACE_SCOPE adds spans that have no profiler phase.
+
+const int TRACE_RING_EVENTS = 16384;	// per thread
+
+class Trace {
+	public:
+		typedef std::chrono::steady_clock::time_point TimePoint;
+
+		// spans that begin before start() are not exported
+		static void start();
+		static void stop();
+		static bool enabled();
+
+		// "name" must outlive the trace, string literals and the profiler's phase names do
+		static void span( const char *name, TimePoint begin, TimePoint end );
+
+		// shown as the track name, may be called before the thread records anything
+		static void set_thread_name( const std::string &name );
+
+		// every span since start(), returns false if the file cannot be written
+		static bool write_json( const char *fileName );
+};
+
+#ifdef CLOTH_PROFILE
+
+class TraceScope {
+	public:
+		explicit TraceScope( const char *name ) : m_Name( name ), m_Begin( std::chrono::steady_clock::now() ) {}
+		~TraceScope() { if ( Trace::enabled() ) Trace::span( m_Name, m_Begin, std::chrono::steady_clock::now() ); }
+
+	private:
+		const char *m_Name;
+		Trace::TimePoint m_Begin;
+};
+
+#define TRACE_CONCAT2( a, b ) a##b
+#define TRACE_CONCAT( a, b ) TRACE_CONCAT2( a, b )
+#define TRACE_SCOPE( name ) TraceScope TRACE_CONCAT( trace_scope_, __LINE__ )( name )
+// for spans that do not match a block
+#define TRACE_START( timer ) Trace::TimePoint timer = std::chrono::steady_clock::now()
+#define TRACE_STOP( timer, name ) do { if ( Trace::enabled() ) Trace::span( name, timer, std::chrono::steady_clock::now() ); } while ( 0 )
+#define TRACE_THREAD_NAME( name ) Trace::set_thread_name( name )
+
+#else
+
+#define TRACE_SCOPE( name ) ((void)0)
+#define TRACE_START( timer ) ((void)0)
+#define TRACE_STOP( timer, name ) ((void)0)
+#define TRACE_THREAD_NAME( name ) ((void)0)
+
+#endif
@@ -0,0 +1,278 @@
+#include "TrajectoryCodec.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+TrajectoryCodecOptions::TrajectoryCodecOptions() :
+	position_error( 1e-5 ), velocity_error( 1e-4 ), keyframe_interval( 64 ), extrapolate( true ), level( 1 ), threads( 0 ) {
+}
+
+TrajectoryCodec::TrajectoryCodec( int particles, double position_step, double velocity_step, bool extrapolate, int level, int threads ) :
+	m_Particles( particles ), m_Extrapolate( extrapolate ), m_Level( level ), m_SinceKeyframe( 0 ),
+	m_Previous( 6 * particles, 0 ), m_BeforePrevious( 6 * particles, 0 ), m_Pool( threads )
+{
+	m_Step[0] = position_step;
+	m_Step[1] = velocity_step;
+	m_ChunkData.resize( chunk_count() );
+}
+
+// value "index" ( 6 per particle ) predicted from the frames before
+inline int64_t TrajectoryCodec::prediction( int index ) const
+{
+	if ( m_SinceKeyframe == 0 )
+		return 0;
+	if ( m_SinceKeyframe == 1 || !m_Extrapolate )
+		return m_Previous[index];
+	return 2 * (int64_t)m_Previous[index] - m_BeforePrevious[index];
+}
+
+template <class Real>
+bool TrajectoryCodec::encode( bool keyframe, const Real *positions, const Real *velocities, std::vector<char> *out )
+{
+	if ( keyframe )
+		m_SinceKeyframe = 0;
+
+	std::vector<char> chunkOk( chunk_count(), 1 );
+	m_Pool.parallel_for( chunk_count(), [&]( int chunk ) {
+		int begin = chunk * CODEC_CHUNK_PARTICLES, end = std::min( m_Particles, begin + CODEC_CHUNK_PARTICLES );
+		int count = 6 * ( end - begin );
+		std::vector<unsigned char> planes( 4 * count );
+		for ( int ii = begin; ii < end; ii++ )
+			for ( int k = 0; k < 6; k++ )
+			{
+				int index = 6 * ii + k;
+				double value = k < 3 ? positions[ 3 * ii + k ] : velocities[ 3 * ii + k - 3 ];
+				double scaled = std::floor( value / m_Step[ k / 3 ] + 0.5 );
+				if ( !( std::fabs( scaled ) <= CODEC_MAX_QUANTUM ) )
+					chunkOk[chunk] = 0;		// also NaN, the clamped value keeps the prediction state in range
+				int32_t quantum = (int32_t)std::max( (double)-CODEC_MAX_QUANTUM, std::min( (double)CODEC_MAX_QUANTUM, scaled ) );
+				int32_t residual = (int32_t)( quantum - prediction( index ) );
+				uint32_t zigzag = ( (uint32_t)residual << 1 ) ^ (uint32_t)( residual >> 31 );
+				int at = index - 6 * begin;
+				for ( int b = 0; b < 4; b++ )
+					planes[ b * count + at ] = ( zigzag >> ( 8 * b ) ) & 0xff;
+				m_BeforePrevious[index] = m_Previous[index];
+				m_Previous[index] = quantum;
+			}
+
+		// the residuals are mostly short runs of zeros with few distinct bytes in between, run-length
+		// matching finds those about as well as the full match search and much faster
+		std::vector<char> &data = m_ChunkData[chunk];
+		data.resize( sizeof( uint32_t ) + compressBound( planes.size() ) );
+		z_stream stream;
+		memset( &stream, 0, sizeof( stream ) );
+		deflateInit2( &stream, m_Level, Z_DEFLATED, 15, 8, Z_RLE );
+		stream.next_in = &planes[0];
+		stream.avail_in = planes.size();
+		stream.next_out = ( Bytef* )&data[ sizeof( uint32_t ) ];
+		stream.avail_out = data.size() - sizeof( uint32_t );
+		deflate( &stream, Z_FINISH );
+		uint32_t size = stream.total_out;
+		deflateEnd( &stream );
+		memcpy( &data[0], &size, sizeof( size ) );
+		data.resize( sizeof( uint32_t ) + size );
+	} );
+
+	for ( int ci = 0; ci < chunk_count(); ci++ )
+		out->insert( out->end(), m_ChunkData[ci].begin(), m_ChunkData[ci].end() );
+	m_SinceKeyframe++;
+	return std::find( chunkOk.begin(), chunkOk.end(), 0 ) == chunkOk.end();
+}
+
+template <class Real>
+bool TrajectoryCodec::decode( bool keyframe, const char *data, size_t size, Real *positions, Real *velocities )
+{
+	if ( keyframe )
+		m_SinceKeyframe = 0;
+
+	// the chunks are found serially, then inflated in parallel
+	std::vector<const char*> chunkStart( chunk_count() );
+	std::vector<uint32_t> chunkBytes( chunk_count() );
+	size_t at = 0;
+	for ( int ci = 0; ci < chunk_count(); ci++ ) {
+		if ( at + sizeof( uint32_t ) > size )
+			return false;
+		memcpy( &chunkBytes[ci], data + at, sizeof( uint32_t ) );
+		chunkStart[ci] = data + at + sizeof( uint32_t );
+		at += sizeof( uint32_t ) + chunkBytes[ci];
+		if ( at > size )
+			return false;
+	}
+
+	std::vector<char> chunkOk( chunk_count(), 0 );
+	m_Pool.parallel_for( chunk_count(), [&]( int chunk ) {
+		int begin = chunk * CODEC_CHUNK_PARTICLES, end = std::min( m_Particles, begin + CODEC_CHUNK_PARTICLES );
+		int count = 6 * ( end - begin );
+		std::vector<unsigned char> planes( 4 * count );
+		uLongf bytes = planes.size();
+		if ( uncompress( &planes[0], &bytes, ( const Bytef* )chunkStart[chunk], chunkBytes[chunk] ) != Z_OK || bytes != planes.size() )
+			return;
+		for ( int ii = begin; ii < end; ii++ )
+			for ( int k = 0; k < 6; k++ )
+			{
+				int index = 6 * ii + k, at = index - 6 * begin;
+				uint32_t zigzag = 0;
+				for ( int b = 0; b < 4; b++ )
+					zigzag |= (uint32_t)planes[ b * count + at ] << ( 8 * b );
+				int32_t residual = (int32_t)( zigzag >> 1 ) ^ -(int32_t)( zigzag & 1 );
+				int32_t quantum = (int32_t)( prediction( index ) + residual );
+				m_BeforePrevious[index] = m_Previous[index];
+				m_Previous[index] = quantum;
+				Real value = Real( quantum * m_Step[ k / 3 ] );
+				if ( k < 3 )
+					positions[ 3 * ii + k ] = value;
+				else
+					velocities[ 3 * ii + k - 3 ] = value;
+			}
+		chunkOk[chunk] = 1;
+	} );
+
+	m_SinceKeyframe++;
+	return std::find( chunkOk.begin(), chunkOk.end(), 0 ) == chunkOk.end();
+}
+
+template bool TrajectoryCodec::encode( bool, const float *, const float *, std::vector<char> * );
+template bool TrajectoryCodec::encode( bool, const double *, const double *, std::vector<char> * );
+template bool TrajectoryCodec::decode( bool, const char *, size_t, float *, float * );
+template bool TrajectoryCodec::decode( bool, const char *, size_t, double *, double * );
+
+CompressedTrajectoryFile::CompressedTrajectoryFile() :
+	m_pData( NULL ), m_Size( 0 ), m_pHeader( NULL ), m_pCodecHeader( NULL ), m_pCodec( NULL ), m_LastFrame( -1 ) {
+}
+
+CompressedTrajectoryFile::~CompressedTrajectoryFile()
+{
+	close();
+}
+
+bool CompressedTrajectoryFile::open( const char *fileName, int threads )
+{
+	close();
+	int fd = ::open( fileName, O_RDONLY );
+	if ( fd < 0 ) {
+		fprintf( stderr, "Cannot open trajectory %s\n", fileName );
+		return false;
+	}
+	struct stat info;
+	size_t headers = sizeof( TrajectoryHeader ) + sizeof( TrajectoryCodecHeader );
+	if ( fstat( fd, &info ) != 0 || info.st_size < (off_t)headers ) {
+		fprintf( stderr, "%s is not a compressed trajectory\n", fileName );
+		::close( fd );
+		return false;
+	}
+	void *pMapping = mmap( NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	::close( fd );
+	if ( pMapping == MAP_FAILED ) {
+		fprintf( stderr, "Cannot map trajectory %s\n", fileName );
+		return false;
+	}
+	m_pData = ( const char* )pMapping;
+	m_Size = info.st_size;
+	m_pHeader = ( const TrajectoryHeader* )m_pData;
+	m_pCodecHeader = ( const TrajectoryCodecHeader* )( m_pData + sizeof( TrajectoryHeader ) );
+
+	const TrajectoryHeader &header = *m_pHeader;
+	const TrajectoryCodecHeader &codec = *m_pCodecHeader;
+	if ( memcmp( header.magic, TRAJECTORY_CODEC_MAGIC, sizeof( TRAJECTORY_CODEC_MAGIC ) ) != 0 || header.version != TRAJECTORY_VERSION
+	     || ( header.scalar_bytes != 4 && header.scalar_bytes != 8 ) || codec.keyframe_interval == 0
+	     || header.frame_offset != headers + 8 * (uint64_t)header.springs || header.frame_offset > m_Size ) {
+		fprintf( stderr, "%s is not a version %u compressed trajectory\n", fileName, TRAJECTORY_VERSION );
+		close();
+		return false;
+	}
+
+	const uint64_t prefix = sizeof( uint32_t ) + sizeof( int64_t );	// length and step of each frame record
+	if ( codec.index_offset > 0 && codec.index_offset <= m_Size
+	     && header.frames <= ( m_Size - codec.index_offset ) / sizeof( uint64_t ) ) {
+		const uint64_t *index = ( const uint64_t* )( m_pData + codec.index_offset );
+		m_FrameOffsets.assign( index, index + header.frames );
+		for ( size_t fi = 0; fi < m_FrameOffsets.size(); fi++ )
+			if ( m_FrameOffsets[fi] < header.frame_offset || m_FrameOffsets[fi] > m_Size - prefix ) {
+				fprintf( stderr, "%s has a corrupt frame index\n", fileName );
+				close();
+				return false;
+			}
+	} else {
+		// an interrupted recording has no index, walk the length prefixes up to the last whole frame
+		uint64_t at = header.frame_offset;
+		while ( at + prefix <= m_Size ) {
+			uint32_t bytes;
+			memcpy( &bytes, m_pData + at, sizeof( bytes ) );
+			if ( at + prefix + bytes > m_Size )
+				break;
+			m_FrameOffsets.push_back( at );
+			at += prefix + bytes;
+		}
+	}
+
+	m_pCodec = new TrajectoryCodec( header.particles, codec.position_step, codec.velocity_step,
+	                                codec.extrapolate != 0, 1, threads );
+	m_LastFrame = -1;
+	return true;
+}
+
+void CompressedTrajectoryFile::close()
+{
+	if ( m_pData )
+		munmap( ( void* )m_pData, m_Size );
+	m_pData = NULL;
+	m_pHeader = NULL;
+	m_pCodecHeader = NULL;
+	m_Size = 0;
+	m_FrameOffsets.clear();
+	delete m_pCodec;
+	m_pCodec = NULL;
+	m_LastFrame = -1;
+}
+
+std::string CompressedTrajectoryFile::integrator() const
+{
+	return std::string( m_pHeader->integrator, strnlen( m_pHeader->integrator, sizeof( m_pHeader->integrator ) ) );
+}
+
+const uint32_t *CompressedTrajectoryFile::spring_indices() const
+{
+	return ( const uint32_t* )( m_pData + sizeof( TrajectoryHeader ) + sizeof( TrajectoryCodecHeader ) );
+}
+
+template <class Real>
+bool CompressedTrajectoryFile::read( long frame, Real *positions, Real *velocities, long long *step )
+{
+	if ( sizeof( Real ) != m_pHeader->scalar_bytes || frame < 0 || frame >= frames() )
+		return false;
+
+	long interval = m_pCodecHeader->keyframe_interval;
+	long first = frame == m_LastFrame + 1 ? frame : frame / interval * interval;
+	m_LastFrame = -1;	// unknown state until the decode below succeeds
+	for ( long fi = first; fi <= frame; fi++ )
+	{
+		const char *record = m_pData + m_FrameOffsets[fi];
+		uint32_t bytes;
+		int64_t frameStep;
+		memcpy( &bytes, record, sizeof( bytes ) );
+		memcpy( &frameStep, record + sizeof( bytes ), sizeof( frameStep ) );
+		// open() checked that the prefix is in the file, the frame may still run past its end
+		if ( bytes > m_Size - m_FrameOffsets[fi] - sizeof( bytes ) - sizeof( frameStep ) ) {
+			fprintf( stderr, "Frame %ld of the trajectory runs past the end of the file\n", fi );
+			return false;
+		}
+		if ( !m_pCodec->decode( fi % interval == 0, record + sizeof( bytes ) + sizeof( frameStep ), bytes, positions, velocities ) ) {
+			fprintf( stderr, "Frame %ld of the trajectory is corrupt\n", fi );
+			return false;
+		}
+		*step = frameStep;
+	}
+	m_LastFrame = frame;
+	return true;
+}
+
+template bool CompressedTrajectoryFile::read( long, float *, float *, long long * );
+template bool CompressedTrajectoryFile::read( long, double *, double *, long long * );
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "TrajectoryFile.h"
+#include "ThreadPool.h"
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+// Lossy compression of trajectory frames.
+// Positions and velocities are rounded to multiples of twice their error bound, so no decoded
+// value is further than the bound ( plus float rounding ) from the recorded one. Each value is stored as its difference
+// to a prediction made from the previous quantized frames, either the previous value or a
+// linear extrapolation of the last two. Prediction runs on the quantized integers, so the
+// decoder reproduces them exactly and errors never accumulate. The residuals are zigzag coded,
+// split into byte planes ( all low bytes first ) and deflated with zlib's run-length strategy. Particles are coded in
+// independent chunks of CODEC_CHUNK_PARTICLES, which the codec spreads over its own threads.
+// Every keyframe_interval-th frame is coded without prediction; decoding can start there.
+//
+// Compressed file layout, native byte order:
+//   TrajectoryHeader with TRAJECTORY_CODEC_MAGIC, frame_stride 0 and the frame count
+//   TrajectoryCodecHeader
+//   uint32[2]  the two particle indices of every spring
+// then every frame:
+//   uint32     bytes of the chunks that follow
+//   int64      step
+//   for every chunk: uint32 bytes, zlib stream of the chunk's residual byte planes
+// then the frame index at index_offset:
+//   uint64     file offset of every frame
+
+const char TRAJECTORY_CODEC_MAGIC[8] = { 'C', 'L', 'O', 'T', 'H', 'C', 'T', 'J' };
+const int CODEC_CHUNK_PARTICLES = 16384;
+const int CODEC_MAX_QUANTUM = 1 << 28;	// largest value in steps that can be coded, so residuals fit in 32 bits
+
+struct TrajectoryCodecHeader {
+	double position_step, velocity_step;	// quantization steps, twice the error bounds
+	uint32_t keyframe_interval;
+	uint32_t extrapolate;
+	uint64_t index_offset;					// written when the recording is closed, 0 after a crash
+};
+
+struct TrajectoryCodecOptions {
+	double position_error;		// largest position error after decoding, in scene units
+	double velocity_error;
+	int keyframe_interval;
+	bool extrapolate;			// predict 2 x(t-1) - x(t-2) instead of x(t-1)
+	int level;					// zlib level, 1 is fastest
+	int threads;				// 0 uses every core
+
+	TrajectoryCodecOptions();
+};
+
+// the state of one coded stream of frames, encoding and decoding must see the same sequence
+class TrajectoryCodec {
+	public:
+		TrajectoryCodec( int particles, double position_step, double velocity_step, bool extrapolate, int level, int threads );
+
+		// appends the coded frame to "out"; "keyframe" drops the prediction. Returns false if a
+		// value is further than CODEC_MAX_QUANTUM steps from 0, the frame then breaks the error bound
+		template <class Real>
+		bool encode( bool keyframe, const Real *positions, const Real *velocities, std::vector<char> *out );
+
+		// returns false on corrupt data
+		template <class Real>
+		bool decode( bool keyframe, const char *data, size_t size, Real *positions, Real *velocities );
+
+	private:
+		int chunk_count() const { return ( m_Particles + CODEC_CHUNK_PARTICLES - 1 ) / CODEC_CHUNK_PARTICLES; }
+		int64_t prediction( int index ) const;
+
+		int m_Particles;
+		double m_Step[2];			// position, velocity
+		bool m_Extrapolate;
+		int m_Level;
+		int m_SinceKeyframe;		// frames coded since the last keyframe, picks the predictor
+		std::vector<int32_t> m_Previous, m_BeforePrevious;	// quantized frames, 6 values per particle
+		std::vector< std::vector<char> > m_ChunkData;
+		ThreadPool m_Pool;
+};
+
+// a compressed recording, mapped read-only and decoded on demand
+class CompressedTrajectoryFile {
+	public:
+		CompressedTrajectoryFile();
+		~CompressedTrajectoryFile();
+
+		bool open( const char *fileName, int threads );
+		void close();
+
+		int particles() const { return m_pHeader->particles; }
+		int springs() const { return m_pHeader->springs; }
+		int scalar_bytes() const { return m_pHeader->scalar_bytes; }
+		double dt() const { return m_pHeader->dt; }
+		std::string integrator() const;
+		long frames() const { return m_FrameOffsets.size(); }
+		const uint32_t *spring_indices() const;
+
+		// decodes from the keyframe before "frame" unless "frame" follows the last one read,
+		// so sequential reads cost one frame each; "Real" must match scalar_bytes
+		template <class Real>
+		bool read( long frame, Real *positions, Real *velocities, long long *step );
+
+	private:
+		CompressedTrajectoryFile( const CompressedTrajectoryFile & );
+		void operator = ( const CompressedTrajectoryFile & );
+
+		const char *m_pData;
+		size_t m_Size;
+		const TrajectoryHeader *m_pHeader;
+		const TrajectoryCodecHeader *m_pCodecHeader;
+		std::vector<uint64_t> m_FrameOffsets;
+		TrajectoryCodec *m_pCodec;
+		long m_LastFrame;		// last frame decoded into the codec state, -1 for none
+};
@@ -0,0 +1,84 @@
+#include "TrajectoryFile.h"
+
+#include <cstring>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+TrajectoryFile::TrajectoryFile() : m_pData( NULL ), m_Size( 0 ), m_pHeader( NULL ), m_Frames( 0 ) {
+}
+
+TrajectoryFile::~TrajectoryFile()
+{
+	close();
+}
+
+bool TrajectoryFile::open( const char *fileName )
+{
+	close();
+	int fd = ::open( fileName, O_RDONLY );
+	if ( fd < 0 ) {
+		fprintf( stderr, "Cannot open trajectory %s\n", fileName );
+		return false;
+	}
+	struct stat info;
+	if ( fstat( fd, &info ) != 0 || info.st_size < (off_t)sizeof( TrajectoryHeader ) ) {
+		fprintf( stderr, "%s is not a trajectory\n", fileName );
+		::close( fd );
+		return false;
+	}
+	void *pMapping = mmap( NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	::close( fd );	// the mapping keeps the file
+	if ( pMapping == MAP_FAILED ) {
+		fprintf( stderr, "Cannot map trajectory %s\n", fileName );
+		return false;
+	}
+	m_pData = ( const char* )pMapping;
+	m_Size = info.st_size;
+	m_pHeader = ( const TrajectoryHeader* )m_pData;
+
+	const TrajectoryHeader &header = *m_pHeader;
+	uint64_t frame_bytes = sizeof( int64_t ) + 6 * (uint64_t)header.particles * header.scalar_bytes;
+	if ( memcmp( header.magic, TRAJECTORY_MAGIC, sizeof( TRAJECTORY_MAGIC ) ) != 0 || header.version != TRAJECTORY_VERSION
+	     || ( header.scalar_bytes != 4 && header.scalar_bytes != 8 ) || header.frame_stride < frame_bytes
+	     || header.frame_offset < sizeof( TrajectoryHeader ) + 8 * (uint64_t)header.springs || header.frame_offset > m_Size ) {
+		fprintf( stderr, "%s is not a version %u trajectory\n", fileName, TRAJECTORY_VERSION );
+		close();
+		return false;
+	}
+
+	// an interrupted recording has no frame count, it ends at the last whole frame
+	m_Frames = ( m_Size - header.frame_offset ) / header.frame_stride;
+	if ( header.frames > 0 && header.frames < (uint64_t)m_Frames )
+		m_Frames = header.frames;
+	return true;
+}
+
+void TrajectoryFile::close()
+{
+	if ( m_pData )
+		munmap( ( void* )m_pData, m_Size );
+	m_pData = NULL;
+	m_pHeader = NULL;
+	m_Size = 0;
+	m_Frames = 0;
+}
+
+std::string TrajectoryFile::integrator() const
+{
+	return std::string( m_pHeader->integrator, strnlen( m_pHeader->integrator, sizeof( m_pHeader->integrator ) ) );
+}
+
+const uint32_t *TrajectoryFile::spring_indices() const
+{
+	return ( const uint32_t* )( m_pData + sizeof( TrajectoryHeader ) );
+}
+
+long long TrajectoryFile::step( long frame ) const
+{
+	int64_t step;
+	memcpy( &step, frame_data( frame ), sizeof( step ) );
+	return step;
+}
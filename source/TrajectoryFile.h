@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// Trajectory files, written by TrajectoryRecorder and read back here through mmap.
+// Frames have a fixed stride and start at a fixed offset, so the frame index is the
+// arithmetic frame_offset + frame * frame_stride: jumping to frame 100000 touches the
+// same one or two pages as jumping to frame 1, and nothing is read that is not shown.
+//
+// Layout, native byte order:
+//   TrajectoryHeader
+//   uint32[2]  the two particle indices of every spring
+//   zeros up to frame_offset, a multiple of TRAJECTORY_ALIGNMENT
+// then every frame, frame_stride bytes each:
+//   int64      step
+//   scalar[3]  position of every particle, float or double as scalar_bytes says
+//   scalar[3]  velocity of every particle
+
+const char TRAJECTORY_MAGIC[8] = { 'C', 'L', 'O', 'T', 'H', 'T', 'R', 'J' };
+const uint32_t TRAJECTORY_VERSION = 2;
+const int TRAJECTORY_ALIGNMENT = 64;	// frames start on a cache line, positions can be used in place
+
+struct TrajectoryHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t scalar_bytes;		// 4 or 8
+	uint32_t particles;
+	uint32_t springs;
+	double dt;
+	char integrator[16];		// zero padded
+	uint64_t frame_offset;
+	uint64_t frame_stride;
+	uint64_t frames;			// written when the recording is closed, 0 after a crash
+};
+
+class TrajectoryFile {
+	public:
+		TrajectoryFile();
+		~TrajectoryFile();	// unmaps the file
+
+		// maps the whole file read-only, returns false if it is missing or not a trajectory
+		bool open( const char *fileName );
+		void close();
+
+		int particles() const { return m_pHeader->particles; }
+		int springs() const { return m_pHeader->springs; }
+		int scalar_bytes() const { return m_pHeader->scalar_bytes; }
+		double dt() const { return m_pHeader->dt; }
+		std::string integrator() const;
+		long frames() const { return m_Frames; }
+
+		const uint32_t *spring_indices() const;	// 2 per spring
+
+		// pointers into the mapping, valid until close(); "Real" must match scalar_bytes
+		// or NULL comes back
+		long long step( long frame ) const;
+		template <class Real>
+		const Real *positions( long frame ) const
+		{
+			return sizeof( Real ) == m_pHeader->scalar_bytes ? ( const Real* )( frame_data( frame ) + sizeof( int64_t ) ) : NULL;
+		}
+		template <class Real>
+		const Real *velocities( long frame ) const
+		{
+			const Real *p = positions<Real>( frame );
+			return p ? p + 3 * particles() : NULL;
+		}
+
+	private:
+		TrajectoryFile( const TrajectoryFile & );
+		void operator = ( const TrajectoryFile & );
+
+		const char *frame_data( long frame ) const { return m_pData + m_pHeader->frame_offset + frame * m_pHeader->frame_stride; }
+
+		const char *m_pData;
+		size_t m_Size;
+		const TrajectoryHeader *m_pHeader;
+		long m_Frames;
+};
@@ -0,0 +1,220 @@
+#include "TrajectoryRecorder.h"
+
+#include <algorithm>
+#include <cstddef>
+
+TrajectoryRecorder::TrajectoryRecorder() :
+	m_File( NULL ), m_FrameBytes( 0 ), m_Frames( 0 ), m_Particles( 0 ), m_ScalarBytes( 0 ), m_pCodec( NULL ),
+	m_KeyframeInterval( 1 ), m_Offset( 0 ), m_OutOfRange( false ), m_pCurrent( NULL ), m_Allocated( 0 ),
+	m_Failed( false ), m_Quit( false ) {
+}
+
+TrajectoryRecorder::~TrajectoryRecorder()
+{
+	close();
+}
+
+bool TrajectoryRecorder::open_file( const char *fileName, int scalar_bytes, int particles, const std::vector<unsigned int> &springs,
+                                    float dt, const std::string &mode, const TrajectoryCodecOptions *pCompression )
+{
+	close();
+	m_File = fopen( fileName, "wb" );
+	if ( !m_File ) {
+		fprintf( stderr, "Cannot write trajectory %s\n", fileName );
+		return false;
+	}
+
+	// frames are padded to whole cache lines, so every frame starts aligned in the mapping
+	const uint64_t align = TRAJECTORY_ALIGNMENT;
+	uint64_t frame_bytes = sizeof( int64_t ) + 2 * 3 * (uint64_t)particles * scalar_bytes;
+	uint64_t spring_bytes = springs.size() * sizeof( unsigned int );
+
+	TrajectoryHeader header;
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, TRAJECTORY_MAGIC, sizeof( header.magic ) );
+	header.version = TRAJECTORY_VERSION;
+	header.scalar_bytes = scalar_bytes;
+	header.particles = particles;
+	header.springs = springs.size() / 2;
+	header.dt = dt;
+	strncpy( header.integrator, mode.c_str(), sizeof( header.integrator ) - 1 );
+	header.frame_offset = ( sizeof( header ) + spring_bytes + align - 1 ) / align * align;
+	header.frame_stride = ( frame_bytes + align - 1 ) / align * align;
+	header.frames = 0;
+
+	// compressed frames have no fixed size and start right after the springs
+	TrajectoryCodecHeader codec;
+	memset( &codec, 0, sizeof( codec ) );
+	if ( pCompression ) {
+		memcpy( header.magic, TRAJECTORY_CODEC_MAGIC, sizeof( header.magic ) );
+		header.frame_offset = sizeof( header ) + sizeof( codec ) + spring_bytes;
+		header.frame_stride = 0;
+		codec.position_step = 2.0 * pCompression->position_error;
+		codec.velocity_step = 2.0 * pCompression->velocity_error;
+		codec.keyframe_interval = std::max( 1, pCompression->keyframe_interval );
+		codec.extrapolate = pCompression->extrapolate;
+	}
+
+	std::vector<char> padding( header.frame_offset - sizeof( header ) - spring_bytes - ( pCompression ? sizeof( codec ) : 0 ), 0 );
+	bool ok = fwrite( &header, sizeof( header ), 1, m_File ) == 1
+	       && ( !pCompression || fwrite( &codec, sizeof( codec ), 1, m_File ) == 1 )
+	       && ( springs.empty() || fwrite( &springs[0], sizeof( unsigned int ), springs.size(), m_File ) == springs.size() )
+	       && ( padding.empty() || fwrite( &padding[0], 1, padding.size(), m_File ) == padding.size() );
+	if ( !ok ) {
+		fprintf( stderr, "Cannot write trajectory %s\n", fileName );
+		fclose( m_File );
+		m_File = NULL;
+		return false;
+	}
+
+	m_FrameBytes = pCompression ? frame_bytes : header.frame_stride;
+	m_Frames = 0;
+	m_Particles = particles;
+	m_ScalarBytes = scalar_bytes;
+	if ( pCompression ) {
+		m_pCodec = new TrajectoryCodec( particles, codec.position_step, codec.velocity_step, pCompression->extrapolate,
+		                                pCompression->level, pCompression->threads );
+		m_KeyframeInterval = codec.keyframe_interval;
+		m_FrameOffsets.clear();
+		m_Offset = header.frame_offset;
+		m_OutOfRange = false;
+	}
+	m_Failed = m_Quit = false;
+	m_Writer = std::thread( &TrajectoryRecorder::writer_loop, this );
+	return true;
+}
+
+char *TrajectoryRecorder::frame_slot()
+{
+	if ( m_pCurrent && m_pCurrent->used + m_FrameBytes > m_pCurrent->data.size() ) {
+		{
+			std::lock_guard<std::mutex> lock( m_Mutex );
+			m_Queue.push_back( m_pCurrent );
+		}
+		m_Full.notify_one();
+		m_pCurrent = NULL;
+	}
+
+	if ( !m_pCurrent ) {
+		std::unique_lock<std::mutex> lock( m_Mutex );
+		if ( m_Spare.empty() && m_Allocated == TRAJECTORY_BUFFERS )
+			m_Empty.wait( lock, [&]{ return !m_Spare.empty(); } );
+		if ( !m_Spare.empty() ) {
+			m_pCurrent = m_Spare.back();
+			m_Spare.pop_back();
+		} else {
+			// at least one frame per buffer, however large the cloth
+			m_pCurrent = new Buffer();
+			m_pCurrent->data.resize( std::max<size_t>( 1, TRAJECTORY_BUFFER_BYTES / m_FrameBytes ) * m_FrameBytes );
+			m_Allocated++;
+		}
+		m_pCurrent->used = 0;
+	}
+	return &m_pCurrent->data[ m_pCurrent->used ];
+}
+
+void TrajectoryRecorder::frame_done()
+{
+	m_pCurrent->used += m_FrameBytes;
+	m_Frames++;
+}
+
+void TrajectoryRecorder::writer_loop()
+{
+	for ( ;; )
+	{
+		Buffer *pBuffer;
+		{
+			std::unique_lock<std::mutex> lock( m_Mutex );
+			m_Full.wait( lock, [&]{ return m_Quit || !m_Queue.empty(); } );
+			if ( m_Queue.empty() )
+				return;		// quitting with nothing left to write
+			pBuffer = m_Queue.front();
+			m_Queue.pop_front();
+		}
+
+		bool ok = m_pCodec ? write_compressed( pBuffer )
+		                   : fwrite( &pBuffer->data[0], 1, pBuffer->used, m_File ) == pBuffer->used;
+
+		{
+			std::lock_guard<std::mutex> lock( m_Mutex );
+			m_Failed = m_Failed || !ok;
+			m_Spare.push_back( pBuffer );
+		}
+		m_Empty.notify_one();
+	}
+}
+
+bool TrajectoryRecorder::write_compressed( const Buffer *pBuffer )
+{
+	bool ok = !m_OutOfRange;	// the recording ends at the first frame the codec cannot hold
+	for ( size_t at = 0; ok && at < pBuffer->used; at += m_FrameBytes )
+	{
+		const char *frame = &pBuffer->data[at];
+		const char *positions = frame + sizeof( int64_t );
+		const char *velocities = positions + 3 * (size_t)m_Particles * m_ScalarBytes;
+		bool keyframe = m_FrameOffsets.size() % m_KeyframeInterval == 0;
+		m_Coded.clear();
+		if ( m_ScalarBytes == sizeof( float ) )
+			m_OutOfRange = !m_pCodec->encode( keyframe, ( const float* )positions, ( const float* )velocities, &m_Coded );
+		else
+			m_OutOfRange = !m_pCodec->encode( keyframe, ( const double* )positions, ( const double* )velocities, &m_Coded );
+		if ( m_OutOfRange ) {
+			fprintf( stderr, "Frame %zu of the trajectory has values beyond %d quantization steps, the error bound is too small\n",
+			         m_FrameOffsets.size(), CODEC_MAX_QUANTUM );
+			return false;
+		}
+
+		uint32_t bytes = m_Coded.size();
+		ok = ok && fwrite( &bytes, sizeof( bytes ), 1, m_File ) == 1
+		        && fwrite( frame, sizeof( int64_t ), 1, m_File ) == 1
+		        && fwrite( &m_Coded[0], 1, bytes, m_File ) == bytes;
+		m_FrameOffsets.push_back( m_Offset );
+		m_Offset += sizeof( bytes ) + sizeof( int64_t ) + bytes;
+	}
+	return ok;
+}
+
+bool TrajectoryRecorder::close()
+{
+	if ( !m_File )
+		return true;
+
+	{
+		std::lock_guard<std::mutex> lock( m_Mutex );
+		if ( m_pCurrent && m_pCurrent->used > 0 )
+			m_Queue.push_back( m_pCurrent );
+		else if ( m_pCurrent )
+			m_Spare.push_back( m_pCurrent );
+		m_pCurrent = NULL;
+		m_Quit = true;
+	}
+	m_Full.notify_one();
+	m_Writer.join();
+
+	// the frame index follows the frames of a compressed recording
+	uint64_t index_offset = m_Offset;
+	if ( m_pCodec )
+		m_Failed = m_Failed || ( !m_FrameOffsets.empty()
+		           && fwrite( &m_FrameOffsets[0], sizeof( uint64_t ), m_FrameOffsets.size(), m_File ) != m_FrameOffsets.size() );
+
+	// the frame count goes into the header last, a file without it was cut short
+	uint64_t frames = m_pCodec ? m_FrameOffsets.size() : m_Frames;
+	m_Failed = m_Failed || fseek( m_File, offsetof( TrajectoryHeader, frames ), SEEK_SET ) != 0
+	           || fwrite( &frames, sizeof( frames ), 1, m_File ) != 1;
+	if ( m_pCodec )
+		m_Failed = m_Failed || fseek( m_File, sizeof( TrajectoryHeader ) + offsetof( TrajectoryCodecHeader, index_offset ), SEEK_SET ) != 0
+		           || fwrite( &index_offset, sizeof( index_offset ), 1, m_File ) != 1;
+	delete m_pCodec;
+	m_pCodec = NULL;
+	bool closed = fclose( m_File ) == 0;
+	bool ok = !m_Failed && closed;
+	m_File = NULL;
+	for ( int bi = 0; bi < m_Spare.size(); bi++ )
+		delete m_Spare[bi];
+	m_Spare.clear();
+	m_Allocated = 0;
+	if ( !ok )
+		fprintf( stderr, "Writing the trajectory failed\n" );
+	return ok;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "ClothWorld.h"
+#include "TrajectoryFile.h"
+#include "TrajectoryCodec.h"
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <stdio.h>
+
+// Binary trajectory of one cloth, written by a background thread, layout in TrajectoryFile.h.
+// record() only copies the particle state into a buffer; full buffers go to the writer
+// thread, which does the file I/O. If the disk falls behind by more than
+// TRAJECTORY_BUFFERS buffers, record() waits instead of dropping frames.
+// With compression options the writer thread also encodes the frames, layout in TrajectoryCodec.h.
+
+const int TRAJECTORY_BUFFER_BYTES = 1 << 20;	// frames are batched into buffers of about this size
+const int TRAJECTORY_BUFFERS = 8;				// buffers in flight before record() waits
+
+class TrajectoryRecorder {
+	public:
+		TrajectoryRecorder();
+		~TrajectoryRecorder();	// closes the file
+
+		// writes the header, returns false if the file cannot be created;
+		// "pCompression" NULL writes the raw mappable format
+		template <class P>
+		bool open( const char *fileName, const ClothWorldT<P> *pWorld, float dt, const std::string &mode,
+		           const TrajectoryCodecOptions *pCompression = NULL )
+		{
+			typedef typename P::Real Real;
+			std::vector<unsigned int> springs;
+			for ( int fi = 0; fi < pWorld->pNonconstraintForceVector.size(); fi++ )
+				if ( pWorld->pNonconstraintForceVector[fi]->is_spring ) {
+					SpringForceT<Real> *pSpring = ( SpringForceT<Real>* )pWorld->pNonconstraintForceVector[fi];
+					pSpring->update_index( pWorld->pVector );
+					springs.push_back( pSpring->index_of_p1() );
+					springs.push_back( pSpring->index_of_p2() );
+				}
+			return open_file( fileName, sizeof( Real ), pWorld->particle_count(), springs, dt, mode, pCompression );
+		}
+
+		// the same without a world, for copying recordings
+		bool open_file( const char *fileName, int scalar_bytes, int particles, const std::vector<unsigned int> &springs,
+		                float dt, const std::string &mode, const TrajectoryCodecOptions *pCompression );
+
+		// queues the current state of "pWorld", which must be the world passed to open()
+		template <class P>
+		void record( const ClothWorldT<P> *pWorld )
+		{
+			typedef typename P::Real Real;
+			const int size = pWorld->particle_count();
+			char *frame = frame_slot();
+			int64_t step = pWorld->step_count();
+			memcpy( frame, &step, sizeof( step ) );
+			char *positions = frame + sizeof( step ), *velocities = positions + size * 3 * sizeof( Real );
+			for ( int ii = 0; ii < size; ii++ ) {
+				memcpy( positions + ii * 3 * sizeof( Real ), &pWorld->pVector[ii]->m_Position[0], 3 * sizeof( Real ) );
+				memcpy( velocities + ii * 3 * sizeof( Real ), &pWorld->pVector[ii]->m_Velocity[0], 3 * sizeof( Real ) );
+			}
+			frame_done();
+		}
+
+		// queues a frame given as arrays, 3 scalars per particle of the size passed to open_file()
+		template <class Real>
+		void record_frame( long long step, const Real *positions, const Real *velocities )
+		{
+			const size_t bytes = 3 * (size_t)m_Particles * sizeof( Real );
+			char *frame = frame_slot();
+			int64_t frameStep = step;
+			memcpy( frame, &frameStep, sizeof( frameStep ) );
+			memcpy( frame + sizeof( frameStep ), positions, bytes );
+			memcpy( frame + sizeof( frameStep ) + bytes, velocities, bytes );
+			frame_done();
+		}
+
+		// waits for every queued frame and fills in the frame count, returns false if any write failed
+		bool close();
+
+		int frames() const { return m_Frames; }
+
+	private:
+		TrajectoryRecorder( const TrajectoryRecorder & );
+		void operator = ( const TrajectoryRecorder & );
+
+		struct Buffer {
+			std::vector<char> data;
+			size_t used;
+		};
+
+		char *frame_slot();		// room for one frame at the end of the current buffer
+		void frame_done();
+		void writer_loop();
+		bool write_compressed( const Buffer *pBuffer );	// on the writer thread
+
+		FILE *m_File;
+		size_t m_FrameBytes;
+		int m_Frames;
+		int m_Particles, m_ScalarBytes;
+
+		TrajectoryCodec *m_pCodec;			// NULL for raw recordings, used by the writer thread only
+		int m_KeyframeInterval;
+		std::vector<uint64_t> m_FrameOffsets;
+		uint64_t m_Offset;					// end of the file so far
+		std::vector<char> m_Coded;
+		bool m_OutOfRange;					// a frame had values the codec cannot hold, no more are written
+
+		std::thread m_Writer;
+		std::mutex m_Mutex;
+		std::condition_variable m_Full, m_Empty;
+		std::deque<Buffer*> m_Queue;		// full buffers waiting for the writer
+		std::vector<Buffer*> m_Spare;		// written buffers ready for reuse
+		Buffer *m_pCurrent;					// being filled by record(), owned by the recording thread
+		int m_Allocated;
+		bool m_Failed, m_Quit;
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+
+// Single producer, single consumer handoff of whole frames without locks.
+// The producer fills write_buffer() and publish()es it, the consumer calls update() and reads
+// read_buffer(). Three buffers mean neither side ever waits: the producer always has a free
+// buffer and the consumer always holds the newest complete one. Frames the consumer did not get
+// to in time are overwritten, never queued.
+template <class T>
+class TripleBuffer {
+	public:
+		TripleBuffer() : m_Back( 0 ), m_Middle( 1 ), m_Front( 2 ) {}
+
+		// producer side
+		T &write_buffer() { return m_Buffers[m_Back]; }
+		void publish()
+		{
+			// hand the filled buffer over and take back whatever was waiting
+			m_Back = m_Middle.exchange( m_Back | FRESH, std::memory_order_acq_rel ) & INDEX;
+		}
+
+		// consumer side, returns false when nothing newer was published since the last call
+		bool update()
+		{
+			if ( !( m_Middle.load( std::memory_order_relaxed ) & FRESH ) )
+				return false;
+			m_Front = m_Middle.exchange( m_Front, std::memory_order_acq_rel ) & INDEX;
+			return true;
+		}
+		const T &read_buffer() const { return m_Buffers[m_Front]; }
+
+	private:
+		TripleBuffer( const TripleBuffer & );
+		void operator = ( const TripleBuffer & );
+
+		enum { INDEX = 3, FRESH = 4 };	// m_Middle packs the buffer index and a "not read yet" bit
+
+		T m_Buffers[3];
+		unsigned int m_Back;				// owned by the producer
+		std::atomic<unsigned int> m_Middle;	// the one being handed over
+		unsigned int m_Front;				// owned by the consumer
+};
@@ -25,6 +25,12 @@
 
 #include "imageio.h"
 
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <zlib.h>
+
 // ***** generic internal functions ***** //
 
 // Call this function if there was an error.
@@ -34,7 +40,7 @@ unsigned char *_loadImgError(int *width, int *height) {
 }
 
 // Returns true iff the string s ends with postfix
-bool _endsWith(char *s, char *postfix) {
+bool _endsWith(const char *s, const char *postfix) {
   int sLen = strlen(s);
   int postfixLen = strlen(postfix);
   if (postfixLen > sLen)
@@ -79,7 +85,7 @@ unsigned char *_loadImageRGBApng(char *fileName, int *width, int *height) {
     return _loadImgError(width, height);
   }
 
-  if (setjmp(png_ptr->jmpbuf)) {
+  if (setjmp(png_jmpbuf(png_ptr))) {
     png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
     fclose(fp);
     return _loadImgError(width, height);
@@ -131,7 +137,13 @@ unsigned char *_loadImageRGBApng(char *fileName, int *width, int *height) {
   return buffer;
 }
 
-bool _saveImageRGBApng(char *fileName, unsigned char *buffer, int width, int height) {
+// PNG_FILTER_* bits, none of them meaning no filter
+int _pngFilters(const PngOptions &options) {
+  int filters = options.filters & PNG_ALL_FILTERS;
+  return filters ? filters : PNG_FILTER_NONE;
+}
+
+bool _saveImageRGBApng(char *fileName, unsigned char *buffer, int width, int height, const PngOptions &options) {
   // open the file
   FILE *fp = fopen(fileName, "wb");
   if (!fp)
@@ -151,7 +163,7 @@ bool _saveImageRGBApng(char *fileName, unsigned char *buffer, int width, int hei
   }
 
   // do the setjmp thingy
-  if (setjmp(png_ptr->jmpbuf)) {
+  if (setjmp(png_jmpbuf(png_ptr))) {
     png_destroy_write_struct(&png_ptr, &info_ptr);
     fclose(fp);
     return false;
@@ -161,10 +173,14 @@ bool _saveImageRGBApng(char *fileName, unsigned char *buffer, int width, int hei
   png_init_io(png_ptr, fp);
   
   // write the header
-  png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, 
-	       PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_set_IHDR(png_ptr, info_ptr, width, height, 8, options.rgb ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA,
+	       PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_set_compression_level(png_ptr, options.level);
+  png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, _pngFilters(options));
   png_write_info(png_ptr, info_ptr);
-  png_set_flush(png_ptr, 10);
+  // the rows stay RGBA, libpng drops the alpha byte of each pixel
+  if (options.rgb)
+    png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
 
   // write the image
   png_bytep row_pointers[height];
@@ -179,8 +195,189 @@ bool _saveImageRGBApng(char *fileName, unsigned char *buffer, int width, int hei
   return true;
 }
 
+// ***** parallel png writer ***** //
+
+// runs task(0) .. task(count - 1) on as many threads, task(0) on the calling one
+template <class Task>
+void _inParallel(int count, const Task &task) {
+  std::vector<std::thread> threads;
+  for (int i = 1; i < count; i++)
+    threads.push_back(std::thread(task, i));
+  task(0);
+  for (int i = 0; i < threads.size(); i++)
+    threads[i].join();
+}
+
+// row "y", counted from the top, of the bottom-up RGBA buffer, as the bytes that go into the file
+void _pngRow(const unsigned char *buffer, int width, int height, int y, bool rgb, unsigned char *row) {
+  const unsigned char *pixels = buffer + (size_t) (height - 1 - y) * width * 4;
+  if (!rgb) {
+    memcpy(row, pixels, (size_t) width * 4);
+    return;
+  }
+  for (int x = 0; x < width; x++) {
+    row[3 * x] = pixels[4 * x];
+    row[3 * x + 1] = pixels[4 * x + 1];
+    row[3 * x + 2] = pixels[4 * x + 2];
+  }
+}
+
+inline int _paeth(int a, int b, int c) {
+  int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  return (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+}
+
+// "row" filtered with filter "type" against the row above it, "prev"
+void _pngFilter(int type, const unsigned char *row, const unsigned char *prev, int bytes, int bpp, unsigned char *out) {
+  switch (type) {
+  case 0:
+    memcpy(out, row, bytes);
+    break;
+  case 1:
+    for (int i = 0; i < bpp; i++)
+      out[i] = row[i];
+    for (int i = bpp; i < bytes; i++)
+      out[i] = row[i] - row[i - bpp];
+    break;
+  case 2:
+    for (int i = 0; i < bytes; i++)
+      out[i] = row[i] - prev[i];
+    break;
+  case 3:
+    for (int i = 0; i < bpp; i++)
+      out[i] = row[i] - (prev[i] >> 1);
+    for (int i = bpp; i < bytes; i++)
+      out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+    break;
+  default:
+    for (int i = 0; i < bpp; i++)
+      out[i] = row[i] - prev[i];
+    for (int i = bpp; i < bytes; i++)
+      out[i] = row[i] - _paeth(row[i - bpp], prev[i], prev[i - bpp]);
+  }
+}
+
+// Filters "row" with each filter in "filters" and writes the filter type and the filtered
+// bytes of the smallest sum of absolute values to "line", the choice libpng makes.
+// "scratch" holds one row.
+void _pngFilterRow(const unsigned char *row, const unsigned char *prev, int bytes, int bpp, int filters,
+                   unsigned char *line, unsigned char *scratch) {
+  unsigned long best = ~0ul;
+  for (int type = 0; type < 5; type++) {
+    if (!(filters & (PNG_FILTER_NONE << type)))
+      continue;
+    if (filters == (PNG_FILTER_NONE << type)) {
+      line[0] = type;
+      _pngFilter(type, row, prev, bytes, bpp, line + 1);
+      return;
+    }
+    _pngFilter(type, row, prev, bytes, bpp, scratch);
+    unsigned long sum = 0;
+    for (int i = 0; i < bytes; i++)
+      sum += scratch[i] < 128 ? scratch[i] : 256 - scratch[i];
+    if (sum < best) {
+      best = sum;
+      line[0] = type;
+      memcpy(line + 1, scratch, bytes);
+    }
+  }
+}
+
+// one chunk: length, type, data and the crc of type and data
+bool _pngChunk(FILE *fp, const char *type, const unsigned char *data, size_t bytes) {
+  unsigned char length[4] = { (unsigned char) (bytes >> 24), (unsigned char) (bytes >> 16),
+                              (unsigned char) (bytes >> 8), (unsigned char) bytes };
+  uLong crc = crc32(crc32(0, 0, 0), (const Bytef *) type, 4);
+  if (bytes)
+    crc = crc32(crc, data, bytes);
+  unsigned char check[4] = { (unsigned char) (crc >> 24), (unsigned char) (crc >> 16),
+                             (unsigned char) (crc >> 8), (unsigned char) crc };
+  return fwrite(length, 1, 4, fp) == 4 && fwrite(type, 1, 4, fp) == 4
+      && (!bytes || fwrite(data, 1, bytes, fp) == bytes) && fwrite(check, 1, 4, fp) == 4;
+}
+
+bool _saveImageRGBApngStrips(char *fileName, unsigned char *buffer, int width, int height, const PngOptions &options, int strips) {
+  const int bpp = options.rgb ? 3 : 4, filters = _pngFilters(options);
+  const size_t rowBytes = (size_t) width * bpp, lineBytes = rowBytes + 1;
+  std::vector<unsigned char> filtered(lineBytes * height);
+
+  // every strip filters its rows, then deflates them with the end of the strip before as the
+  // dictionary, so each needs the strip before it filtered
+  _inParallel(strips, [&](int strip) {
+    std::vector<unsigned char> rows(3 * rowBytes, 0);
+    unsigned char *prev = &rows[0], *row = prev + rowBytes, *scratch = row + rowBytes;
+    int first = (long) height * strip / strips, last = (long) height * (strip + 1) / strips;
+    if (first > 0)
+      _pngRow(buffer, width, height, first - 1, options.rgb, prev);
+    for (int y = first; y < last; y++) {
+      _pngRow(buffer, width, height, y, options.rgb, row);
+      _pngFilterRow(row, prev, rowBytes, bpp, filters, &filtered[y * lineBytes], scratch);
+      std::swap(prev, row);
+    }
+  });
+
+  std::vector<std::vector<unsigned char> > coded(strips);
+  std::vector<uLong> adler(strips);
+  std::vector<char> ok(strips, 0);
+  _inParallel(strips, [&](int strip) {
+    size_t first = (long) height * strip / strips * lineBytes, last = (long) height * (strip + 1) / strips * lineBytes;
+    bool final = strip == strips - 1;
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // raw deflate, the zlib header and checksum are written around the strips
+    if (deflateInit2(&stream, options.level, Z_DEFLATED, -15, 8, filters == PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED) != Z_OK)
+      return;
+    size_t dictionary = std::min<size_t>(first, 32768);
+    if (dictionary)
+      deflateSetDictionary(&stream, &filtered[first - dictionary], dictionary);
+    std::vector<unsigned char> &out = coded[strip];
+    out.resize(deflateBound(&stream, last - first) + 16);
+    stream.next_in = &filtered[first];
+    stream.avail_in = last - first;
+    stream.next_out = &out[0];
+    stream.avail_out = out.size();
+    // a sync flush ends a strip on a byte boundary without ending the stream
+    int result = deflate(&stream, final ? Z_FINISH : Z_SYNC_FLUSH);
+    ok[strip] = final ? result == Z_STREAM_END : result == Z_OK && stream.avail_in == 0 && stream.avail_out > 0;
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    adler[strip] = adler32(adler32(0, 0, 0), &filtered[first], last - first);
+  });
+  for (int strip = 0; strip < strips; strip++)
+    if (!ok[strip])
+      return false;
+
+  // the zlib header, with the level in it as zlib writes it, and the checksum of all strips
+  int flevel = options.level == Z_DEFAULT_COMPRESSION ? 2 : options.level < 2 ? 0 : options.level < 6 ? 1 : options.level == 6 ? 2 : 3;
+  unsigned char header[2] = { 0x78, (unsigned char) (flevel << 6) };
+  header[1] += 31 - (header[0] * 256 + header[1]) % 31;
+  uLong checksum = adler[0];
+  for (int strip = 1; strip < strips; strip++)
+    checksum = adler32_combine(checksum, adler[strip], (long) height * (strip + 1) / strips * lineBytes - (long) height * strip / strips * lineBytes);
+  unsigned char trailer[4] = { (unsigned char) (checksum >> 24), (unsigned char) (checksum >> 16),
+                               (unsigned char) (checksum >> 8), (unsigned char) checksum };
+
+  FILE *fp = fopen(fileName, "wb");
+  if (!fp)
+    return false;
+  static const unsigned char SIGNATURE[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+  unsigned char ihdr[13] = { (unsigned char) (width >> 24), (unsigned char) (width >> 16), (unsigned char) (width >> 8), (unsigned char) width,
+                             (unsigned char) (height >> 24), (unsigned char) (height >> 16), (unsigned char) (height >> 8), (unsigned char) height,
+                             8, (unsigned char) (options.rgb ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA), 0, 0, 0 };
+  bool written = fwrite(SIGNATURE, 1, 8, fp) == 8 && _pngChunk(fp, "IHDR", ihdr, 13)
+              && _pngChunk(fp, "IDAT", header, 2);
+  for (int strip = 0; strip < strips && written; strip++)
+    written = coded[strip].empty() || _pngChunk(fp, "IDAT", &coded[strip][0], coded[strip].size());
+  written = written && _pngChunk(fp, "IDAT", trailer, 4) && _pngChunk(fp, "IEND", 0, 0);
+  return fclose(fp) == 0 && written;
+}
+
 // ***** external functions ***** //
 
+PngOptions::PngOptions() :
+  level(Z_DEFAULT_COMPRESSION), filters(PNG_ALL_FILTERS), rgb(false), threads(1) {
+}
+
 // Sets tbe width and height to the appropriate values and mallocs
 // a char *buffer loading up the values in row-major, RGBA format.
 // The memory associated with the buffer can be deallocated with free().
@@ -197,8 +394,17 @@ unsigned char *loadImageRGBA(char *fileName, int *width, int *height) {
 // to the given file name, returns true on success, false otherwise.
 // The image format is RGBA.
 bool saveImageRGBA(char *fileName, unsigned char *buffer, int width, int height) {
-	if (_endsWith(fileName, ".png"))
-		return _saveImageRGBApng(fileName, buffer, width, height);
-	else
+	return saveImageRGBA(fileName, buffer, width, height, PngOptions());
+}
+
+// Saves with the given options, in strips on several threads unless there is
+// only one thread or one row.
+bool saveImageRGBA(char *fileName, unsigned char *buffer, int width, int height, const PngOptions &options) {
+	if (!_endsWith(fileName, ".png"))
 		return false;
+	int strips = options.threads > 0 ? options.threads : std::thread::hardware_concurrency();
+	strips = std::max(1, std::min(strips, height));
+	if (strips == 1)
+		return _saveImageRGBApng(fileName, buffer, width, height, options);
+	return _saveImageRGBApngStrips(fileName, buffer, width, height, options, strips);
 }
@@ -32,20 +32,37 @@
 //
 // COMPILATION
 //
-// Should be compiled with -ltiff and -lpng
+// Should be compiled with -ltiff, -lpng and -lz
 
 // Sets tbe width and height to the appropriate values and mallocs
 // a char *buffer loading up the values in row-major, RGBA format.
 // The memory associated with the buffer can be deallocated with free().
 // If there was an error reading file, then 0 is returned, and
 // width = height = -1. 
-unsigned char *loadImageRGBA(unsigned char *fileName, int *width, int *height);
+unsigned char *loadImageRGBA(char *fileName, int *width, int *height);
 
 // Saves image given by buffer with specicified with and height
 // to the given file name, returns true on success, false otherwise.
 // The image format is RGBA.
 bool saveImageRGBA(char *fileName, unsigned char *buffer, int width, int height);
 
+// How saveImageRGBA writes a png, the defaults give what it always wrote.
+struct PngOptions {
+  int level;      // zlib level, 0 stores, 1 is fastest, Z_DEFAULT_COMPRESSION is 6
+  int filters;    // PNG_FILTER_NONE, _SUB, _UP, _AVG, _PAETH or several ( PNG_ALL_FILTERS ),
+                  // several pick the smallest for each row
+  bool rgb;       // leave out the alpha channel, for opaque images
+  int threads;    // horizontal strips deflated at once, 0 uses every core
+
+  PngOptions();
+};
+
+// The same with options. With more than one thread each strip of rows is filtered and
+// deflated on its own thread, primed with the 32K before it, and the strips are joined
+// into one zlib stream, pigz style: a little larger than one deflate, any png reader
+// reads it.
+bool saveImageRGBA(char *fileName, unsigned char *buffer, int width, int height, const PngOptions &options);
+
 // returns index into image buffer for given coordinate
 #define indxRGBA(X,Y,W) (((Y) * (W) + (X)) * 4)
 
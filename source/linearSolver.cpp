@@ -1,65 +1,144 @@
 #include "linearSolver.h"
+#include "ThreadPool.h"
+#include "Profiler.h"
+#include "Trace.h"
+
+#include <vector>
+#include <algorithm>
+
+// elements per parallel block, fixed so the reduction tree does not depend on the thread count
+#define PARALLEL_BLOCK 4096
 
 // vector helper functions
 
-void vecAddEqual(int n, double r[], double v[])
+template <class Real>
+void vecAddEqual(int n, Real r[], Real v[])
 {
   for (int i = 0; i < n; i++)
     r[i] = r[i] + v[i];
 }
 
-void vecDiffEqual(int n, double r[], double v[])
+template <class Real>
+void vecDiffEqual(int n, Real r[], Real v[])
 {
   for (int i = 0; i < n; i++)
     r[i] = r[i] - v[i];
 }
 
-void vecAssign(int n, double v1[], double v2[])
+template <class Real>
+void vecAssign(int n, Real v1[], Real v2[])
 {
   for (int i = 0; i < n; i++)
     v1[i] = v2[i];
 }
 
-void vecTimesScalar(int n, double v[], double s)
+template <class Real>
+void vecTimesScalar(int n, Real v[], Real s)
 {
   for (int i = 0; i < n; i++)
     v[i] *= s;
 }
 
-double vecDot(int n, double v1[], double v2[])
+template <class Real, class Accum>
+Accum vecDot(int n, Real v1[], Real v2[])
 {
-  double dot = 0;
+  Accum dot = 0;
   for (int i = 0; i < n; i++)
-    dot += v1[i] * v2[i];
+    dot += (Accum) v1[i] * v2[i];
   return dot;
 }
 
-double vecSqrLen(int n, double v[])
+template <class Real, class Accum>
+Accum vecSqrLen(int n, Real v[])
+{
+  return vecDot<Real, Accum>(n, v, v);
+}
+
+template <class Real, class Accum>
+Accum vecDotParallel(int n, Real v1[], Real v2[], ThreadPool *pool, bool deterministic)
+{
+  int blocks = (n + PARALLEL_BLOCK - 1) / PARALLEL_BLOCK;
+  bool parallel = pool && pool->size() >= 2;
+  if (blocks < 2 || (!deterministic && !parallel))
+    return vecDot<Real, Accum>(n, v1, v2);
+
+  if (!deterministic) {
+    std::vector<Accum> partial(pool->size(), 0.0);
+    pool->parallel_for(blocks, [&](int block, int worker) {
+      int begin = block * PARALLEL_BLOCK, end = std::min(n, begin + PARALLEL_BLOCK);
+      partial[worker] += vecDot<Real, Accum>(end - begin, v1 + begin, v2 + begin);
+    });
+    Accum dot = 0;
+    for (int w = 0; w < partial.size(); w++)
+      dot += partial[w];
+    return dot;
+  }
+
+  // the same blocks without a pool, so one thread sums like any other count
+  std::vector<Accum> partial(blocks);
+  auto blockDot = [&](int block) {
+    int begin = block * PARALLEL_BLOCK, end = std::min(n, begin + PARALLEL_BLOCK);
+    partial[block] = vecDot<Real, Accum>(end - begin, v1 + begin, v2 + begin);
+  };
+  if (parallel)
+    pool->parallel_for(blocks, blockDot);
+  else
+    for (int block = 0; block < blocks; block++)
+      blockDot(block);
+
+  // pairwise tree over the blocks, the shape only depends on n
+  for (int width = 1; width < blocks; width *= 2)
+    for (int i = 0; i + width < blocks; i += 2 * width)
+      partial[i] += partial[i + width];
+  return partial[0];
+}
+
+template <class Real, class Accum>
+static Accum vecSqrLenParallel(int n, Real v[], ThreadPool *pool, bool deterministic)
 {
-  return vecDot(n, v, v);
+  return vecDotParallel<Real, Accum>(n, v, v, pool, deterministic);
 }
 
-double ConjGrad(int n, implicitMatrix *A, double x[], double b[], 
+// run "op(begin, end)" over [0, n), in blocks on the pool if there is one
+template <class Op>
+static void forBlocks(int n, ThreadPool *pool, Op op)
+{
+  int blocks = (n + PARALLEL_BLOCK - 1) / PARALLEL_BLOCK;
+  if (!pool || pool->size() < 2 || blocks < 2) {
+    op(0, n);
+    return;
+  }
+  pool->parallel_for(blocks, [&](int block) {
+    int begin = block * PARALLEL_BLOCK;
+    op(begin, std::min(n, begin + PARALLEL_BLOCK));
+  });
+}
+
+template <class Real, class Accum>
+Accum ConjGrad(int n, implicitMatrixT<Real> *A, Real x[], Real b[], 
 		double epsilon,	// how low should we go?
-		int    *steps)
+		int    *steps,
+		ThreadPool *pool, bool deterministic)
 {
+  TRACE_SCOPE("cg solve");
   int		i, iMax;
-  double	alpha, beta, rSqrLen, rSqrLenOld, u;
-
-  double *r = (double *) malloc(sizeof(double) * n);
-  double *d = (double *) malloc(sizeof(double) * n);
-  double *t = (double *) malloc(sizeof(double) * n);
-  double *temp = (double *) malloc(sizeof(double) * n);
+  Accum	alpha, beta, rSqrLen, rSqrLenOld, u;
 
-  vecAssign(n, x, b);
+  Real *r = (Real *) malloc(sizeof(Real) * n);
+  Real *d = (Real *) malloc(sizeof(Real) * n);
+  Real *t = (Real *) malloc(sizeof(Real) * n);
+  Real *temp = (Real *) malloc(sizeof(Real) * n);
 
-  vecAssign(n, r, b);
+  forBlocks(n, pool, [&](int s, int e) {
+    vecAssign(e - s, x + s, b + s);
+    vecAssign(e - s, r + s, b + s);
+  });
   A->matVecMult(x, temp);
-  vecDiffEqual(n, r, temp);
+  forBlocks(n, pool, [&](int s, int e) { vecDiffEqual(e - s, r + s, temp + s); });
 
-  rSqrLen = vecSqrLen(n, r);
+  rSqrLen = vecSqrLenParallel<Real, Accum>(n, r, pool, deterministic);
 
-  vecAssign(n, d, r);
+  forBlocks(n, pool, [&](int s, int e) { vecAssign(e - s, d + s, r + s); });
 
   i = 0;
   if (*steps)
@@ -69,9 +148,11 @@ double ConjGrad(int n, implicitMatrix *A, double x[], double b[],
 		
   if (rSqrLen > epsilon)
     while (i < iMax) {	
+      PROFILE_SCOPE(PHASE_CG_ITERATION);
+      PROFILE_COUNT(COUNTER_CG_ITERATIONS, 1);
       i++;
       A->matVecMult(d, t);
-      u = vecDot(n, d, t);
+      u = vecDotParallel<Real, Accum>(n, d, t, pool, deterministic);
       
       if (u == 0) {
 	printf("(SolveConjGrad) d'Ad = 0\n");
@@ -82,23 +163,27 @@ double ConjGrad(int n, implicitMatrix *A, double x[], double b[],
       alpha = rSqrLen / u;
       
       // Take a step along direction d
-      vecAssign(n, temp, d);
-      vecTimesScalar(n, temp, alpha);
-      vecAddEqual(n, x, temp);
+      forBlocks(n, pool, [&](int s, int e) {
+        vecAssign(e - s, temp + s, d + s);
+        vecTimesScalar(e - s, temp + s, (Real) alpha);
+        vecAddEqual(e - s, x + s, temp + s);
+      });
       
       if (i & 0x3F) {
-	vecAssign(n, temp, t);
-	vecTimesScalar(n, temp, alpha);
-	vecDiffEqual(n, r, temp);
+	forBlocks(n, pool, [&](int s, int e) {
+	  vecAssign(e - s, temp + s, t + s);
+	  vecTimesScalar(e - s, temp + s, (Real) alpha);
+	  vecDiffEqual(e - s, r + s, temp + s);
+	});
       } else {
 	// For stability, correct r every 64th iteration
-	vecAssign(n, r, b);
+	forBlocks(n, pool, [&](int s, int e) { vecAssign(e - s, r + s, b + s); });
 	A->matVecMult(x, temp);
-	vecDiffEqual(n, r, temp);
+	forBlocks(n, pool, [&](int s, int e) { vecDiffEqual(e - s, r + s, temp + s); });
       }
       
       rSqrLenOld = rSqrLen;
-      rSqrLen = vecSqrLen(n, r);
+      rSqrLen = vecSqrLenParallel<Real, Accum>(n, r, pool, deterministic);
       
       // Converged! Let's get out of here
       if (rSqrLen <= epsilon)
@@ -106,8 +191,10 @@ double ConjGrad(int n, implicitMatrix *A, double x[], double b[],
       
       // Change direction: d = r + beta * d
       beta = rSqrLen/rSqrLenOld;
-      vecTimesScalar(n, d, beta);
-      vecAddEqual(n, d, r);
+      forBlocks(n, pool, [&](int s, int e) {
+        vecTimesScalar(e - s, d + s, (Real) beta);
+        vecAddEqual(e - s, d + s, r + s);
+      });
     }
   
   // free memory
@@ -121,4 +208,24 @@ double ConjGrad(int n, implicitMatrix *A, double x[], double b[],
   return(rSqrLen);
 }
 
-
+// float, double and mixed ( float vectors, double reductions )
+template void vecAddEqual(int, float[], float[]);
+template void vecAddEqual(int, double[], double[]);
+template void vecDiffEqual(int, float[], float[]);
+template void vecDiffEqual(int, double[], double[]);
+template void vecAssign(int, float[], float[]);
+template void vecAssign(int, double[], double[]);
+template void vecTimesScalar(int, float[], float);
+template void vecTimesScalar(int, double[], double);
+template float vecDot<float, float>(int, float[], float[]);
+template double vecDot<double, double>(int, double[], double[]);
+template double vecDot<float, double>(int, float[], float[]);
+template float vecSqrLen<float, float>(int, float[]);
+template double vecSqrLen<double, double>(int, double[]);
+template double vecSqrLen<float, double>(int, float[]);
+template float vecDotParallel<float, float>(int, float[], float[], ThreadPool *, bool);
+template double vecDotParallel<double, double>(int, double[], double[], ThreadPool *, bool);
+template double vecDotParallel<float, double>(int, float[], float[], ThreadPool *, bool);
+template float ConjGrad<float, float>(int, implicitMatrixT<float> *, float[], float[], double, int *, ThreadPool *, bool);
+template double ConjGrad<double, double>(int, implicitMatrixT<double> *, double[], double[], double, int *, ThreadPool *, bool);
+template double ConjGrad<float, double>(int, implicitMatrixT<float> *, float[], float[], double, int *, ThreadPool *, bool);
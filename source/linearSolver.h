@@ -6,25 +6,32 @@
 #include <stddef.h>
 #include <stdlib.h>
 
+class ThreadPool;
+
 // Karen's CGD
 
 #define MAX_STEPS 100
 
 // Matrix class the solver will accept
-class implicitMatrix
+template <class Real>
+class implicitMatrixT
 {
  public:
-  virtual void matVecMult(double x[], double r[]) = 0;
+  virtual void matVecMult(Real x[], Real r[]) = 0;
 };
 
 // Matrix class the solver will accept
-class implicitMatrixWithTrans : public implicitMatrix
+template <class Real>
+class implicitMatrixWithTransT : public implicitMatrixT<Real>
 {
  public:
-  virtual void matVecMult(double x[], double r[]) = 0;
-  virtual void matTransVecMult(double x[], double r[]) = 0;
+  virtual void matVecMult(Real x[], Real r[]) = 0;
+  virtual void matTransVecMult(Real x[], Real r[]) = 0;
 };
 
+typedef implicitMatrixT<double> implicitMatrix;
+typedef implicitMatrixWithTransT<double> implicitMatrixWithTrans;
+
 
 
 // Solve Ax = b for a symmetric, positive definite matrix A
@@ -34,16 +41,29 @@ class implicitMatrixWithTrans : public implicitMatrix
 // "epsilon" is the error tolerance
 // "steps", as passed, is the maximum number of steps, or 0 (implying MAX_STEPS)
 // Upon completion, "steps" contains the number of iterations taken
-double ConjGrad(int n, implicitMatrix *A, double x[], double b[], 
+// With a "pool" the vector operations are split over its threads; "deterministic"
+// reductions give the same result for any thread count, with or without a pool,
+// otherwise every thread keeps its own partial sum and the result may vary run to run
+// Vectors hold "Real" (float or double); dot products and residuals are summed in
+// "Accum", so ConjGrad<float, double> is float storage with double reductions
+template <class Real, class Accum = Real>
+Accum ConjGrad(int n, implicitMatrixT<Real> *A, Real x[], Real b[], 
 		double epsilon,	// how low should we go?
-		int    *steps);
+		int    *steps,
+		ThreadPool *pool = NULL, bool deterministic = true);
 
 // Some vector helper functions
-void vecAddEqual(int n, double r[], double v[]);
-void vecDiffEqual(int n, double r[], double v[]);
-void vecAssign(int n, double v1[], double v2[]);
-void vecTimesScalar(int n, double v[], double s);
-double vecDot(int n, double v1[], double v2[]);
-double vecSqrLen(int n, double v[]);
+template <class Real> void vecAddEqual(int n, Real r[], Real v[]);
+template <class Real> void vecDiffEqual(int n, Real r[], Real v[]);
+template <class Real> void vecAssign(int n, Real v1[], Real v2[]);
+template <class Real> void vecTimesScalar(int n, Real v[], Real s);
+template <class Real, class Accum = Real> Accum vecDot(int n, Real v1[], Real v2[]);
+template <class Real, class Accum = Real> Accum vecSqrLen(int n, Real v[]);
+
+// dot product over fixed blocks, summed pairwise in block order ( deterministic )
+// or as per-thread partial sums ( fast ), which falls back to vecDot without a pool;
+// vectors of one block are always a plain vecDot
+template <class Real, class Accum = Real>
+Accum vecDotParallel(int n, Real v1[], Real v2[], ThreadPool *pool, bool deterministic);
 
 #endif